@@ -0,0 +1,74 @@
+//! Test archives and timing shared by the benchmarks.
+
+#![allow(dead_code)]
+
+use std::path::Path;
+use std::time::{Duration, Instant};
+
+use comic_archive::ZipImageArchive;
+
+/// How long each measurement runs for, after one warm-up pass.
+pub const MEASURE_FOR: Duration = Duration::from_secs(2);
+
+/// An empty ZIP archive: only the end of central directory record.
+const EMPTY_ZIP: [u8; 22] = [
+    0x50, 0x4b, 0x05, 0x06, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+];
+
+/// Write a CBZ at `path` holding `pages` stored pages of `page_len` bytes, and return the
+/// page names. The contents do not compress, like the JPEGs of a real comic.
+pub fn write_cbz(path: &Path, pages: usize, page_len: usize) -> Vec<String> {
+    std::fs::write(path, EMPTY_ZIP).unwrap();
+    let names: Vec<String> = (0..pages).map(|i| format!("page{:04}.jpg", i)).collect();
+    let data: Vec<Vec<u8>> = (0..pages).map(|i| page_bytes(i as u64, page_len)).collect();
+    let files: Vec<(&str, &[u8])> = names
+        .iter()
+        .zip(&data)
+        .map(|(name, data)| (name.as_str(), data.as_slice()))
+        .collect();
+    ZipImageArchive::new(path)
+        .unwrap()
+        .append_files(&files)
+        .unwrap();
+    names
+}
+
+/// A JPEG signature followed by xorshift noise.
+pub fn page_bytes(seed: u64, len: usize) -> Vec<u8> {
+    let mut state = seed.wrapping_mul(0x9E37_79B9_7F4A_7C15) | 1;
+    let mut data: Vec<u8> = (0..len)
+        .map(|_| {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            state as u8
+        })
+        .collect();
+    data[..4].copy_from_slice(&[0xFF, 0xD8, 0xFF, 0xE0]);
+    data
+}
+
+/// Read every page with `read`, which returns the page length, over and over for
+/// `MEASURE_FOR`. Prints and returns the mean time per read.
+pub fn bench(label: &str, names: &[String], mut read: impl FnMut(&str) -> usize) -> Duration {
+    for name in names {
+        read(name);
+    }
+    let started = Instant::now();
+    let (mut reads, mut bytes) = (0u64, 0u64);
+    while started.elapsed() < MEASURE_FOR {
+        for name in names {
+            bytes += read(name) as u64;
+            reads += 1;
+        }
+    }
+    let elapsed = started.elapsed();
+    let per_read = elapsed / reads as u32;
+    println!(
+        "  {:<36} {:>10.1?}/read {:>9.0} MiB/s",
+        label,
+        per_read,
+        bytes as f64 / elapsed.as_secs_f64() / (1024.0 * 1024.0)
+    );
+    per_read
+}
@@ -0,0 +1,129 @@
+//! Time to the first page of a CBR: `RarImageArchive`, which streams the page from
+//! `unrar p`, against extracting it to a temporary directory and reading it back, as reads
+//! used to. Pages at the start, middle and end of the archive are timed, on a fresh
+//! archive each time so nothing is cached, for a normal and a solid archive.
+//!
+//! Needs `unrar`, and `rar` to build the test archives. To time an existing archive
+//! instead, set `COMIC_BENCH_CBR` to its path.
+//!
+//! ```text
+//! cargo bench -p comic_archive --features rar --bench rar_first_page
+//! ```
+
+mod common;
+
+use std::path::{Path, PathBuf};
+use std::process::{Command, Stdio};
+use std::time::{Duration, Instant};
+
+use comic_archive::RarImageArchive;
+use comic_archive::prelude::*;
+
+const PAGES: usize = 100;
+const PAGE_LEN: usize = 256 * 1024;
+/// Runs per page and path; the median is reported.
+const RUNS: usize = 5;
+
+/// The read path before streaming: `unrar x` into a temporary directory, then read the
+/// file back.
+fn extract_to_temp(path: &Path, name: &str) -> Duration {
+    let started = Instant::now();
+    let dir = tempfile::tempdir().unwrap();
+    let mut dest = dir.path().as_os_str().to_owned();
+    dest.push(std::path::MAIN_SEPARATOR_STR);
+    let status = Command::new("unrar")
+        .args(["x", "-y", "-inul"])
+        .arg(path)
+        .arg(name)
+        .arg(dest)
+        .status()
+        .unwrap();
+    assert!(status.success(), "unrar x failed");
+    std::fs::read(dir.path().join(name)).unwrap();
+    started.elapsed()
+}
+
+/// A read through a freshly opened `RarImageArchive`. Opening lists the archive, which
+/// both paths need alike, so only the read is timed.
+fn stream(path: &Path, name: &str) -> Duration {
+    let archive = RarImageArchive::new(path).unwrap();
+    let started = Instant::now();
+    #[cfg(feature = "async")]
+    archive.read_image_by_name_sync(name).unwrap();
+    #[cfg(not(feature = "async"))]
+    archive.read_image_by_name(name).unwrap();
+    started.elapsed()
+}
+
+fn median(mut runs: Vec<Duration>) -> Duration {
+    runs.sort();
+    runs[runs.len() / 2]
+}
+
+/// Build a CBR of noise pages with `rar`, solid or not.
+fn write_cbr(dir: &Path, solid: bool) -> Option<PathBuf> {
+    let pages = dir.join(if solid { "solid" } else { "plain" });
+    std::fs::create_dir_all(&pages).unwrap();
+    for i in 0..PAGES {
+        let name = pages.join(format!("page{:04}.jpg", i));
+        std::fs::write(name, common::page_bytes(i as u64, PAGE_LEN)).unwrap();
+    }
+    let archive = pages.with_extension("cbr");
+    let mut cmd = Command::new("rar");
+    cmd.args(["a", "-inul", "-ep1", "-m1"]);
+    if solid {
+        cmd.arg("-s");
+    }
+    let status = cmd
+        .arg(&archive)
+        .arg(pages.join("*"))
+        .stdout(Stdio::null())
+        .status();
+    match status {
+        Ok(status) if status.success() => Some(archive),
+        _ => None,
+    }
+}
+
+fn time_archive(label: &str, path: &Path) {
+    let archive = RarImageArchive::new(path).expect("unrar lists the archive");
+    let names: Vec<String> = archive
+        .pages()
+        .iter()
+        .map(|page| page.name.clone())
+        .collect();
+    println!("{} ({} pages)", label, names.len());
+    for (at, name) in [
+        ("first", names.first()),
+        ("middle", names.get(names.len() / 2)),
+        ("last", names.last()),
+    ] {
+        let Some(name) = name else { continue };
+        let extract = median((0..RUNS).map(|_| extract_to_temp(path, name)).collect());
+        let streamed = median((0..RUNS).map(|_| stream(path, name)).collect());
+        println!(
+            "  {:<6} page: extract to temp {:>9.1?}, stream {:>9.1?} ({:.1}x)",
+            at,
+            extract,
+            streamed,
+            extract.as_secs_f64() / streamed.as_secs_f64()
+        );
+    }
+}
+
+fn main() {
+    if let Some(path) = std::env::var_os("COMIC_BENCH_CBR") {
+        time_archive("COMIC_BENCH_CBR", Path::new(&path));
+        return;
+    }
+    let dir = tempfile::tempdir().unwrap();
+    for (label, solid) in [("Normal archive", false), ("Solid archive", true)] {
+        match write_cbr(dir.path(), solid) {
+            Some(path) => time_archive(label, &path),
+            None => {
+                println!("`rar` is not available; set COMIC_BENCH_CBR to time an archive");
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,53 @@
+//! Page reads from a CBZ: opening the archive through the `zip` crate for every page, as
+//! reads used to, against `ZipImageArchive`, which keeps the file open and its central
+//! directory indexed. Reads are positional unless built with `--features mmap`.
+//!
+//! ```text
+//! cargo bench -p comic_archive --bench zip_read [--features mmap]
+//! ```
+
+mod common;
+
+use std::fs::File;
+use std::io::Read;
+use std::path::Path;
+
+use comic_archive::ZipImageArchive;
+
+/// (pages, page size) of the archives read.
+const ARCHIVES: [(usize, usize); 3] = [(24, 2 * 1024 * 1024), (200, 256 * 1024), (1000, 32 * 1024)];
+
+/// The read path before the index: open, parse the central directory, find the entry.
+fn read_reopening(path: &Path, name: &str) -> usize {
+    let mut zip = zip::read::ZipArchive::new(File::open(path).unwrap()).unwrap();
+    let mut entry = zip.by_name(name).unwrap();
+    let mut buf = Vec::with_capacity(entry.size() as usize);
+    entry.read_to_end(&mut buf).unwrap();
+    buf.len()
+}
+
+fn main() {
+    let dir = tempfile::tempdir().unwrap();
+    let indexed = if cfg!(feature = "mmap") {
+        "ZipImageArchive, mapped"
+    } else {
+        "ZipImageArchive, pread"
+    };
+    for (pages, page_len) in ARCHIVES {
+        let path = dir.path().join(format!("{pages}.cbz"));
+        let names = common::write_cbz(&path, pages, page_len);
+        println!("{} pages of {} KiB", pages, page_len / 1024);
+
+        let before = common::bench("zip crate, reopened per read", &names, |name| {
+            read_reopening(&path, name)
+        });
+        let archive = ZipImageArchive::new(&path).unwrap();
+        let after = common::bench(indexed, &names, |name| {
+            archive.read_file_by_name_sync(name).unwrap().len()
+        });
+        println!(
+            "  {:.1}x faster",
+            before.as_secs_f64() / after.as_secs_f64()
+        );
+    }
+}
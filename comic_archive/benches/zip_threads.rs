@@ -0,0 +1,69 @@
+//! Read throughput of one shared `ZipImageArchive` as reader threads are added. Reads are
+//! positional (or mapped, with `--features mmap`) and take `&self`, so throughput should
+//! grow with the thread count until the disk or memory bandwidth runs out.
+//!
+//! ```text
+//! cargo bench -p comic_archive --bench zip_threads [--features mmap]
+//! ```
+
+mod common;
+
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Instant;
+
+use comic_archive::ZipImageArchive;
+
+const PAGES: usize = 200;
+const PAGE_LEN: usize = 256 * 1024;
+
+fn main() {
+    let dir = tempfile::tempdir().unwrap();
+    let path = dir.path().join("threads.cbz");
+    let names = common::write_cbz(&path, PAGES, PAGE_LEN);
+    let archive = ZipImageArchive::new(&path).unwrap();
+    for name in &names {
+        archive.read_file_by_name_sync(name).unwrap();
+    }
+
+    let cores = std::thread::available_parallelism().map_or(4, |n| n.get());
+    let counts: Vec<usize> = std::iter::successors(Some(1), |&n| Some(n * 2))
+        .take_while(|&n| n <= cores * 2)
+        .collect();
+    println!(
+        "{} pages of {} KiB, {} cores",
+        PAGES,
+        PAGE_LEN / 1024,
+        cores
+    );
+
+    let mut single = 0.0;
+    for threads in counts {
+        let bytes = AtomicU64::new(0);
+        let started = Instant::now();
+        std::thread::scope(|scope| {
+            for thread in 0..threads {
+                let (archive, names, bytes) = (&archive, &names, &bytes);
+                scope.spawn(move || {
+                    // Each thread starts at a different page, so they do not read in step.
+                    let start = thread * names.len() / threads;
+                    while started.elapsed() < common::MEASURE_FOR {
+                        for name in names[start..].iter().chain(&names[..start]) {
+                            let page = archive.read_file_by_name_sync(name).unwrap();
+                            bytes.fetch_add(page.len() as u64, Ordering::Relaxed);
+                        }
+                    }
+                });
+            }
+        });
+        let rate = bytes.into_inner() as f64 / started.elapsed().as_secs_f64() / (1024.0 * 1024.0);
+        if threads == 1 {
+            single = rate;
+        }
+        println!(
+            "  {:>3} threads {:>9.0} MiB/s {:>6.2}x",
+            threads,
+            rate,
+            rate / single
+        );
+    }
+}
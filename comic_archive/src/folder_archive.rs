@@ -1,12 +1,232 @@
+use std::collections::{BTreeMap, HashMap};
 use std::io::Read;
 use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Mutex, RwLock};
+use std::time::{Duration, Instant};
 
 use crate::error::ArchiveError;
-use crate::model::Manifest;
+use crate::model::{EntryInfo, Manifest, PageTable};
 use crate::{ImageArchiveTrait, is_supported_format};
+use bytes::Bytes;
 
+/// An archive backend for a directory of images, including images in nested folders.
+///
+/// The directory tree is indexed once when opened. With the `watch` feature, the index is
+/// then kept current from filesystem notifications, so pages added while the folder is
+/// open (e.g. by a download in progress) show up without rescanning. A file being written
+/// is only indexed once it is closed or has not changed for `SETTLE`, and a page whose
+/// data changes is indexed again with its new size.
 pub struct FolderImageArchive {
     pub path: PathBuf,
+    index: Arc<FolderIndex>,
+    /// Stops watching when the archive is dropped.
+    #[cfg(feature = "watch")]
+    _watcher: Option<notify::RecommendedWatcher>,
+}
+
+/// How long a file must go without changes before it is taken to be completely written,
+/// for platforms that do not report when a file written to is closed.
+const SETTLE: Duration = Duration::from_millis(500);
+
+/// The pages under a folder, keyed by their path relative to it with `/` separators. The
+/// sorted page table is rebuilt from the map on the first `pages()` call after a change,
+/// so a burst of notifications costs one rebuild.
+struct FolderIndex {
+    entries: Mutex<BTreeMap<String, EntryInfo>>,
+    table: RwLock<PageTable>,
+    dirty: AtomicBool,
+    /// Files being written, with when they last changed. They are indexed once closed or
+    /// settled.
+    writing: Mutex<HashMap<PathBuf, Instant>>,
+}
+
+impl FolderIndex {
+    fn table(&self, root: &Path) -> PageTable {
+        self.settle(root);
+        if self.dirty.load(Ordering::Acquire) {
+            // `dirty` is only set under the entries lock, and the table is built and
+            // stored under it, so a table built from older entries never replaces one
+            // built from newer entries.
+            let entries = self.entries.lock().unwrap();
+            if self.dirty.swap(false, Ordering::AcqRel) {
+                let table: PageTable = entries.values().cloned().collect();
+                *self.table.write().unwrap() = table.clone();
+                return table;
+            }
+        }
+        self.table.read().unwrap().clone()
+    }
+
+    /// Index a written or renamed-in file, or everything under a directory. A file already
+    /// indexed is replaced, with its current size.
+    fn add_path(&self, root: &Path, path: &Path) {
+        let mut found = BTreeMap::new();
+        if path.is_dir() {
+            scan(root, path, &mut found);
+        } else if path.is_file() {
+            if let Some(mut entry) = page_entry(root, path) {
+                entry.size = path.metadata().map_or(0, |meta| meta.len());
+                found.insert(entry.name.clone(), entry);
+            }
+        }
+        if !found.is_empty() {
+            log::debug!("{} pages indexed under {:?}", found.len(), path);
+            let mut entries = self.entries.lock().unwrap();
+            entries.extend(found);
+            self.dirty.store(true, Ordering::Release);
+        }
+    }
+
+    /// Note that a page file is being written; it is indexed once it settles.
+    #[cfg(feature = "watch")]
+    fn writing(&self, root: &Path, path: &Path) {
+        if path.is_dir() {
+            self.add_path(root, path);
+        } else if page_entry(root, path).is_some() {
+            self.writing
+                .lock()
+                .unwrap()
+                .insert(path.to_path_buf(), Instant::now());
+        }
+    }
+
+    /// Index a file that is done being written.
+    #[cfg(feature = "watch")]
+    fn written(&self, root: &Path, path: &Path) {
+        if self.writing.lock().unwrap().remove(path).is_some() {
+            self.add_path(root, path);
+        }
+    }
+
+    /// Index the files that have not changed for `SETTLE`.
+    fn settle(&self, root: &Path) {
+        let settled: Vec<PathBuf> = {
+            let mut writing = self.writing.lock().unwrap();
+            if writing.is_empty() {
+                return;
+            }
+            let settled = writing
+                .iter()
+                .filter(|(_, changed)| changed.elapsed() >= SETTLE)
+                .map(|(path, _)| path.clone())
+                .collect::<Vec<_>>();
+            for path in &settled {
+                writing.remove(path);
+            }
+            settled
+        };
+        for path in settled {
+            self.add_path(root, &path);
+        }
+    }
+
+    /// Drop a removed or renamed-away file, or everything under a directory.
+    fn remove_path(&self, root: &Path, path: &Path) {
+        self.writing
+            .lock()
+            .unwrap()
+            .retain(|pending, _| !pending.starts_with(path));
+        let Some(name) = relative_name(root, path) else {
+            return;
+        };
+        let mut entries = self.entries.lock().unwrap();
+        let prefix = format!("{name}/");
+        let mut removed: Vec<String> = entries
+            .range(prefix.clone()..)
+            .take_while(|(key, _)| key.starts_with(&prefix))
+            .map(|(key, _)| key.clone())
+            .collect();
+        removed.push(name);
+        let mut changed = false;
+        for key in removed {
+            changed |= entries.remove(&key).is_some();
+        }
+        if changed {
+            self.dirty.store(true, Ordering::Release);
+        }
+    }
+
+    #[cfg(feature = "watch")]
+    fn apply(&self, root: &Path, event: notify::Event) {
+        use notify::EventKind;
+        use notify::event::{AccessKind, AccessMode, ModifyKind, RenameMode};
+
+        match event.kind {
+            // A new or changed file may still be partly written.
+            EventKind::Create(_) | EventKind::Modify(ModifyKind::Data(_) | ModifyKind::Any) => {
+                for path in &event.paths {
+                    self.writing(root, path);
+                }
+            }
+            EventKind::Access(AccessKind::Close(AccessMode::Write)) => {
+                for path in &event.paths {
+                    self.written(root, path);
+                }
+            }
+            EventKind::Modify(ModifyKind::Name(RenameMode::To)) => {
+                for path in &event.paths {
+                    self.add_path(root, path);
+                }
+            }
+            EventKind::Remove(_) | EventKind::Modify(ModifyKind::Name(RenameMode::From)) => {
+                for path in &event.paths {
+                    self.remove_path(root, path);
+                }
+            }
+            EventKind::Modify(ModifyKind::Name(RenameMode::Both)) => {
+                if let [from, to] = &event.paths[..] {
+                    self.remove_path(root, from);
+                    self.add_path(root, to);
+                }
+            }
+            // Platforms that cannot pair renames only say that the name changed.
+            EventKind::Modify(ModifyKind::Name(_)) => {
+                for path in &event.paths {
+                    if path.exists() {
+                        self.add_path(root, path);
+                    } else {
+                        self.remove_path(root, path);
+                    }
+                }
+            }
+            _ => {}
+        }
+    }
+}
+
+/// The name of `path` relative to `root`, with `/` separators on every platform.
+fn relative_name(root: &Path, path: &Path) -> Option<String> {
+    let relative = path.strip_prefix(root).ok()?;
+    let parts: Option<Vec<&str>> = relative.iter().map(|part| part.to_str()).collect();
+    Some(parts?.join("/"))
+}
+
+fn page_entry(root: &Path, path: &Path) -> Option<EntryInfo> {
+    let name = relative_name(root, path)?;
+    is_supported_format!(&name).then(|| EntryInfo::from_name(name))
+}
+
+/// Index the supported images under `dir`, recursively. The directory entry's own type
+/// decides between file and folder, so only symlinks cost an extra stat; symlinked
+/// folders are not followed, which rules out cycles. Sizes are left unknown.
+fn scan(root: &Path, dir: &Path, found: &mut BTreeMap<String, EntryInfo>) {
+    let Ok(entries) = std::fs::read_dir(dir) else {
+        return;
+    };
+    for entry in entries.flatten() {
+        let Ok(file_type) = entry.file_type() else {
+            continue;
+        };
+        let path = entry.path();
+        if file_type.is_dir() {
+            scan(root, &path, found);
+        } else if file_type.is_file() || (file_type.is_symlink() && path.is_file()) {
+            if let Some(entry) = page_entry(root, &path) {
+                found.insert(entry.name.clone(), entry);
+            }
+        }
+    }
 }
 
 impl FolderImageArchive {
@@ -14,47 +234,80 @@ impl FolderImageArchive {
         if !path.is_dir() {
             return Err(ArchiveError::UnsupportedArchive);
         }
+        let mut entries = BTreeMap::new();
+        scan(path, path, &mut entries);
+        log::info!("Indexed {} pages under {:?}", entries.len(), path);
+        let index = Arc::new(FolderIndex {
+            table: RwLock::new(entries.values().cloned().collect()),
+            entries: Mutex::new(entries),
+            dirty: AtomicBool::new(false),
+            writing: Mutex::new(HashMap::new()),
+        });
+
         Ok(Self {
             path: path.to_path_buf(),
+            #[cfg(feature = "watch")]
+            _watcher: Self::watch(path, index.clone()),
+            index,
         })
     }
 
+    /// Watch the folder recursively, feeding changes into `index`. Pages added between the
+    /// scan and the watch starting are only picked up once the folder is reopened.
+    #[cfg(feature = "watch")]
+    fn watch(path: &Path, index: Arc<FolderIndex>) -> Option<notify::RecommendedWatcher> {
+        use notify::Watcher;
+
+        let root = path.to_path_buf();
+        let watcher =
+            notify::recommended_watcher(move |event: notify::Result<notify::Event>| match event {
+                Ok(event) => index.apply(&root, event),
+                Err(e) => log::warn!("Folder watch error: {}", e),
+            });
+        let mut watcher = match watcher {
+            Ok(watcher) => watcher,
+            Err(e) => {
+                log::warn!("Cannot watch {:?}: {}", path, e);
+                return None;
+            }
+        };
+        if let Err(e) = watcher.watch(path, notify::RecursiveMode::Recursive) {
+            log::warn!("Cannot watch {:?}: {}", path, e);
+            return None;
+        }
+        Some(watcher)
+    }
+
     fn manifest_path(&self) -> PathBuf {
         self.path.join("manifest.toml")
     }
+
+    pub(crate) fn read_manifest_string_sync(&self) -> Result<String, ArchiveError> {
+        std::fs::read_to_string(self.manifest_path()).map_err(|e| match e.kind() {
+            std::io::ErrorKind::NotFound => ArchiveError::ManifestNotFound,
+            _ => ArchiveError::IoError(format!("Failed to read manifest: {}", e)),
+        })
+    }
 }
 
 #[cfg(feature = "async")]
 #[async_trait::async_trait]
 impl ImageArchiveTrait for FolderImageArchive {
-    fn list_images(&self) -> Vec<String> {
-        let mut files = Vec::new();
-        if let Ok(entries) = std::fs::read_dir(&self.path) {
-            for entry in entries.flatten() {
-                let path = entry.path();
-                if path.is_file() {
-                    let name = path.file_name().unwrap().to_string_lossy().to_string();
-                    if is_supported_format!(&name) {
-                        files.push(name);
-                    }
-                }
-            }
-        }
-        files.sort();
-        files
+    fn pages(&self) -> PageTable {
+        self.index.table(&self.path)
     }
 
-    fn read_image_by_name_sync(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
+    fn read_image_by_name_sync(&self, filename: &str) -> Result<Bytes, ArchiveError> {
         let img_path = self.path.join(filename);
         let mut file = std::fs::File::open(&img_path)
             .map_err(|e| ArchiveError::IoError(format!("Failed to open image: {}", e)))?;
         let mut buf = Vec::new();
         file.read_to_end(&mut buf)
             .map_err(|e| ArchiveError::IoError(format!("Failed to read image: {}", e)))?;
-        Ok(buf)
+        Ok(buf.into())
     }
 
-    async fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
+    async fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
         use tokio::fs::File;
         use tokio::io::AsyncReadExt;
 
@@ -66,7 +319,7 @@ impl ImageArchiveTrait for FolderImageArchive {
         file.read_to_end(&mut buf)
             .await
             .map_err(|e| ArchiveError::IoError(format!("Failed to read image: {}", e)))?;
-        Ok(buf)
+        Ok(buf.into())
     }
 
     async fn read_manifest_string(&self) -> Result<String, ArchiveError> {
@@ -89,7 +342,7 @@ impl ImageArchiveTrait for FolderImageArchive {
         toml::from_str(&s).map_err(|e| ArchiveError::ManifestParseError(e.to_string()))
     }
 
-    async fn write_manifest(&mut self, manifest: &Manifest) -> Result<(), ArchiveError> {
+    async fn write_manifest(&self, manifest: &Manifest) -> Result<(), ArchiveError> {
         use tokio::fs;
         let manifest_path = self.manifest_path();
         let s = toml::to_string_pretty(manifest)
@@ -102,41 +355,22 @@ impl ImageArchiveTrait for FolderImageArchive {
 
 #[cfg(not(feature = "async"))]
 impl ImageArchiveTrait for FolderImageArchive {
-    fn list_images(&self) -> Vec<String> {
-        let mut files = Vec::new();
-        if let Ok(entries) = fs::read_dir(&self.path) {
-            for entry in entries.flatten() {
-                let path = entry.path();
-                if path.is_file() {
-                    let name = path.file_name().unwrap().to_string_lossy().to_string();
-                    if is_supported_format!(&name) {
-                        files.push(name);
-                    }
-                }
-            }
-        }
-        files.sort();
-        files
+    fn pages(&self) -> PageTable {
+        self.index.table(&self.path)
     }
 
-    fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
+    fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
         let img_path = self.path.join(filename);
         let mut file = std::fs::File::open(&img_path)
             .map_err(|e| ArchiveError::IoError(format!("Failed to open image: {}", e)))?;
         let mut buf = Vec::new();
         file.read_to_end(&mut buf)
             .map_err(|e| ArchiveError::IoError(format!("Failed to read image: {}", e)))?;
-        Ok(buf)
+        Ok(buf.into())
     }
 
     fn read_manifest_string(&self) -> Result<String, ArchiveError> {
-        let manifest_path = self.manifest_path();
-        let mut file =
-            fs::File::open(&manifest_path).map_err(|_| ArchiveError::ManifestNotFound)?;
-        let mut s = String::new();
-        file.read_to_string(&mut s)
-            .map_err(|e| ArchiveError::IoError(format!("Failed to read manifest: {}", e)))?;
-        Ok(s)
+        self.read_manifest_string_sync()
     }
 
     fn read_manifest(&self) -> Result<Manifest, ArchiveError> {
@@ -144,11 +378,11 @@ impl ImageArchiveTrait for FolderImageArchive {
         toml::from_str(&s).map_err(|e| ArchiveError::ManifestParseError(e.to_string()))
     }
 
-    fn write_manifest(&mut self, manifest: &Manifest) -> Result<(), ArchiveError> {
+    fn write_manifest(&self, manifest: &Manifest) -> Result<(), ArchiveError> {
         let manifest_path = self.manifest_path();
         let s = toml::to_string_pretty(manifest)
             .map_err(|e| ArchiveError::ManifestParseError(e.to_string()))?;
-        fs::write(&manifest_path, s)
+        std::fs::write(&manifest_path, s)
             .map_err(|e| ArchiveError::IoError(format!("Failed to write manifest: {}", e)))
     }
 }
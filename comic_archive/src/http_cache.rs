@@ -0,0 +1,296 @@
+//! On-disk cache for pages fetched over HTTP.
+//!
+//! Each URL is stored as two files named after a hash of the URL: the body, and a small
+//! TOML record of the validators and freshness the server sent with it. Fresh entries are
+//! served without a request; stale ones are revalidated with `If-None-Match` /
+//! `If-Modified-Since`, so an unchanged page costs a 304 rather than a download. When the
+//! network fails, the stale body is served instead, which keeps cached comics readable
+//! offline. The cache is kept under a byte budget by deleting the least recently used
+//! entries; the body's modification time records its last use across runs.
+
+use std::collections::HashMap;
+use std::fs::{self, File};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Mutex, OnceLock};
+use std::time::{SystemTime, UNIX_EPOCH};
+
+use bytes::Bytes;
+use reqwest::header::{
+    CACHE_CONTROL, ETAG, HeaderMap, HeaderValue, IF_MODIFIED_SINCE, IF_NONE_MATCH, LAST_MODIFIED,
+};
+use serde::{Deserialize, Serialize};
+
+use crate::model::CacheStats;
+
+/// What the server said about a cached response.
+#[derive(Debug, Clone, Default, Serialize, Deserialize)]
+pub(crate) struct CacheMeta {
+    pub url: String,
+    pub etag: Option<String>,
+    pub last_modified: Option<String>,
+    /// Unix time the response was stored or last revalidated.
+    pub stored_at: u64,
+    /// `max-age` in seconds; without one the entry is revalidated on every use.
+    pub max_age: Option<u64>,
+    /// `no-cache`: always revalidate.
+    pub no_cache: bool,
+    /// `immutable`: never revalidate.
+    pub immutable: bool,
+}
+
+impl CacheMeta {
+    /// Read the caching headers of a response. `None` if it must not be stored.
+    pub fn from_headers(url: &str, headers: &HeaderMap) -> Option<Self> {
+        let mut meta = CacheMeta {
+            url: url.to_string(),
+            etag: header_string(headers, ETAG),
+            last_modified: header_string(headers, LAST_MODIFIED),
+            stored_at: now(),
+            ..Default::default()
+        };
+        for value in headers.get_all(CACHE_CONTROL) {
+            let Ok(value) = value.to_str() else {
+                continue;
+            };
+            for directive in value.split(',').map(|d| d.trim().to_ascii_lowercase()) {
+                match directive.split_once('=') {
+                    Some(("max-age", age)) => meta.max_age = age.trim_matches('"').parse().ok(),
+                    _ if directive == "no-store" => return None,
+                    _ if directive == "no-cache" => meta.no_cache = true,
+                    _ if directive == "immutable" => meta.immutable = true,
+                    _ => {}
+                }
+            }
+        }
+        Some(meta)
+    }
+
+    /// Take the freshness of a 304 response, keeping validators it does not repeat.
+    pub fn revalidated(&self, headers: &HeaderMap) -> Self {
+        let mut meta = Self::from_headers(&self.url, headers).unwrap_or_default();
+        meta.url = self.url.clone();
+        meta.etag = meta.etag.or_else(|| self.etag.clone());
+        meta.last_modified = meta.last_modified.or_else(|| self.last_modified.clone());
+        meta
+    }
+
+    pub fn is_fresh(&self) -> bool {
+        !self.no_cache
+            && (self.immutable
+                || self
+                    .max_age
+                    .is_some_and(|age| now() < self.stored_at.saturating_add(age)))
+    }
+
+    /// Headers that turn a request into a revalidation of this entry.
+    pub fn conditional_headers(&self) -> HeaderMap {
+        let mut headers = HeaderMap::new();
+        if let Some(value) = self
+            .etag
+            .as_deref()
+            .and_then(|v| HeaderValue::from_str(v).ok())
+        {
+            headers.insert(IF_NONE_MATCH, value);
+        }
+        if let Some(value) = self
+            .last_modified
+            .as_deref()
+            .and_then(|v| HeaderValue::from_str(v).ok())
+        {
+            headers.insert(IF_MODIFIED_SINCE, value);
+        }
+        headers
+    }
+}
+
+/// A cached response.
+pub(crate) struct CacheEntry {
+    pub meta: CacheMeta,
+    pub body: Bytes,
+}
+
+/// The bodies on disk, for eviction.
+#[derive(Default)]
+struct Index {
+    /// Key to (size, last use as Unix time).
+    files: HashMap<String, (u64, u64)>,
+    stats: CacheStats,
+}
+
+pub(crate) struct HttpCache {
+    dir: PathBuf,
+    max_bytes: u64,
+    /// Built from the directory listing on first use, so opening a web archive does not
+    /// wait for it.
+    index: OnceLock<Mutex<Index>>,
+}
+
+impl HttpCache {
+    pub fn new(dir: PathBuf, max_bytes: u64) -> Self {
+        Self {
+            dir,
+            max_bytes,
+            index: OnceLock::new(),
+        }
+    }
+
+    fn index(&self) -> &Mutex<Index> {
+        self.index.get_or_init(|| {
+            let mut index = Index::default();
+            index.stats.budget = self.max_bytes;
+            if let Ok(entries) = fs::read_dir(&self.dir) {
+                for entry in entries.flatten() {
+                    let name = entry.file_name().to_string_lossy().to_string();
+                    let Some(key) = name.strip_suffix(".body") else {
+                        continue;
+                    };
+                    let Ok(metadata) = entry.metadata() else {
+                        continue;
+                    };
+                    let used = metadata.modified().map(unix_time).unwrap_or(0);
+                    index.stats.bytes += metadata.len();
+                    index.files.insert(key.to_string(), (metadata.len(), used));
+                }
+            }
+            log::info!(
+                "HTTP cache at {:?}: {} entries, {} bytes",
+                self.dir,
+                index.files.len(),
+                index.stats.bytes
+            );
+            Mutex::new(index)
+        })
+    }
+
+    fn paths(&self, url: &str) -> (String, PathBuf, PathBuf) {
+        let key = format!("{:016x}", fnv1a(url.as_bytes()));
+        let body = self.dir.join(format!("{key}.body"));
+        let meta = self.dir.join(format!("{key}.meta"));
+        (key, body, meta)
+    }
+
+    /// The cached response for `url`, fresh or not.
+    pub fn lookup(&self, url: &str) -> Option<CacheEntry> {
+        let (key, body_path, meta_path) = self.paths(url);
+        let meta: CacheMeta = toml::from_str(&fs::read_to_string(&meta_path).ok()?).ok()?;
+        if meta.url != url {
+            return None;
+        }
+        let body = fs::read(&body_path).ok()?;
+
+        // Record the use for eviction, here and on disk for the next run.
+        let now = SystemTime::now();
+        if let Ok(file) = File::options().write(true).open(&body_path) {
+            let _ = file.set_modified(now);
+        }
+        if let Some(entry) = self.index().lock().unwrap().files.get_mut(&key) {
+            entry.1 = unix_time(now);
+        }
+        Some(CacheEntry {
+            meta,
+            body: body.into(),
+        })
+    }
+
+    /// Store a response, replacing any earlier one for the same URL.
+    pub fn store(&self, meta: &CacheMeta, body: &[u8]) {
+        if let Err(e) = self.write(meta, Some(body)) {
+            log::warn!("Failed to cache {}: {}", meta.url, e);
+            return;
+        }
+        let (key, _, _) = self.paths(&meta.url);
+        let mut index = self.index().lock().unwrap();
+        let size = body.len() as u64;
+        if let Some((old, _)) = index.files.insert(key, (size, now())) {
+            index.stats.bytes -= old;
+        }
+        index.stats.bytes += size;
+        self.evict(&mut index);
+    }
+
+    /// Replace the record of an entry whose body is unchanged, after a 304.
+    pub fn store_meta(&self, meta: &CacheMeta) {
+        if let Err(e) = self.write(meta, None) {
+            log::warn!("Failed to update cache entry for {}: {}", meta.url, e);
+        }
+    }
+
+    fn write(&self, meta: &CacheMeta, body: Option<&[u8]>) -> std::io::Result<()> {
+        fs::create_dir_all(&self.dir)?;
+        let (_, body_path, meta_path) = self.paths(&meta.url);
+        let record = toml::to_string(meta).map_err(std::io::Error::other)?;
+        if let Some(body) = body {
+            write_replace(&body_path, body)?;
+        }
+        write_replace(&meta_path, record.as_bytes())
+    }
+
+    /// Delete the least recently used entries until the cache fits its budget.
+    fn evict(&self, index: &mut Index) {
+        if index.stats.bytes <= self.max_bytes {
+            return;
+        }
+        let mut by_age: Vec<(String, u64, u64)> = index
+            .files
+            .iter()
+            .map(|(key, &(size, used))| (key.clone(), size, used))
+            .collect();
+        by_age.sort_by_key(|&(_, _, used)| used);
+        for (key, size, _) in by_age {
+            if index.stats.bytes <= self.max_bytes {
+                break;
+            }
+            let _ = fs::remove_file(self.dir.join(format!("{key}.meta")));
+            let _ = fs::remove_file(self.dir.join(format!("{key}.body")));
+            index.files.remove(&key);
+            index.stats.bytes -= size;
+            index.stats.evictions += 1;
+        }
+    }
+
+    pub fn record_hit(&self) {
+        self.index().lock().unwrap().stats.hits += 1;
+    }
+
+    pub fn record_miss(&self) {
+        self.index().lock().unwrap().stats.misses += 1;
+    }
+
+    pub fn stats(&self) -> CacheStats {
+        self.index().lock().unwrap().stats
+    }
+}
+
+/// Write through a temporary file and rename it into place, so a reader never sees a
+/// half-written file.
+pub(crate) fn write_replace(path: &Path, data: &[u8]) -> std::io::Result<()> {
+    static NEXT_TMP: AtomicU64 = AtomicU64::new(0);
+    let mut tmp = path.as_os_str().to_owned();
+    tmp.push(format!(".{}.tmp", NEXT_TMP.fetch_add(1, Ordering::Relaxed)));
+    let tmp = PathBuf::from(tmp);
+    fs::write(&tmp, data)?;
+    fs::rename(&tmp, path)
+}
+
+fn header_string(headers: &HeaderMap, name: reqwest::header::HeaderName) -> Option<String> {
+    headers
+        .get(name)
+        .and_then(|value| value.to_str().ok())
+        .map(str::to_string)
+}
+
+fn unix_time(time: SystemTime) -> u64 {
+    time.duration_since(UNIX_EPOCH).map_or(0, |d| d.as_secs())
+}
+
+fn now() -> u64 {
+    unix_time(SystemTime::now())
+}
+
+/// 64-bit FNV-1a, used to name cache files after their URL or path.
+pub(crate) fn fnv1a(bytes: &[u8]) -> u64 {
+    bytes.iter().fold(0xcbf2_9ce4_8422_2325, |hash, &b| {
+        (hash ^ b as u64).wrapping_mul(0x0000_0100_0000_01b3)
+    })
+}
@@ -0,0 +1,282 @@
+//! Sidecar indexes that let a previously opened archive skip building its page table.
+//!
+//! After an archive is opened, its sorted page table, manifest and the few backend facts
+//! needed to rebuild it are written to `user_cache_dir()/index`, in a compact binary file
+//! named after a hash of the archive's path. The file records the archive's size and
+//! modification time, and is only used while both still match, so any change to the
+//! archive makes it stale. For RAR and 7z a fresh sidecar replaces the `unrar` or `7z`
+//! listing subprocess. A ZIP still reads its central directory, one read at the end of
+//! the file that page reads and writes go through, so its sidecar only saves building the
+//! page table from it.
+//!
+//! Each use of a sidecar touches its modification time, and after a store the directory
+//! is trimmed to `MAX_BYTES` by deleting the least recently used sidecars.
+
+use std::fs::{self, File};
+use std::path::{Path, PathBuf};
+use std::time::{SystemTime, UNIX_EPOCH};
+
+use crate::http_cache::{fnv1a, write_replace};
+use crate::prelude::*;
+
+const MAGIC: &[u8; 4] = b"CSIX";
+/// Bumped whenever the layout changes; sidecars of other versions are ignored.
+const VERSION: u32 = 2;
+/// Size the index directory is trimmed back to. A sidecar takes about 50 bytes a page.
+const MAX_BYTES: u64 = 64 * 1024 * 1024;
+
+/// What an archive's sidecar holds.
+pub(crate) struct ArchiveIndex {
+    pub container: ContainerFormat,
+    pub pages: Vec<EntryInfo>,
+    pub manifest: Option<String>,
+    /// Whether a RAR archive is solid.
+    pub solid: bool,
+}
+
+impl ArchiveIndex {
+    pub fn new(
+        container: ContainerFormat,
+        pages: &[EntryInfo],
+        manifest: &Result<String, ArchiveError>,
+        solid: bool,
+    ) -> Self {
+        Self {
+            container,
+            pages: pages.to_vec(),
+            manifest: manifest.as_ref().ok().cloned(),
+            solid,
+        }
+    }
+}
+
+/// Where an archive's sidecar lives, and the stamp it must carry to be used.
+pub(crate) struct IndexFile {
+    path: PathBuf,
+    archive: String,
+    size: u64,
+    modified: u64,
+}
+
+impl IndexFile {
+    /// The sidecar for `archive`, or `None` without a cache directory or file metadata.
+    pub fn for_archive(archive: &Path) -> Option<Self> {
+        let archive = fs::canonicalize(archive).ok()?;
+        let metadata = fs::metadata(&archive).ok()?;
+        let modified = metadata.modified().ok()?.duration_since(UNIX_EPOCH).ok()?;
+        let archive = archive.to_string_lossy().into_owned();
+        let name = format!("{:016x}.idx", fnv1a(archive.as_bytes()));
+        Some(Self {
+            path: crate::user_cache_dir()?.join("index").join(name),
+            archive,
+            size: metadata.len(),
+            modified: modified.as_nanos() as u64,
+        })
+    }
+
+    /// The stored index, if there is one for this exact version of the archive.
+    pub fn load(&self) -> Option<ArchiveIndex> {
+        let data = fs::read(&self.path).ok()?;
+        let mut r = Reader(&data);
+        if r.take(4)? != MAGIC || r.u32()? != VERSION {
+            return None;
+        }
+        if r.str()? != self.archive || r.u64()? != self.size || r.u64()? != self.modified {
+            return None;
+        }
+        let container = match r.u8()? {
+            0 => ContainerFormat::Zip,
+            1 => ContainerFormat::Rar,
+            2 => ContainerFormat::SevenZip,
+            _ => return None,
+        };
+        let solid = r.u8()? != 0;
+        let manifest = match r.u8()? {
+            0 => None,
+            _ => Some(r.str()?.to_string()),
+        };
+        let count = r.u32()? as usize;
+        let mut pages = Vec::with_capacity(count.min(r.0.len()));
+        for _ in 0..count {
+            pages.push(r.entry()?);
+        }
+
+        // Record the use for eviction.
+        if let Ok(file) = File::options().write(true).open(&self.path) {
+            let _ = file.set_modified(SystemTime::now());
+        }
+        Some(ArchiveIndex {
+            container,
+            pages,
+            manifest,
+            solid,
+        })
+    }
+
+    pub fn store(&self, index: &ArchiveIndex) {
+        let mut w = Vec::with_capacity(64 + index.pages.len() * 48);
+        w.extend_from_slice(MAGIC);
+        put_u32(&mut w, VERSION);
+        put_str(&mut w, &self.archive);
+        put_u64(&mut w, self.size);
+        put_u64(&mut w, self.modified);
+        w.push(match index.container {
+            ContainerFormat::Zip => 0,
+            ContainerFormat::Rar => 1,
+            ContainerFormat::SevenZip => 2,
+            ContainerFormat::Unknown => return,
+        });
+        w.push(index.solid as u8);
+        match &index.manifest {
+            Some(manifest) => {
+                w.push(1);
+                put_str(&mut w, manifest);
+            }
+            None => w.push(0),
+        }
+        put_u32(&mut w, index.pages.len() as u32);
+        for entry in &index.pages {
+            put_entry(&mut w, entry);
+        }
+
+        let Some(dir) = self.path.parent() else {
+            return;
+        };
+        let result = fs::create_dir_all(dir).and_then(|_| write_replace(&self.path, &w));
+        if let Err(e) = result {
+            log::warn!("Failed to write index for {}: {}", self.archive, e);
+            return;
+        }
+        evict(dir, MAX_BYTES);
+    }
+}
+
+/// Delete the least recently used sidecars in `dir` until they fit in `max_bytes`.
+/// Sidecars are only stored when none could be used, so listing the directory here
+/// keeps it off the path of a fast open.
+fn evict(dir: &Path, max_bytes: u64) {
+    let Ok(entries) = fs::read_dir(dir) else {
+        return;
+    };
+    let mut files: Vec<(PathBuf, u64, SystemTime)> = entries
+        .flatten()
+        .filter(|entry| entry.path().extension().is_some_and(|ext| ext == "idx"))
+        .filter_map(|entry| {
+            let metadata = entry.metadata().ok()?;
+            let used = metadata.modified().unwrap_or(UNIX_EPOCH);
+            Some((entry.path(), metadata.len(), used))
+        })
+        .collect();
+    let mut bytes: u64 = files.iter().map(|&(_, size, _)| size).sum();
+    if bytes <= max_bytes {
+        return;
+    }
+    files.sort_by_key(|&(_, _, used)| used);
+    for (path, size, _) in files {
+        if bytes <= max_bytes {
+            break;
+        }
+        if fs::remove_file(&path).is_ok() {
+            bytes -= size;
+        }
+    }
+}
+
+fn put_u32(w: &mut Vec<u8>, value: u32) {
+    w.extend_from_slice(&value.to_le_bytes());
+}
+
+fn put_u64(w: &mut Vec<u8>, value: u64) {
+    w.extend_from_slice(&value.to_le_bytes());
+}
+
+fn put_str(w: &mut Vec<u8>, value: &str) {
+    put_u32(w, value.len() as u32);
+    w.extend_from_slice(value.as_bytes());
+}
+
+fn put_entry(w: &mut Vec<u8>, entry: &EntryInfo) {
+    put_str(w, &entry.name);
+    put_u64(w, entry.size);
+    put_u64(w, entry.compressed_size);
+    put_u64(w, entry.position);
+    w.push(format_code(entry.format));
+    // Bit 0 of the flags byte is set when a CRC-32 follows.
+    w.push(entry.crc32.is_some() as u8);
+    if let Some(crc32) = entry.crc32 {
+        put_u32(w, crc32);
+    }
+}
+
+fn format_code(format: ImageFormat) -> u8 {
+    match format {
+        ImageFormat::Jpeg => 1,
+        ImageFormat::Png => 2,
+        ImageFormat::Gif => 3,
+        ImageFormat::Bmp => 4,
+        ImageFormat::WebP => 5,
+        ImageFormat::Avif => 6,
+        ImageFormat::Unknown => 0,
+    }
+}
+
+fn format_from_code(code: u8) -> ImageFormat {
+    match code {
+        1 => ImageFormat::Jpeg,
+        2 => ImageFormat::Png,
+        3 => ImageFormat::Gif,
+        4 => ImageFormat::Bmp,
+        5 => ImageFormat::WebP,
+        6 => ImageFormat::Avif,
+        _ => ImageFormat::Unknown,
+    }
+}
+
+/// Reads the sidecar layout; every read returns `None` on truncated input.
+struct Reader<'a>(&'a [u8]);
+
+impl<'a> Reader<'a> {
+    fn take(&mut self, len: usize) -> Option<&'a [u8]> {
+        if self.0.len() < len {
+            return None;
+        }
+        let (head, rest) = self.0.split_at(len);
+        self.0 = rest;
+        Some(head)
+    }
+
+    fn u8(&mut self) -> Option<u8> {
+        Some(self.take(1)?[0])
+    }
+
+    fn u32(&mut self) -> Option<u32> {
+        Some(u32::from_le_bytes(self.take(4)?.try_into().ok()?))
+    }
+
+    fn u64(&mut self) -> Option<u64> {
+        Some(u64::from_le_bytes(self.take(8)?.try_into().ok()?))
+    }
+
+    fn str(&mut self) -> Option<&'a str> {
+        let len = self.u32()? as usize;
+        std::str::from_utf8(self.take(len)?).ok()
+    }
+
+    fn entry(&mut self) -> Option<EntryInfo> {
+        let name = self.str()?.to_string();
+        let size = self.u64()?;
+        let compressed_size = self.u64()?;
+        let position = self.u64()?;
+        let format = format_from_code(self.u8()?);
+        let flags = self.u8()?;
+        let crc32 = if flags & 1 != 0 { Some(self.u32()?) } else { None };
+        Some(EntryInfo {
+            name,
+            size,
+            compressed_size,
+            crc32,
+            format,
+            position,
+        })
+    }
+}
@@ -5,10 +5,18 @@ pub mod model;
 pub mod prelude;
 
 mod zip_archive;
+mod zip_index;
+mod zip_writer;
 pub use zip_archive::ZipImageArchive;
 
+mod http_cache;
+mod index_cache;
+#[cfg(test)]
+mod test_server;
 mod web_archive;
+mod web_client;
 pub use web_archive::WebImageArchive;
+pub use web_client::{FetchPriority, LinkEstimate, WebClient, WebClientConfig};
 
 mod folder_archive;
 pub use folder_archive::FolderImageArchive;
@@ -25,54 +33,22 @@ pub use seven_zip_archive::SevenZipImageArchive;
 
 use image::codecs::jpeg::JpegEncoder;
 use std::path::{Path, PathBuf};
+use std::sync::Arc;
 
+use crate::index_cache::{ArchiveIndex, IndexFile};
 use crate::prelude::*;
 
 #[macro_export]
 macro_rules! is_supported_format {
-    ($name:expr) => {
-        $name.ends_with(".jpg")
-            || $name.ends_with(".jpeg")
-            || $name.ends_with(".png")
-            || $name.ends_with(".gif")
-            || $name.ends_with(".bmp")
-            || $name.ends_with(".webp")
-    };
-}
-
-/// Macro to simplify archive backend instantiation and manifest extraction.
-#[macro_export]
-macro_rules! archive_case {
-    (
-        $archive_ty:ty, $path:expr
-    ) => {{
-        async {
-            let archive = <$archive_ty>::new($path)?;
-            let manifest = match archive.read_manifest_string().await {
-                Ok(manifest_str) => {
-                    match $crate::model::Manifest::upgrade_from_v0_to_v1(&manifest_str) {
-                        Ok(upgraded) => upgraded,
-                        Err(_) => {
-                            toml::from_str(&manifest_str).unwrap_or_else(|_| Manifest::default())
-                        }
-                    }
-                }
-                Err(_) => Manifest::default(),
-            };
-            let is_web = manifest.meta.web_archive;
-
-            let backend: Box<dyn ImageArchiveTrait> = if is_web {
-                Box::new(WebImageArchive::new(archive, manifest.clone()))
-            } else {
-                Box::new(archive)
-            };
-
-            Ok(ImageArchive {
-                path: $path.to_path_buf(),
-                manifest,
-                backend,
-            })
-        }
+    ($name:expr) => {{
+        let name = $name.to_ascii_lowercase();
+        name.ends_with(".jpg")
+            || name.ends_with(".jpeg")
+            || name.ends_with(".png")
+            || name.ends_with(".gif")
+            || name.ends_with(".bmp")
+            || name.ends_with(".webp")
+            || name.ends_with(".avif")
     }};
 }
 
@@ -82,147 +58,251 @@ macro_rules! archive_case {
 #[cfg(feature = "async")]
 #[async_trait::async_trait]
 pub trait ImageArchiveTrait: Send + Sync {
-    fn list_images(&self) -> Vec<String>;
-    fn read_image_by_name_sync(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError>;
-    async fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError>;
+    /// The pages of the archive, in reading order.
+    fn pages(&self) -> PageTable;
+    fn list_images(&self) -> Vec<String> {
+        self.pages().iter().map(|entry| entry.name.clone()).collect()
+    }
+    /// Reads take `&self` and may be issued from many threads at once. Page data comes back
+    /// as `Bytes`, which may share memory with the backend (e.g. a mapped archive).
+    fn read_image_by_name_sync(&self, filename: &str) -> Result<Bytes, ArchiveError>;
+    async fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError>;
     async fn read_manifest_string(&self) -> Result<String, ArchiveError>;
     async fn read_manifest(&self) -> Result<Manifest, ArchiveError>;
-    async fn write_manifest(&mut self, manifest: &Manifest) -> Result<(), ArchiveError>;
+    async fn write_manifest(&self, manifest: &Manifest) -> Result<(), ArchiveError>;
+
+    /// How many pages ahead are worth reading, for backends whose reads are slow enough
+    /// to measure. `None` leaves the choice to the caller.
+    fn prefetch_window(&self) -> Option<usize> {
+        None
+    }
+    /// Read a page that is not displayed yet. Backends may serve it behind reads of
+    /// visible pages.
+    async fn prefetch_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        self.read_image_by_name(filename).await
+    }
+
+    /// Read the given pages (indices into `pages()`) one at a time, in the order their
+    /// entries are stored in the container, so bulk jobs read the file in a single forward
+    /// sweep. The iterator is lazy and holds only the page being read.
+    fn read_pages_sequential(&self, indices: &[usize]) -> PageIter<'_> {
+        read_pages_with(self.pages(), indices, move |name| self.read_image_by_name_sync(name))
+    }
 }
 
 #[cfg(not(feature = "async"))]
 pub trait ImageArchiveTrait: Send + Sync {
-    fn list_images(&self) -> Vec<String>;
-    fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError>;
+    /// The pages of the archive, in reading order.
+    fn pages(&self) -> PageTable;
+    fn list_images(&self) -> Vec<String> {
+        self.pages().iter().map(|entry| entry.name.clone()).collect()
+    }
+    /// Reads take `&self` and may be issued from many threads at once. Page data comes back
+    /// as `Bytes`, which may share memory with the backend (e.g. a mapped archive).
+    fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError>;
     fn read_manifest_string(&self) -> Result<String, ArchiveError>;
     fn read_manifest(&self) -> Result<Manifest, ArchiveError>;
-    fn write_manifest(&mut self, manifest: &Manifest) -> Result<(), ArchiveError>;
+    fn write_manifest(&self, manifest: &Manifest) -> Result<(), ArchiveError>;
+
+    /// How many pages ahead are worth reading, for backends whose reads are slow enough
+    /// to measure. `None` leaves the choice to the caller.
+    fn prefetch_window(&self) -> Option<usize> {
+        None
+    }
+    /// Read a page that is not displayed yet. Backends may serve it behind reads of
+    /// visible pages.
+    fn prefetch_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        self.read_image_by_name(filename)
+    }
+
+    /// Read the given pages (indices into `pages()`) one at a time, in the order their
+    /// entries are stored in the container, so bulk jobs read the file in a single forward
+    /// sweep. The iterator is lazy and holds only the page being read.
+    fn read_pages_sequential(&self, indices: &[usize]) -> PageIter<'_> {
+        read_pages_with(self.pages(), indices, move |name| self.read_image_by_name(name))
+    }
+}
+
+/// The per-user cache directory for comic_suite, e.g. `~/.cache/comic_suite` on Linux.
+pub fn user_cache_dir() -> Option<PathBuf> {
+    #[cfg(windows)]
+    let base = std::env::var_os("LOCALAPPDATA").map(PathBuf::from);
+    #[cfg(target_os = "macos")]
+    let base = std::env::var_os("HOME").map(|home| PathBuf::from(home).join("Library/Caches"));
+    #[cfg(not(any(windows, target_os = "macos")))]
+    let base = std::env::var_os("XDG_CACHE_HOME")
+        .map(PathBuf::from)
+        .filter(|dir| dir.is_absolute())
+        .or_else(|| std::env::var_os("HOME").map(|home| PathBuf::from(home).join(".cache")));
+    base.map(|base| base.join("comic_suite"))
+}
+
+/// A lazy iterator of pages returned by `ImageArchiveTrait::read_pages_sequential`.
+pub type PageIter<'a> = Box<dyn Iterator<Item = Result<PageData, ArchiveError>> + Send + 'a>;
+
+/// Sort page indices by where their entries sit in the container. Out-of-range indices
+/// go last so the reader can report them.
+pub(crate) fn physical_order(pages: &[EntryInfo], indices: &[usize]) -> Vec<usize> {
+    let mut order = indices.to_vec();
+    order.sort_by_key(|&index| pages.get(index).map_or(u64::MAX, |entry| entry.position));
+    order
+}
+
+/// Read `indices` one page at a time, in physical order, through `read`.
+pub(crate) fn read_pages_with<'a>(
+    pages: PageTable,
+    indices: &[usize],
+    read: impl Fn(&str) -> Result<Bytes, ArchiveError> + Send + 'a,
+) -> PageIter<'a> {
+    let order = physical_order(&pages, indices);
+    Box::new(order.into_iter().map(move |index| {
+        let entry = pages.get(index).ok_or(ArchiveError::IndexOutOfBounds)?;
+        let data = read(&entry.name)?;
+        Ok(PageData {
+            index,
+            name: entry.name.clone(),
+            data,
+        })
+    }))
 }
 
 /// Main archive wrapper.
 pub struct ImageArchive {
     pub path: PathBuf,
     pub manifest: Manifest,
-    pub backend: Box<dyn ImageArchiveTrait>,
+    pub backend: Arc<dyn ImageArchiveTrait>,
 }
 
 impl ImageArchive {
     /// Open and process an archive at the given path.
+    ///
+    /// The whole open runs in one blocking task; see `ImageArchive::open_sync`.
     #[cfg(feature = "async")]
     pub async fn process(path: &Path) -> Result<Self, ArchiveError> {
-        let ext = path
-            .extension()
-            .and_then(|e| e.to_str())
-            .unwrap_or("")
-            .to_lowercase();
+        let path = path.to_path_buf();
+        tokio::task::spawn_blocking(move || Self::open_sync(&path))
+            .await
+            .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
+    }
 
+    #[cfg(not(feature = "async"))]
+    pub fn process(path: &Path) -> Result<Self, ArchiveError> {
+        Self::open_sync(path)
+    }
+
+    /// Open the archive at `path` with the backend for its type, identified by the file's
+    /// signature rather than its extension. The container is opened and indexed once, and
+    /// the manifest is read through that same handle.
+    ///
+    /// The page table and manifest are saved to a sidecar index (see `index_cache`), and
+    /// reopening the same unchanged file rebuilds the archive from it instead of listing
+    /// a RAR or 7z again.
+    pub fn open_sync(path: &Path) -> Result<Self, ArchiveError> {
         if path.is_dir() {
-            archive_case!(FolderImageArchive, path).await
-        } else {
-            match ext.as_str() {
-                "cbz" | "zip" => archive_case!(ZipImageArchive, path).await,
-                #[cfg(feature = "rar")]
-                "cbr" | "rar" => archive_case!(RarImageArchive, path).await,
-                #[cfg(feature = "7z")]
-                "cb7" | "7z" => archive_case!(SevenZipImageArchive, path).await,
-                _ => Err(ArchiveError::UnsupportedArchive),
+            let archive = FolderImageArchive::new(path)?;
+            let manifest = archive.read_manifest_string_sync();
+            return Ok(Self::from_backend(path, archive, manifest));
+        }
+
+        let index_file = IndexFile::for_archive(path);
+        if let Some(index) = index_file.as_ref().and_then(IndexFile::load) {
+            match Self::from_index(path, &index) {
+                Ok(archive) => {
+                    log::debug!("Opened {:?} from its saved index", path);
+                    return Ok(archive);
+                }
+                Err(e) => log::info!("Saved index of {:?} is unusable: {}", path, e),
             }
         }
+
+        let container = ContainerFormat::detect(path);
+        if container != ContainerFormat::from_extension(path) {
+            log::info!("{:?} is a {:?} archive despite its extension", path, container);
+        }
+        let (archive, index) = match container {
+            ContainerFormat::Zip => {
+                let archive = ZipImageArchive::new(path)?;
+                let manifest = archive.read_manifest_string_sync();
+                let index = ArchiveIndex::new(container, &archive.pages(), &manifest, false);
+                (Self::from_backend(path, archive, manifest), index)
+            }
+            #[cfg(feature = "rar")]
+            ContainerFormat::Rar => {
+                let archive = RarImageArchive::new(path)?;
+                let manifest = archive.read_manifest_string_sync();
+                let index =
+                    ArchiveIndex::new(container, &archive.pages(), &manifest, archive.is_solid());
+                (Self::from_backend(path, archive, manifest), index)
+            }
+            #[cfg(feature = "7z")]
+            ContainerFormat::SevenZip => {
+                let archive = SevenZipImageArchive::new(path)?;
+                let manifest = archive.read_manifest_string_sync();
+                let index = ArchiveIndex::new(container, &archive.pages(), &manifest, false);
+                (Self::from_backend(path, archive, manifest), index)
+            }
+            _ => return Err(ArchiveError::UnsupportedArchive),
+        };
+        if let Some(file) = &index_file {
+            file.store(&index);
+        }
+        Ok(archive)
     }
 
-    #[cfg(not(feature = "async"))]
-    pub fn process(path: &Path) -> Result<Self, ArchiveError> {
-        let ext = path
-            .extension()
-            .and_then(|e| e.to_str())
-            .unwrap_or("")
-            .to_lowercase();
+    /// Rebuild the backend from a saved index instead of listing the container.
+    fn from_index(path: &Path, index: &ArchiveIndex) -> Result<Self, ArchiveError> {
+        let pages: PageTable = index.pages.clone().into();
+        let manifest = index
+            .manifest
+            .clone()
+            .ok_or_else(|| ArchiveError::ManifestError("Manifest not found".to_string()));
+        match index.container {
+            ContainerFormat::Zip => {
+                let archive = ZipImageArchive::with_pages(path, pages)?;
+                Ok(Self::from_backend(path, archive, manifest))
+            }
+            #[cfg(feature = "rar")]
+            ContainerFormat::Rar => {
+                let has_manifest = index.manifest.is_some();
+                let archive = RarImageArchive::from_index(path, pages, index.solid, has_manifest);
+                Ok(Self::from_backend(path, archive, manifest))
+            }
+            #[cfg(feature = "7z")]
+            ContainerFormat::SevenZip => {
+                let has_manifest = index.manifest.is_some();
+                let archive = SevenZipImageArchive::from_index(path, pages, has_manifest)?;
+                Ok(Self::from_backend(path, archive, manifest))
+            }
+            _ => Err(ArchiveError::UnsupportedArchive),
+        }
+    }
 
-        if path.is_dir() {
-            FolderImageArchive::new(path).and_then(|archive| {
-                let manifest = match archive.read_manifest_string() {
-                    Ok(manifest_str) => {
-                        match crate::model::Manifest::upgrade_from_v0_to_v1(&manifest_str) {
-                            Ok(upgraded) => upgraded,
-                            Err(_) => toml::from_str(&manifest_str)
-                                .unwrap_or_else(|_| Manifest::default()),
-                        }
-                    }
-                    Err(_) => Manifest::default(),
-                };
-                let backend: Box<dyn ImageArchiveTrait> = Box::new(archive);
-                Ok(ImageArchive {
-                    path: path.to_path_buf(),
-                    manifest,
-                    backend,
-                })
-            })
+    /// Wrap an opened backend, parsing its manifest and switching to the web backend when
+    /// the manifest asks for it. A missing or invalid manifest falls back to the default.
+    fn from_backend<A: ImageArchiveTrait + 'static>(
+        path: &Path,
+        archive: A,
+        manifest: Result<String, ArchiveError>,
+    ) -> Self {
+        let manifest = match manifest {
+            Ok(manifest_str) => Manifest::parse_or_default(&manifest_str),
+            Err(_) => Manifest::default(),
+        };
+        let backend: Arc<dyn ImageArchiveTrait> = if manifest.meta.web_archive {
+            Arc::new(WebImageArchive::new(archive, manifest.clone()))
         } else {
-            match ext.as_str() {
-                "cbz" | "zip" => ZipImageArchive::new(path).and_then(|archive| {
-                    let manifest = match archive.read_manifest_string() {
-                        Ok(manifest_str) => {
-                            match crate::model::Manifest::upgrade_from_v0_to_v1(&manifest_str) {
-                                Ok(upgraded) => upgraded,
-                                Err(_) => toml::from_str(&manifest_str)
-                                    .unwrap_or_else(|_| Manifest::default()),
-                            }
-                        }
-                        Err(_) => Manifest::default(),
-                    };
-                    let backend: Box<dyn ImageArchiveTrait> = Box::new(archive);
-                    Ok(ImageArchive {
-                        path: path.to_path_buf(),
-                        manifest,
-                        backend,
-                    })
-                }),
-                #[cfg(feature = "rar")]
-                "cbr" | "rar" => RarImageArchive::new(path).and_then(|archive| {
-                    let manifest = match archive.read_manifest_string() {
-                        Ok(manifest_str) => {
-                            match crate::model::Manifest::upgrade_from_v0_to_v1(&manifest_str) {
-                                Ok(upgraded) => upgraded,
-                                Err(_) => toml::from_str(&manifest_str)
-                                    .unwrap_or_else(|_| Manifest::default()),
-                            }
-                        }
-                        Err(_) => Manifest::default(),
-                    };
-                    let backend: Box<dyn ImageArchiveTrait> = Box::new(archive);
-                    Ok(ImageArchive {
-                        path: path.to_path_buf(),
-                        manifest,
-                        backend,
-                    })
-                }),
-                #[cfg(feature = "7z")]
-                "cb7" | "7z" => SevenZipImageArchive::new(path).and_then(|archive| {
-                    let manifest = match archive.read_manifest_string() {
-                        Ok(manifest_str) => {
-                            match crate::model::Manifest::upgrade_from_v0_to_v1(&manifest_str) {
-                                Ok(upgraded) => upgraded,
-                                Err(_) => toml::from_str(&manifest_str)
-                                    .unwrap_or_else(|_| Manifest::default()),
-                            }
-                        }
-                        Err(_) => Manifest::default(),
-                    };
-                    let backend: Box<dyn ImageArchiveTrait> = Box::new(archive);
-                    Ok(ImageArchive {
-                        path: path.to_path_buf(),
-                        manifest,
-                        backend,
-                    })
-                }),
-                _ => Err(ArchiveError::UnsupportedArchive),
-            }
+            Arc::new(archive)
+        };
+        ImageArchive {
+            path: path.to_path_buf(),
+            manifest,
+            backend,
         }
     }
 
     /// Generate a JPEG thumbnail for the given image in the archive.
     #[cfg(feature = "async")]
-    pub async fn generate_thumbnail(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
+    pub async fn generate_thumbnail(&self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
         let image_data = self.read_image_by_name(filename).await?;
         let img = image::load_from_memory(&image_data).map_err(|e| {
             ArchiveError::ImageProcessingError(format!("Failed to load image: {}", e))
@@ -241,7 +321,7 @@ impl ImageArchive {
     }
 
     #[cfg(not(feature = "async"))]
-    pub fn generate_thumbnail(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
+    pub fn generate_thumbnail(&self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
         let image_data = self.read_image_by_name(filename)?;
         let img = image::load_from_memory(&image_data).map_err(|e| {
             ArchiveError::ImageProcessingError(format!("Failed to load image: {}", e))
@@ -259,42 +339,71 @@ impl ImageArchive {
         Ok(buffer)
     }
 
+    pub fn pages(&self) -> PageTable {
+        self.backend.pages()
+    }
+
     pub fn list_images(&self) -> Vec<String> {
         self.backend.list_images()
     }
 
     #[cfg(feature = "async")]
-    pub async fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
+    pub async fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
         self.backend.read_image_by_name(filename).await
     }
 
     #[cfg(not(feature = "async"))]
-    pub fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
+    pub fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
         self.backend.read_image_by_name(filename)
     }
 
     #[cfg(feature = "async")]
-    pub async fn read_image_by_index(&mut self, index: usize) -> Result<Vec<u8>, ArchiveError> {
-        let filenames = self.list_images();
-        if index < filenames.len() {
-            self.read_image_by_name(&filenames[index]).await
-        } else {
-            Err(ArchiveError::IndexOutOfBounds)
+    pub async fn read_image_by_index(&self, index: usize) -> Result<Bytes, ArchiveError> {
+        let pages = self.pages();
+        match pages.get(index) {
+            Some(entry) => self.read_image_by_name(&entry.name).await,
+            None => Err(ArchiveError::IndexOutOfBounds),
         }
     }
 
     #[cfg(not(feature = "async"))]
-    pub fn read_image_by_index(&mut self, index: usize) -> Result<Vec<u8>, ArchiveError> {
-        let filenames = self.list_images();
-        if index < filenames.len() {
-            self.read_image_by_name(&filenames[index])
-        } else {
-            Err(ArchiveError::IndexOutOfBounds)
+    pub fn read_image_by_index(&self, index: usize) -> Result<Bytes, ArchiveError> {
+        let pages = self.pages();
+        match pages.get(index) {
+            Some(entry) => self.read_image_by_name(&entry.name),
+            None => Err(ArchiveError::IndexOutOfBounds),
         }
     }
 
-    pub fn as_trait_mut(&mut self) -> &mut dyn ImageArchiveTrait {
-        self.backend.as_mut()
+    /// Stream a batch of pages in physical order from a blocking task; see
+    /// `ImageArchiveTrait::read_pages_sequential`. At most `buffer` pages wait in the
+    /// channel, and dropping the receiver stops the read.
+    #[cfg(feature = "async")]
+    pub fn stream_pages(
+        &self,
+        indices: Vec<usize>,
+        buffer: usize,
+    ) -> tokio::sync::mpsc::Receiver<Result<PageData, ArchiveError>> {
+        let (tx, rx) = tokio::sync::mpsc::channel(buffer.max(1));
+        let backend = self.backend.clone();
+        tokio::task::spawn_blocking(move || {
+            for page in backend.read_pages_sequential(&indices) {
+                if tx.blocking_send(page).is_err() {
+                    break;
+                }
+            }
+        });
+        rx
+    }
+
+    #[cfg(not(feature = "async"))]
+    pub fn read_pages_sequential(&self, indices: &[usize]) -> PageIter<'_> {
+        self.backend.read_pages_sequential(indices)
+    }
+
+    /// A shared handle to the backend, for reading pages without holding on to the archive.
+    pub fn backend(&self) -> Arc<dyn ImageArchiveTrait> {
+        self.backend.clone()
     }
 
     pub fn manifest_mut(&mut self) -> &mut Manifest {
@@ -0,0 +1,65 @@
+use std::fs::File;
+use std::io::Read;
+use std::path::Path;
+
+/// The container type of an archive file.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub enum ContainerFormat {
+    Zip,
+    Rar,
+    SevenZip,
+    #[default]
+    Unknown,
+}
+
+impl ContainerFormat {
+    /// Bytes needed by `from_magic` to tell every container apart.
+    pub const MAGIC_LEN: usize = 8;
+
+    /// Guess the container from the leading bytes of the file. Covers RAR 4 and RAR 5,
+    /// and empty or spanned ZIPs.
+    pub fn from_magic(bytes: &[u8]) -> Self {
+        if bytes.starts_with(b"PK\x03\x04")
+            || bytes.starts_with(b"PK\x05\x06")
+            || bytes.starts_with(b"PK\x07\x08")
+        {
+            ContainerFormat::Zip
+        } else if bytes.starts_with(b"Rar!\x1a\x07\x00")
+            || bytes.starts_with(b"Rar!\x1a\x07\x01\x00")
+        {
+            ContainerFormat::Rar
+        } else if bytes.starts_with(b"7z\xbc\xaf\x27\x1c") {
+            ContainerFormat::SevenZip
+        } else {
+            ContainerFormat::Unknown
+        }
+    }
+
+    /// Guess the container from a file name's extension.
+    pub fn from_extension(path: &Path) -> Self {
+        let ext = path
+            .extension()
+            .and_then(|e| e.to_str())
+            .unwrap_or("")
+            .to_ascii_lowercase();
+        match ext.as_str() {
+            "cbz" | "zip" => ContainerFormat::Zip,
+            "cbr" | "rar" => ContainerFormat::Rar,
+            "cb7" | "7z" => ContainerFormat::SevenZip,
+            _ => ContainerFormat::Unknown,
+        }
+    }
+
+    /// Read the first bytes of the file at `path` and identify its container, falling back
+    /// to the extension when the signature is not recognised (e.g. a self-extracting
+    /// archive with a stub in front).
+    pub fn detect(path: &Path) -> Self {
+        let mut magic = [0u8; Self::MAGIC_LEN];
+        let read =
+            File::open(path).and_then(|file| file.take(Self::MAGIC_LEN as u64).read(&mut magic));
+        match read.map(|len| Self::from_magic(&magic[..len])) {
+            Ok(ContainerFormat::Unknown) | Err(_) => Self::from_extension(path),
+            Ok(format) => format,
+        }
+    }
+}
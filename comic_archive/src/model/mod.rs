@@ -1,5 +1,12 @@
 use serde::{Deserialize, Serialize};
 
+mod container;
+mod page;
+mod stats;
+pub use container::ContainerFormat;
+pub use page::{EntryInfo, ImageFormat, PageData, PageTable};
+pub use stats::CacheStats;
+
 /// Metadata about a comic archive, such as title, author, web archive flag, and optional page comments.
 #[derive(Debug, Clone, Deserialize, Serialize)]
 pub struct Metadata {
@@ -67,6 +74,15 @@ impl Manifest {
         }
         Ok(manifest)
     }
+
+    /// Parse a manifest, upgrading old versions, or fall back to the default if it is not
+    /// valid TOML.
+    pub fn parse_or_default(toml_str: &str) -> Manifest {
+        Manifest::upgrade_from_v0_to_v1(toml_str).unwrap_or_else(|e| {
+            log::warn!("Ignoring invalid manifest: {}", e);
+            Manifest::default()
+        })
+    }
 }
 
 impl Default for Manifest {
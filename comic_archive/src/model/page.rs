@@ -0,0 +1,126 @@
+use bytes::Bytes;
+use serde::{Deserialize, Serialize};
+use std::sync::Arc;
+
+/// The image format of a page.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default, Deserialize, Serialize)]
+pub enum ImageFormat {
+    Jpeg,
+    Png,
+    Gif,
+    Bmp,
+    WebP,
+    Avif,
+    #[default]
+    Unknown,
+}
+
+impl ImageFormat {
+    /// Bytes needed by `from_magic` to tell every format apart.
+    pub const MAGIC_LEN: usize = 12;
+
+    /// Guess the format from the leading bytes of the image data.
+    pub fn from_magic(bytes: &[u8]) -> Self {
+        if bytes.starts_with(&[0xFF, 0xD8, 0xFF]) {
+            ImageFormat::Jpeg
+        } else if bytes.starts_with(b"\x89PNG\r\n\x1a\n") {
+            ImageFormat::Png
+        } else if bytes.starts_with(b"GIF87a") || bytes.starts_with(b"GIF89a") {
+            ImageFormat::Gif
+        } else if bytes.starts_with(b"BM") {
+            ImageFormat::Bmp
+        } else if bytes.len() >= 12 && &bytes[0..4] == b"RIFF" && &bytes[8..12] == b"WEBP" {
+            ImageFormat::WebP
+        } else if bytes.len() >= 12
+            && &bytes[4..8] == b"ftyp"
+            && (&bytes[8..12] == b"avif" || &bytes[8..12] == b"avis")
+        {
+            ImageFormat::Avif
+        } else {
+            ImageFormat::Unknown
+        }
+    }
+
+    /// Guess the format from a file name's extension.
+    pub fn from_name(name: &str) -> Self {
+        let ext = name
+            .rsplit_once('.')
+            .map(|(_, ext)| ext.to_ascii_lowercase())
+            .unwrap_or_default();
+        match ext.as_str() {
+            "jpg" | "jpeg" => ImageFormat::Jpeg,
+            "png" => ImageFormat::Png,
+            "gif" => ImageFormat::Gif,
+            "bmp" => ImageFormat::Bmp,
+            "webp" => ImageFormat::WebP,
+            "avif" => ImageFormat::Avif,
+            _ => ImageFormat::Unknown,
+        }
+    }
+
+    /// The usual file extension for the format, or `None` if it is unknown.
+    pub fn extension(self) -> Option<&'static str> {
+        match self {
+            ImageFormat::Jpeg => Some("jpg"),
+            ImageFormat::Png => Some("png"),
+            ImageFormat::Gif => Some("gif"),
+            ImageFormat::Bmp => Some("bmp"),
+            ImageFormat::WebP => Some("webp"),
+            ImageFormat::Avif => Some("avif"),
+            ImageFormat::Unknown => None,
+        }
+    }
+
+    /// The format from the data's signature, or from the name if the signature is not
+    /// recognised.
+    pub fn detect(bytes: &[u8], name: &str) -> Self {
+        match Self::from_magic(bytes) {
+            ImageFormat::Unknown => Self::from_name(name),
+            format => format,
+        }
+    }
+}
+
+/// Metadata about a single page in an archive.
+#[derive(Debug, Clone, Deserialize, Serialize)]
+pub struct EntryInfo {
+    /// The name of the page within the archive (or its URL for web archives).
+    pub name: String,
+    /// Uncompressed size in bytes, or 0 if unknown.
+    pub size: u64,
+    /// Compressed size in bytes, or 0 if unknown.
+    pub compressed_size: u64,
+    /// CRC-32 of the uncompressed data, if the container records one.
+    pub crc32: Option<u32>,
+    /// The image format of the page.
+    pub format: ImageFormat,
+    /// Where the entry sits in the container: the local header offset for ZIP, the listing
+    /// position for RAR. Reading pages in increasing `position` sweeps the file forward.
+    pub position: u64,
+}
+
+impl EntryInfo {
+    /// An entry with only a name known, its format guessed from the extension.
+    pub fn from_name(name: impl Into<String>) -> Self {
+        let name = name.into();
+        Self {
+            format: ImageFormat::from_name(&name),
+            name,
+            size: 0,
+            compressed_size: 0,
+            crc32: None,
+            position: 0,
+        }
+    }
+}
+
+/// A page read by a batch read, tagged with its index in the page table.
+#[derive(Debug, Clone)]
+pub struct PageData {
+    pub index: usize,
+    pub name: String,
+    pub data: Bytes,
+}
+
+/// An immutable, cheap-to-clone table of the pages in an archive, in reading order.
+pub type PageTable = Arc<[EntryInfo]>;
@@ -0,0 +1,26 @@
+/// A snapshot of a cache's counters.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct CacheStats {
+    /// Lookups served from the cache.
+    pub hits: u64,
+    /// Lookups that had to load the entry.
+    pub misses: u64,
+    /// Entries dropped to stay within the budget.
+    pub evictions: u64,
+    /// Bytes currently held.
+    pub bytes: u64,
+    /// The most bytes the cache will hold.
+    pub budget: u64,
+}
+
+impl CacheStats {
+    /// The fraction of lookups that were hits, or 0 before any lookup.
+    pub fn hit_rate(&self) -> f64 {
+        let lookups = self.hits + self.misses;
+        if lookups == 0 {
+            0.0
+        } else {
+            self.hits as f64 / lookups as f64
+        }
+    }
+}
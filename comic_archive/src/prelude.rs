@@ -3,5 +3,12 @@ pub use crate::RarImageArchive;
 #[cfg(feature = "7z")]
 pub use crate::SevenZipImageArchive;
 pub use crate::error::ArchiveError;
-pub use crate::model::{ExternalPages, Manifest, Metadata};
-pub use crate::{ImageArchive, ImageArchiveTrait, WebImageArchive, ZipImageArchive};
+pub use crate::model::{
+    CacheStats, ContainerFormat, EntryInfo, ExternalPages, ImageFormat, Manifest, Metadata,
+    PageData, PageTable,
+};
+pub use crate::{
+    ImageArchive, ImageArchiveTrait, PageIter, WebClient, WebClientConfig, WebImageArchive,
+    ZipImageArchive,
+};
+pub use bytes::Bytes;
@@ -1,10 +1,14 @@
 use crate::is_supported_format;
 use crate::prelude::*;
+use std::collections::VecDeque;
+use std::ffi::{OsStr, OsString};
 use std::fs;
-use std::io::Read;
+use std::io::{Read, Write};
 use std::path::{Path, PathBuf};
-use std::process::Command;
-use tempfile::tempdir;
+use std::process::{Child, ChildStdout, Command, Stdio};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Mutex};
+use tempfile::{NamedTempFile, tempdir};
 
 #[cfg(windows)]
 use std::os::windows::process::CommandExt;
@@ -12,16 +16,33 @@ use std::os::windows::process::CommandExt;
 #[cfg(windows)]
 const CREATE_NO_WINDOW: u32 = 0x08000000;
 
+/// Pages extracted together from a solid archive. Extracting any page of a solid archive
+/// decompresses everything before it, so the pages after it are read in the same pass.
+const SOLID_WINDOW: usize = 16;
+/// Pages kept in memory from solid extraction windows.
+const SOLID_CACHE_PAGES: usize = 2 * SOLID_WINDOW;
+
 /// An archive backend for RAR/CBR comic archives using the external `unrar` and `rar` tools.
+#[derive(Clone)]
 pub struct RarImageArchive {
     path: PathBuf,
-    entries: Vec<String>,
+    pages: PageTable,
+    /// Whether the archive is solid, according to its technical listing.
+    solid: bool,
+    /// Whether the archive has a manifest.toml, so opening skips `unrar` when it does not.
+    /// Set once a manifest is written; clones share it.
+    has_manifest: Arc<AtomicBool>,
+    /// Pages extracted ahead of time from a solid archive, most recently used last.
+    cache: Arc<Mutex<VecDeque<(usize, Bytes)>>>,
+    /// Held while a window is extracted, so concurrent reads wait for it instead of each
+    /// decompressing the archive again.
+    window_lock: Arc<Mutex<()>>,
 }
 
 impl RarImageArchive {
     pub fn new(path: &Path) -> Result<Self, ArchiveError> {
         let mut cmd = Command::new("unrar");
-        cmd.arg("l").arg("-c-").arg(path);
+        cmd.arg("lt").arg("-c-").arg("-cfg-").arg("--").arg(path);
 
         #[cfg(windows)]
         cmd.creation_flags(CREATE_NO_WINDOW);
@@ -35,137 +56,376 @@ impl RarImageArchive {
         }
 
         let stdout = String::from_utf8_lossy(&output.stdout);
-        let mut entries = Vec::new();
-        let mut listing_started = false;
-
-        for line in stdout.lines() {
-            if line.trim().starts_with("--------") {
-                listing_started = true;
-                continue;
-            }
-            if listing_started {
-                if line.trim().is_empty() {
-                    break;
-                }
-                let parts: Vec<&str> = line.split_whitespace().collect();
-                if parts.len() < 5 {
-                    break;
-                }
-                let filename = parts[4..].join(" ");
-                let filename_lower = filename.to_lowercase();
-                if is_supported_format!(&filename_lower) {
-                    entries.push(filename);
-                }
-            }
+        let (solid, mut entries) = parse_technical_listing(&stdout);
+        let has_manifest = entries.iter().any(|entry| entry.name == "manifest.toml");
+        entries.retain(|entry| is_supported_format!(&entry.name));
+        entries.sort_by(|a, b| a.name.cmp(&b.name));
+        if solid {
+            log::info!("{:?} is a solid archive", path);
         }
-        entries.sort();
+        Ok(Self::from_index(path, entries.into(), solid, has_manifest))
+    }
 
-        Ok(Self {
+    /// Rebuild an archive from what an earlier listing of the same file found.
+    pub(crate) fn from_index(
+        path: &Path,
+        pages: PageTable,
+        solid: bool,
+        has_manifest: bool,
+    ) -> Self {
+        Self {
             path: path.to_path_buf(),
-            entries,
-        })
+            pages,
+            solid,
+            has_manifest: Arc::new(AtomicBool::new(has_manifest)),
+            cache: Arc::new(Mutex::new(VecDeque::new())),
+            window_lock: Arc::new(Mutex::new(())),
+        }
     }
 
-    fn read_file_by_name_sync(&self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
-        let tmp_dir = tempdir().map_err(|_| {
-            ArchiveError::Io(std::io::Error::new(
-                std::io::ErrorKind::Other,
-                "Failed to create temp dir",
-            ))
-        })?;
+    /// Whether the archive is solid, so pages can only be decompressed in order.
+    pub fn is_solid(&self) -> bool {
+        self.solid
+    }
 
+    /// An `unrar` run of `command` on this archive, with `switches`. Configuration files
+    /// and the RAR environment variable are ignored, and `--` ends the switches, so names
+    /// added after this are never taken for one.
+    fn unrar<S: AsRef<OsStr>>(
+        &self,
+        command: &str,
+        switches: impl IntoIterator<Item = S>,
+    ) -> Command {
         let mut cmd = Command::new("unrar");
-        cmd.arg("x")
-            .arg("-y")
-            .arg(&self.path)
-            .arg(filename)
-            .arg(tmp_dir.path());
+        cmd.arg(command).arg("-inul").arg("-cfg-");
+        cmd.args(switches).arg("--").arg(&self.path);
 
         #[cfg(windows)]
         cmd.creation_flags(CREATE_NO_WINDOW);
 
-        let status = cmd
-            .status()
-            .map_err(|_| ArchiveError::UnsupportedArchive)?;
+        cmd
+    }
 
+    /// Print a single entry with `unrar p` and collect it from stdout. Nothing is written
+    /// to disk, and the buffer handed back is the one the pipe was read into.
+    ///
+    /// `unrar` takes the name as a wildcard mask, so the output may hold other entries as
+    /// well. Output that does not match the listed size and CRC is discarded and the entry
+    /// is extracted on its own instead.
+    fn print_entry(&self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
+        let mut cmd = self.unrar("p", [] as [&str; 0]);
+        cmd.arg(filename);
+        cmd.stdin(Stdio::null()).stdout(Stdio::piped());
+
+        let mut child = cmd.spawn().map_err(|_| ArchiveError::UnsupportedArchive)?;
+        let entry = self.pages.iter().find(|entry| entry.name == filename);
+        let size = entry.map_or(0, |entry| entry.size);
+        let mut buffer = Vec::with_capacity(size as usize);
+        let read = child
+            .stdout
+            .take()
+            .expect("stdout is piped")
+            .read_to_end(&mut buffer);
+        let status = child.wait()?;
+        read?;
+
+        // `unrar` exits non-zero when nothing matched.
+        if !status.success() || buffer.is_empty() {
+            return Err(ArchiveError::NoImages);
+        }
+        match entry {
+            Some(entry) if !is_intact(entry, &buffer) => {
+                log::warn!("unrar output for {} does not match its listing", filename);
+                self.extract_entry(entry)
+            }
+            _ => Ok(buffer),
+        }
+    }
+
+    /// Extract a single entry to a temporary directory and read it back from its own path,
+    /// so entries that its name also matches as a mask cannot get mixed in.
+    fn extract_entry(&self, entry: &EntryInfo) -> Result<Vec<u8>, ArchiveError> {
+        let tmp_dir = tempdir()?;
+        // A trailing separator marks the last argument as the destination.
+        let mut dest = tmp_dir.path().as_os_str().to_owned();
+        dest.push(std::path::MAIN_SEPARATOR_STR);
+
+        let mut cmd = self.unrar("x", ["-o+"]);
+        cmd.arg(&entry.name).arg(dest).stdin(Stdio::null());
+        let status = cmd.status().map_err(|_| ArchiveError::UnsupportedArchive)?;
         if !status.success() {
-            return Err(ArchiveError::UnsupportedArchive);
+            return Err(ArchiveError::NoImages);
         }
 
-        let extracted_path = tmp_dir.path().join(filename);
-        let mut file = fs::File::open(&extracted_path).map_err(|_| ArchiveError::NoImages)?;
-        let mut buffer = Vec::new();
-        file.read_to_end(&mut buffer)
-            .map_err(|_| ArchiveError::NoImages)?;
+        let data = fs::read(tmp_dir.path().join(&entry.name))?;
+        if !is_intact(entry, &data) {
+            return Err(ArchiveError::Other(format!(
+                "{} does not match the size and CRC in its listing",
+                entry.name
+            )));
+        }
+        Ok(data)
+    }
 
-        Ok(buffer)
+    fn read_file_by_name_sync(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        let index = self.pages.iter().position(|entry| entry.name == filename);
+        match index {
+            Some(index) if self.solid => self.read_solid_page(index),
+            _ => Ok(self.print_entry(filename)?.into()),
+        }
     }
 
-    fn read_manifest_string_sync(&self) -> Result<String, ArchiveError> {
-        let tmp_dir =
-            tempdir().map_err(|_| ArchiveError::ManifestError("Tempdir failed".into()))?;
+    /// Read a page of a solid archive. On a miss, the page and the `SOLID_WINDOW` pages
+    /// after it are extracted in one `unrar` run and kept for the reads that follow.
+    fn read_solid_page(&self, index: usize) -> Result<Bytes, ArchiveError> {
+        if let Some(data) = self.cached(index) {
+            return Ok(data);
+        }
+        let _guard = self.window_lock.lock().unwrap();
+        if let Some(data) = self.cached(index) {
+            return Ok(data);
+        }
 
-        let mut cmd = Command::new("unrar");
-        cmd.arg("x")
-            .arg("-y")
-            .arg(&self.path)
-            .arg("manifest.toml")
-            .arg(tmp_dir.path());
+        let window: Vec<usize> = (index..(index + SOLID_WINDOW).min(self.pages.len())).collect();
+        log::debug!("Extracting pages {}..{} of solid archive", index, index + window.len());
+        let mut found = None;
+        for page in self.read_pages_piped(&window) {
+            match page {
+                Ok(page) => {
+                    if page.index == index {
+                        found = Some(page.data.clone());
+                    }
+                    self.insert_cached(page.index, page.data);
+                }
+                Err(e) if found.is_none() => return Err(e),
+                Err(_) => break,
+            }
+        }
+        found.ok_or(ArchiveError::NoImages)
+    }
 
-        #[cfg(windows)]
-        cmd.creation_flags(CREATE_NO_WINDOW);
+    fn cached(&self, index: usize) -> Option<Bytes> {
+        let mut cache = self.cache.lock().unwrap();
+        let pos = cache.iter().position(|(i, _)| *i == index)?;
+        let entry = cache.remove(pos)?;
+        let data = entry.1.clone();
+        cache.push_back(entry);
+        Some(data)
+    }
 
-        let status = cmd
-            .status()
-            .map_err(|_| ArchiveError::ManifestError("Failed to run unrar".into()))?;
+    fn insert_cached(&self, index: usize, data: Bytes) {
+        let mut cache = self.cache.lock().unwrap();
+        cache.retain(|(i, _)| *i != index);
+        cache.push_back((index, data));
+        while cache.len() > SOLID_CACHE_PAGES {
+            cache.pop_front();
+        }
+    }
 
-        if !status.success() {
+    /// Pipe all requested pages out of a single `unrar p` run, which writes them to stdout
+    /// back to back in archive order, and split the stream by the listed sizes. Falls back
+    /// to one `unrar p` run per page if any size is unknown.
+    ///
+    /// The names go to `unrar` in a list file (`-n@`) rather than on the command line,
+    /// which has no room for a long list on Windows. Each page cut from the stream is
+    /// checked against its listed CRC, since a name that works as a wildcard mask can pull
+    /// in other entries and shift everything after it.
+    fn read_pages_piped(&self, indices: &[usize]) -> PageIter<'_> {
+        let mut order = crate::physical_order(&self.pages, indices);
+        order.dedup();
+        let known = order
+            .iter()
+            .all(|&index| self.pages.get(index).is_some_and(|entry| entry.size > 0));
+        if !known || order.is_empty() {
+            return crate::read_pages_with(self.pages.clone(), indices, move |name| {
+                Ok(self.print_entry(name)?.into())
+            });
+        }
+
+        let list = (|| {
+            let mut list = NamedTempFile::new()?;
+            for &index in &order {
+                writeln!(list, "{}", self.pages[index].name)?;
+            }
+            list.flush()?;
+            Ok::<_, std::io::Error>(list)
+        })();
+        let list = match list {
+            Ok(list) => list,
+            Err(e) => return Box::new(std::iter::once(Err(e.into()))),
+        };
+        let mut include = OsString::from("-n@");
+        include.push(list.path());
+
+        // The list file is read as UTF-8 (`-scfl`) on every platform.
+        let mut cmd = self.unrar("p", [include.as_os_str(), OsStr::new("-scfl")]);
+        cmd.stdin(Stdio::null()).stdout(Stdio::piped());
+
+        let mut child = match cmd.spawn() {
+            Ok(child) => child,
+            Err(_) => return Box::new(std::iter::once(Err(ArchiveError::UnsupportedArchive))),
+        };
+        let stdout = child.stdout.take().expect("stdout is piped");
+        Box::new(RarPipe {
+            archive: self,
+            pipe: Some((child, stdout)),
+            _list: list,
+            order: order.into_iter(),
+        })
+    }
+
+    pub(crate) fn read_manifest_string_sync(&self) -> Result<String, ArchiveError> {
+        if !self.has_manifest.load(Ordering::Relaxed) {
             return Err(ArchiveError::ManifestError(
                 "manifest.toml not found in archive".into(),
             ));
         }
+        let buffer = self.print_entry("manifest.toml").map_err(|_| {
+            ArchiveError::ManifestError("manifest.toml not found in archive".into())
+        })?;
+        String::from_utf8(buffer)
+            .map_err(|_| ArchiveError::ManifestError("manifest.toml is not valid UTF-8".into()))
+    }
+}
 
-        let manifest_path = tmp_dir.path().join("manifest.toml");
-        let manifest_str = fs::read_to_string(&manifest_path)
-            .map_err(|_| ArchiveError::ManifestError("Failed to read manifest.toml".into()))?;
-        Ok(manifest_str)
+/// Parse the output of `unrar lt`: whether the archive is solid, and its file entries in
+/// archive order.
+fn parse_technical_listing(listing: &str) -> (bool, Vec<EntryInfo>) {
+    let mut solid = false;
+    let mut entries = Vec::new();
+    let mut current: Option<EntryInfo> = None;
+    let mut is_file = true;
+    let mut position = 0;
+
+    for line in listing.lines() {
+        let Some((key, value)) = line.split_once(':') else {
+            continue;
+        };
+        let value = value.trim();
+        match key.trim() {
+            "Details" => solid = value.split(',').any(|part| part.trim() == "solid"),
+            "Name" => {
+                if let Some(entry) = current.take().filter(|_| is_file) {
+                    entries.push(entry);
+                }
+                let mut entry = EntryInfo::from_name(value);
+                entry.position = position;
+                position += 1;
+                current = Some(entry);
+                is_file = true;
+            }
+            "Type" => is_file = value == "File",
+            "Size" => {
+                if let Some(entry) = current.as_mut() {
+                    entry.size = value.parse().unwrap_or(0);
+                }
+            }
+            "Packed size" => {
+                if let Some(entry) = current.as_mut() {
+                    entry.compressed_size = value.parse().unwrap_or(0);
+                }
+            }
+            "CRC32" => {
+                if let Some(entry) = current.as_mut() {
+                    entry.crc32 = u32::from_str_radix(value, 16).ok();
+                }
+            }
+            _ => {}
+        }
+    }
+    if let Some(entry) = current.filter(|_| is_file) {
+        entries.push(entry);
+    }
+    (solid, entries)
+}
+
+/// Whether `data` is all of `entry`, going by the size and CRC in the listing. Either is
+/// skipped when the listing did not give it.
+fn is_intact(entry: &EntryInfo, data: &[u8]) -> bool {
+    (entry.size == 0 || data.len() as u64 == entry.size)
+        && entry.crc32.is_none_or(|crc| crc32fast::hash(data) == crc)
+}
+
+/// Splits the stdout of an `unrar p` run into pages. Only the page being read is held in
+/// memory; dropping the iterator stops the process.
+///
+/// A page that fails its CRC means the stream is out of step. The process is stopped,
+/// and that page and the rest are read one entry at a time instead.
+struct RarPipe<'a> {
+    archive: &'a RarImageArchive,
+    pipe: Option<(Child, ChildStdout)>,
+    /// The `-n@` list, removed once the process is done with it.
+    _list: NamedTempFile,
+    order: std::vec::IntoIter<usize>,
+}
+
+impl RarPipe<'_> {
+    fn stop(&mut self) {
+        if let Some((mut child, _)) = self.pipe.take() {
+            let _ = child.kill();
+            let _ = child.wait();
+        }
+    }
+}
+
+impl Iterator for RarPipe<'_> {
+    type Item = Result<PageData, ArchiveError>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let index = self.order.next()?;
+        let archive = self.archive;
+        let entry = &archive.pages[index];
+        let page = |data: Vec<u8>| PageData {
+            index,
+            name: entry.name.clone(),
+            data: data.into(),
+        };
+
+        if let Some((_, stdout)) = self.pipe.as_mut() {
+            let mut data = vec![0u8; entry.size as usize];
+            match stdout.read_exact(&mut data) {
+                Ok(()) if is_intact(entry, &data) => return Some(Ok(page(data))),
+                Ok(()) => log::warn!("{} from the unrar stream fails its CRC", entry.name),
+                Err(e) => log::warn!("unrar stream ended before {}: {}", entry.name, e),
+            }
+            self.stop();
+        }
+        Some(archive.print_entry(&entry.name).map(page))
+    }
+}
+
+impl Drop for RarPipe<'_> {
+    fn drop(&mut self) {
+        self.stop();
     }
 }
 
 #[cfg(feature = "async")]
 #[async_trait::async_trait]
 impl ImageArchiveTrait for RarImageArchive {
-    fn list_images(&self) -> Vec<String> {
-        self.entries.clone()
+    fn pages(&self) -> PageTable {
+        self.pages.clone()
     }
 
-    fn read_image_by_name_sync(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
+    fn read_image_by_name_sync(&self, filename: &str) -> Result<Bytes, ArchiveError> {
         self.read_file_by_name_sync(filename)
     }
 
-    async fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
-        let path = self.path.clone();
+    fn read_pages_sequential(&self, indices: &[usize]) -> PageIter<'_> {
+        self.read_pages_piped(indices)
+    }
+
+    async fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        let archive = self.clone();
         let filename = filename.to_string();
-        tokio::task::spawn_blocking(move || {
-            let mut archive = RarImageArchive {
-                path,
-                entries: Vec::new(),
-            }; // entries unused
-            archive.read_image_by_name_sync(&filename)
-        })
+        tokio::task::spawn_blocking(move || archive.read_file_by_name_sync(&filename))
         .await
         .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
     }
 
     async fn read_manifest_string(&self) -> Result<String, ArchiveError> {
-        let path = self.path.clone();
-        tokio::task::spawn_blocking(move || {
-            let archive = RarImageArchive {
-                path,
-                entries: Vec::new(),
-            };
-            archive.read_manifest_string_sync()
-        })
+        let archive = self.clone();
+        tokio::task::spawn_blocking(move || archive.read_manifest_string_sync())
         .await
         .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
     }
@@ -177,11 +437,11 @@ impl ImageArchiveTrait for RarImageArchive {
         Ok(manifest)
     }
 
-    async fn write_manifest(&mut self, manifest: &Manifest) -> Result<(), ArchiveError> {
+    async fn write_manifest(&self, manifest: &Manifest) -> Result<(), ArchiveError> {
         let path = self.path.clone();
         let toml = toml::to_string_pretty(manifest)
             .map_err(|e| ArchiveError::ManifestError(format!("Invalid TOML: {}", e)))?;
-        tokio::task::spawn_blocking(move || {
+        let result = tokio::task::spawn_blocking(move || {
             let tmp_dir =
                 tempdir().map_err(|_| ArchiveError::ManifestError("Tempdir failed".into()))?;
             let manifest_path = tmp_dir.path().join("manifest.toml");
@@ -213,18 +473,22 @@ impl ImageArchiveTrait for RarImageArchive {
             Ok(())
         })
         .await
-        .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
+        .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))));
+        if result.is_ok() {
+            self.has_manifest.store(true, Ordering::Relaxed);
+        }
+        result
     }
 }
 
 #[cfg(not(feature = "async"))]
 impl ImageArchiveTrait for RarImageArchive {
-    /// List all image filenames in the RAR archive.
-    fn list_images(&self) -> Vec<String> {
-        self.entries.clone()
+    /// The image pages in the RAR archive, sorted by name.
+    fn pages(&self) -> PageTable {
+        self.pages.clone()
     }
 
-    /// Extract and return the raw bytes of an image by filename.
+    /// Return the raw bytes of an image by filename, streamed from `unrar`.
     ///
     /// # Arguments
     ///
@@ -232,68 +496,18 @@ impl ImageArchiveTrait for RarImageArchive {
     ///
     /// # Returns
     ///
-    /// A vector of bytes containing the image data, or an `ArchiveError` on failure.
-    fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
-        let tmp_dir = tempdir().map_err(|_| {
-            ArchiveError::Io(std::io::Error::new(
-                std::io::ErrorKind::Other,
-                "Failed to create temp dir",
-            ))
-        })?;
-        let mut cmd = Command::new("unrar");
-        cmd.arg("x")
-            .arg("-y") // assume yes
-            .arg(&self.path)
-            .arg(filename)
-            .arg(tmp_dir.path());
-
-        #[cfg(windows)]
-        cmd.creation_flags(CREATE_NO_WINDOW);
-
-        let status = cmd
-            .status()
-            .map_err(|_| ArchiveError::UnsupportedArchive)?;
-
-        if !status.success() {
-            return Err(ArchiveError::UnsupportedArchive);
-        }
-
-        let extracted_path = tmp_dir.path().join(filename);
-        let mut file = fs::File::open(&extracted_path).map_err(|_| ArchiveError::NoImages)?;
-        let mut buffer = Vec::new();
-        file.read_to_end(&mut buffer)
-            .map_err(|_| ArchiveError::NoImages)?;
+    /// The image bytes, or an `ArchiveError` on failure.
+    fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        self.read_file_by_name_sync(filename)
+    }
 
-        Ok(buffer)
+    /// Read a batch of pages through a single `unrar p` run.
+    fn read_pages_sequential(&self, indices: &[usize]) -> PageIter<'_> {
+        self.read_pages_piped(indices)
     }
 
     fn read_manifest_string(&self) -> Result<String, ArchiveError> {
-        let tmp_dir =
-            tempdir().map_err(|_| ArchiveError::ManifestError("Tempdir failed".into()))?;
-        let mut cmd = Command::new("unrar");
-        cmd.arg("x")
-            .arg("-y")
-            .arg(&self.path)
-            .arg("manifest.toml")
-            .arg(tmp_dir.path());
-
-        #[cfg(windows)]
-        cmd.creation_flags(CREATE_NO_WINDOW);
-
-        let status = cmd
-            .status()
-            .map_err(|_| ArchiveError::ManifestError("Failed to run unrar".into()))?;
-
-        if !status.success() {
-            return Err(ArchiveError::ManifestError(
-                "manifest.toml not found in archive".into(),
-            ));
-        }
-
-        let manifest_path = tmp_dir.path().join("manifest.toml");
-        let manifest_str = fs::read_to_string(&manifest_path)
-            .map_err(|_| ArchiveError::ManifestError("Failed to read manifest.toml".into()))?;
-        Ok(manifest_str)
+        self.read_manifest_string_sync()
     }
 
     /// Read and parse the manifest from the RAR archive.
@@ -317,7 +531,7 @@ impl ImageArchiveTrait for RarImageArchive {
     /// # Returns
     ///
     /// Returns `Ok(())` on success, or an `ArchiveError` if writing fails.
-    fn write_manifest(&mut self, manifest: &Manifest) -> Result<(), ArchiveError> {
+    fn write_manifest(&self, manifest: &Manifest) -> Result<(), ArchiveError> {
         log::info!(
             "Preparing to write manifest to RAR archive: {:?}",
             &self.path
@@ -342,8 +556,6 @@ impl ImageArchiveTrait for RarImageArchive {
             &self.path
         );
 
-        drop(tmp_dir);
-
         let mut cmd = Command::new("rar");
         cmd.arg("u") // update
             .arg("-ep1") // exclude base dir from names
@@ -361,12 +573,15 @@ impl ImageArchiveTrait for RarImageArchive {
                 )
             })?;
 
+        drop(tmp_dir);
+
         if !status.success() {
             log::error!("Failed to update manifest in archive (WinRAR required)");
             return Err(ArchiveError::ManifestError(
                 "Failed to update manifest in archive (WinRAR required)".into(),
             ));
         }
+        self.has_manifest.store(true, Ordering::Relaxed);
 
         log::info!(
             "Manifest successfully written to RAR archive: {:?}",
@@ -1,12 +1,13 @@
 use crate::error::*;
 use crate::is_supported_format;
 use crate::prelude::*;
+use std::collections::VecDeque;
 use std::fs;
-use std::io::Read;
 use std::path::{Path, PathBuf};
-use std::process::Command;
+use std::process::{Command, Stdio};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
 use tempfile::TempDir;
-use walkdir;
 
 #[cfg(windows)]
 use std::os::windows::process::CommandExt;
@@ -14,150 +15,372 @@ use std::os::windows::process::CommandExt;
 #[cfg(windows)]
 const CREATE_NO_WINDOW: u32 = 0x08000000;
 
+/// Pages extracted together on a miss. 7z archives are usually solid, so extracting one
+/// page decompresses its block up to that point; the pages after it come almost free.
+const EXTRACT_WINDOW: usize = 16;
+
+/// Byte budget for extracted pages, shared by every open 7z archive, until an application
+/// sets its own with `SevenZipImageArchive::set_extract_budget`.
+const DEFAULT_EXTRACT_BUDGET: u64 = 512 * 1024 * 1024;
+
+/// A page extracted to disk by one of the open archives.
+struct ExtractedFile {
+    archive: u64,
+    name: String,
+    path: PathBuf,
+    size: u64,
+}
+
+/// Extracted pages of all open 7z archives, least recently read first. Temp dirs are
+/// often on tmpfs, so this is kept under a byte budget by deleting the oldest files.
+struct ExtractStore {
+    files: VecDeque<ExtractedFile>,
+    stats: CacheStats,
+}
+
+static STORE: Mutex<ExtractStore> = Mutex::new(ExtractStore {
+    files: VecDeque::new(),
+    stats: CacheStats {
+        hits: 0,
+        misses: 0,
+        evictions: 0,
+        bytes: 0,
+        budget: DEFAULT_EXTRACT_BUDGET,
+    },
+});
+
+static NEXT_ARCHIVE_ID: AtomicU64 = AtomicU64::new(0);
+
+impl ExtractStore {
+    fn position(&self, archive: u64, name: &str) -> Option<usize> {
+        self.files
+            .iter()
+            .position(|file| file.archive == archive && file.name == name)
+    }
+
+    /// Look up an extracted page, marking it as the most recently read.
+    fn touch(&mut self, archive: u64, name: &str) -> Option<PathBuf> {
+        let file = self.files.remove(self.position(archive, name)?)?;
+        let path = file.path.clone();
+        self.files.push_back(file);
+        self.stats.hits += 1;
+        Some(path)
+    }
+
+    fn insert(&mut self, file: ExtractedFile) {
+        if let Some(old) = self.position(file.archive, &file.name) {
+            let old = self.files.remove(old).unwrap();
+            self.stats.bytes -= old.size;
+        }
+        self.stats.bytes += file.size;
+        self.files.push_back(file);
+    }
+
+    /// Delete the least recently read pages until the store fits its budget. The most
+    /// recent page is always kept, so a read never evicts what it just extracted.
+    fn evict(&mut self) {
+        while self.stats.bytes > self.stats.budget && self.files.len() > 1 {
+            let file = self.files.pop_front().unwrap();
+            if let Err(e) = fs::remove_file(&file.path) {
+                log::warn!("Failed to evict {:?}: {}", file.path, e);
+            }
+            self.stats.bytes -= file.size;
+            self.stats.evictions += 1;
+        }
+    }
+
+    /// Forget every page of a closed archive. Its temp dir removes the files.
+    fn purge(&mut self, archive: u64) {
+        let mut freed = 0;
+        self.files.retain(|file| {
+            let keep = file.archive != archive;
+            if !keep {
+                freed += file.size;
+            }
+            keep
+        });
+        self.stats.bytes -= freed;
+    }
+}
+
+/// The temp dir of one archive, deregistered from the store when the last clone drops.
+struct ExtractDir {
+    id: u64,
+    dir: TempDir,
+}
+
+impl Drop for ExtractDir {
+    fn drop(&mut self) {
+        if let Ok(mut store) = STORE.lock() {
+            store.purge(self.id);
+        }
+    }
+}
+
+/// An archive backend for 7z/CB7 comic archives using the external `7z` tool.
+///
+/// Opening only lists the archive. Pages are extracted into a temporary directory on
+/// first read, a window at a time, and deleted again once the extracted pages of all
+/// open archives exceed the budget set with [`SevenZipImageArchive::set_extract_budget`].
+/// Clones share the listing and the extracted files.
+#[derive(Clone)]
 pub struct SevenZipImageArchive {
-    #[allow(dead_code)]
     path: PathBuf,
-    entries: Vec<String>,
-    temp_dir: TempDir,
+    pages: PageTable,
+    has_manifest: bool,
+    temp: Arc<ExtractDir>,
+    /// Held while `7z` runs, so concurrent reads wait for one extraction instead of
+    /// starting their own.
+    extract_lock: Arc<Mutex<()>>,
 }
 
 impl SevenZipImageArchive {
     pub fn new(path: &Path) -> Result<Self, ArchiveError> {
+        log::info!("Listing archive: {:?}", path);
+
+        let mut cmd = Command::new("7z");
+        cmd.arg("l").arg("-slt").arg("--").arg(path);
+        cmd.stdin(Stdio::null());
+
+        #[cfg(windows)]
+        cmd.creation_flags(CREATE_NO_WINDOW);
+
+        let output = cmd.output().map_err(|_| ArchiveError::NoImages)?;
+        if !output.status.success() {
+            log::info!("7z listing failed for {:?}", path);
+            return Err(ArchiveError::NoImages);
+        }
+
+        let (names, mut entries) =
+            parse_technical_listing(&String::from_utf8_lossy(&output.stdout));
+        entries.retain(|entry| is_supported_format!(&entry.name));
+        entries.sort_by(|a, b| a.name.cmp(&b.name));
+        log::info!("Archive entries: {}", entries.len());
+        let has_manifest = names.iter().any(|name| name == "manifest.toml");
+        Self::from_index(path, entries.into(), has_manifest)
+    }
+
+    /// Rebuild an archive from what an earlier listing of the same file found.
+    pub(crate) fn from_index(
+        path: &Path,
+        pages: PageTable,
+        has_manifest: bool,
+    ) -> Result<Self, ArchiveError> {
         let temp_dir = tempfile::tempdir().map_err(|_| ArchiveError::NoImages)?;
-        log::info!("Extracting all files from archive: {:?}", path);
+        Ok(Self {
+            path: path.to_path_buf(),
+            pages,
+            has_manifest,
+            temp: Arc::new(ExtractDir {
+                id: NEXT_ARCHIVE_ID.fetch_add(1, Ordering::Relaxed),
+                dir: temp_dir,
+            }),
+            extract_lock: Arc::new(Mutex::new(())),
+        })
+    }
+
+    /// Set the byte budget for extracted pages across all open 7z archives, evicting
+    /// pages right away if the store is already over it.
+    pub fn set_extract_budget(bytes: u64) {
+        let mut store = STORE.lock().unwrap();
+        store.stats.budget = bytes;
+        store.evict();
+    }
+
+    /// Hit, miss and eviction counters of the extracted-page store.
+    pub fn extract_stats() -> CacheStats {
+        STORE.lock().unwrap().stats
+    }
+
+    /// Make sure `filename` is extracted, returning its path in the temp dir. On a miss,
+    /// it is extracted together with the pages after it that are not on disk yet, as
+    /// many as fit in half the budget.
+    fn ensure_extracted(&self, filename: &str) -> Result<PathBuf, ArchiveError> {
+        let id = self.temp.id;
+        if let Some(path) = STORE.lock().unwrap().touch(id, filename) {
+            return Ok(path);
+        }
+        let _guard = self.extract_lock.lock().unwrap();
+
+        let mut window = Vec::new();
+        {
+            let mut store = STORE.lock().unwrap();
+            if let Some(path) = store.touch(id, filename) {
+                return Ok(path);
+            }
+            store.stats.misses += 1;
+
+            if let Some(index) = self.pages.iter().position(|entry| entry.name == filename) {
+                let mut room = (store.stats.budget / 2).saturating_sub(self.pages[index].size);
+                for entry in self.pages[index + 1..].iter() {
+                    if window.len() + 1 >= EXTRACT_WINDOW || entry.size > room {
+                        break;
+                    }
+                    if store.position(id, &entry.name).is_none() {
+                        room -= entry.size;
+                        window.push(entry.name.clone());
+                    }
+                }
+            }
+        }
+        // Registered last, so the requested page is the most recently read.
+        window.push(filename.to_string());
+        log::debug!("Extracting {} entries from {:?}", window.len(), self.path);
 
         let mut cmd = Command::new("7z");
         cmd.arg("x")
-            .arg(path)
-            .arg(format!("-o{}", temp_dir.path().display()));
+            .arg("-y")
+            .arg("-bso0")
+            .arg("-bsp0")
+            .arg(format!("-o{}", self.temp.dir.path().display()))
+            .arg("--")
+            .arg(&self.path)
+            .args(&window);
+        cmd.stdin(Stdio::null());
 
         #[cfg(windows)]
         cmd.creation_flags(CREATE_NO_WINDOW);
 
         let status = cmd.status().map_err(|_| ArchiveError::NoImages)?;
-
         if !status.success() {
-            log::info!("7z extraction failed for {:?}", path);
+            log::info!("7z extraction failed for {:?}", self.path);
             return Err(ArchiveError::NoImages);
         }
 
-        // Recursively collect all supported image files from temp_dir
-        let mut entries = Vec::new();
-        for entry in walkdir::WalkDir::new(temp_dir.path())
-            .into_iter()
-            .filter_map(|e| e.ok())
-            .filter(|e| e.file_type().is_file())
-        {
-            let rel_path = entry
-                .path()
-                .strip_prefix(temp_dir.path())
-                .unwrap()
-                .to_string_lossy()
-                .to_string();
-            let rel_path_lower = rel_path.to_lowercase();
-            log::info!("found extracted file: '{}'", rel_path);
-            if is_supported_format!(&rel_path_lower) {
-                log::info!("accepted image: '{}'", rel_path);
-                entries.push(rel_path);
+        let mut store = STORE.lock().unwrap();
+        for name in window {
+            let path = self.temp.dir.path().join(&name);
+            match fs::metadata(&path) {
+                Ok(meta) if meta.is_file() => store.insert(ExtractedFile {
+                    archive: id,
+                    name,
+                    path,
+                    size: meta.len(),
+                }),
+                _ => {}
+            }
+        }
+        store.evict();
+        match store.position(id, filename) {
+            Some(index) => Ok(store.files[index].path.clone()),
+            None => {
+                log::info!("Extracted file not found: {:?}", filename);
+                Err(ArchiveError::NoImages)
             }
         }
-        entries.sort();
-        log::info!("Archive entries: {:?}", entries);
-
-        Ok(Self {
-            path: path.to_path_buf(),
-            entries,
-            temp_dir,
-        })
     }
 
-    fn read_file_by_name_sync(&self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
-        let extracted_path = self.temp_dir.path().join(filename);
-        log::info!("Reading extracted file at {:?}", extracted_path);
+    fn read_file_by_name_sync(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        // Another read may evict the page between extracting and reading it; extract it
+        // again in that case.
+        for _ in 0..2 {
+            let extracted_path = self.ensure_extracted(filename)?;
+            match fs::read(&extracted_path) {
+                Ok(buffer) => {
+                    log::debug!("Read {} bytes from {:?}", buffer.len(), extracted_path);
+                    return Ok(buffer.into());
+                }
+                Err(e) if e.kind() == std::io::ErrorKind::NotFound => {
+                    log::debug!("{:?} was evicted before it was read", extracted_path);
+                }
+                Err(_) => return Err(ArchiveError::NoImages),
+            }
+        }
+        Err(ArchiveError::NoImages)
+    }
 
-        if !extracted_path.exists() {
-            log::info!("Extracted file not found: {:?}", extracted_path);
-            return Err(ArchiveError::NoImages);
+    pub(crate) fn read_manifest_string_sync(&self) -> Result<String, ArchiveError> {
+        if !self.has_manifest {
+            return Err(ArchiveError::ManifestError(
+                "manifest.toml not found".into(),
+            ));
         }
+        let buffer = self.read_file_by_name_sync("manifest.toml")?;
+        String::from_utf8(buffer.to_vec())
+            .map_err(|_| ArchiveError::ManifestError("manifest.toml is not valid UTF-8".into()))
+    }
+}
+
+/// Parse the output of `7z l -slt`: every entry path in archive order, and the file
+/// entries as pages with their position in the archive.
+fn parse_technical_listing(listing: &str) -> (Vec<String>, Vec<EntryInfo>) {
+    let mut names = Vec::new();
+    let mut entries = Vec::new();
+    let mut current: Option<EntryInfo> = None;
+    let mut is_dir = false;
+    let mut position = 0;
 
-        let mut file = fs::File::open(&extracted_path).map_err(|_| ArchiveError::NoImages)?;
-        let mut buffer = Vec::new();
-        file.read_to_end(&mut buffer)
-            .map_err(|_| ArchiveError::NoImages)?;
-        log::info!(
-            "Successfully read {} bytes from {:?}",
-            buffer.len(),
-            extracted_path
-        );
-        Ok(buffer)
+    // Entry records follow the `----------` line; before it is the archive's own record.
+    let records = listing
+        .split_once("\n----------")
+        .map_or("", |(_, records)| records);
+    for line in records.lines() {
+        let Some((key, value)) = line.split_once(" = ") else {
+            continue;
+        };
+        let value = value.trim();
+        match key.trim() {
+            "Path" => {
+                if let Some(entry) = current.take().filter(|_| !is_dir) {
+                    entries.push(entry);
+                }
+                names.push(value.to_string());
+                let mut entry = EntryInfo::from_name(value);
+                entry.position = position;
+                position += 1;
+                current = Some(entry);
+                is_dir = false;
+            }
+            "Folder" => is_dir |= value == "+",
+            "Attributes" => is_dir |= value.starts_with('D'),
+            "Size" => {
+                if let Some(entry) = current.as_mut() {
+                    entry.size = value.parse().unwrap_or(0);
+                }
+            }
+            "Packed Size" => {
+                if let Some(entry) = current.as_mut() {
+                    entry.compressed_size = value.parse().unwrap_or(0);
+                }
+            }
+            "CRC" => {
+                if let Some(entry) = current.as_mut() {
+                    entry.crc32 = u32::from_str_radix(value, 16).ok();
+                }
+            }
+            _ => {}
+        }
+    }
+    if let Some(entry) = current.filter(|_| !is_dir) {
+        entries.push(entry);
     }
+    (names, entries)
 }
 
 #[cfg(feature = "async")]
 #[async_trait::async_trait]
 impl ImageArchiveTrait for SevenZipImageArchive {
-    fn list_images(&self) -> Vec<String> {
-        self.entries.clone()
+    fn pages(&self) -> PageTable {
+        self.pages.clone()
     }
 
-    fn read_image_by_name_sync(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
+    fn read_image_by_name_sync(&self, filename: &str) -> Result<Bytes, ArchiveError> {
         self.read_file_by_name_sync(filename)
     }
 
-    async fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
-        let temp_dir_path = self.temp_dir.path().to_path_buf();
+    async fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        let archive = self.clone();
         let filename = filename.to_string();
-        tokio::task::spawn_blocking(move || {
-            let extracted_path = temp_dir_path.join(&filename);
-            log::info!("Reading extracted file at {:?}", extracted_path);
-
-            if !extracted_path.exists() {
-                log::info!("Extracted file not found: {:?}", extracted_path);
-                return Err(ArchiveError::NoImages);
-            }
-
-            let mut file = fs::File::open(&extracted_path).map_err(|_| ArchiveError::NoImages)?;
-            let mut buffer = Vec::new();
-            file.read_to_end(&mut buffer)
-                .map_err(|_| ArchiveError::NoImages)?;
-            log::info!(
-                "Successfully read {} bytes from {:?}",
-                buffer.len(),
-                extracted_path
-            );
-            Ok(buffer)
-        })
-        .await
-        .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
+        tokio::task::spawn_blocking(move || archive.read_file_by_name_sync(&filename))
+            .await
+            .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
     }
 
     async fn read_manifest_string(&self) -> Result<String, ArchiveError> {
-        let temp_dir_path = self.temp_dir.path().to_path_buf();
-        let filename = "manifest.toml".to_string();
-        let buffer = tokio::task::spawn_blocking(move || {
-            let extracted_path = temp_dir_path.join(&filename);
-            log::info!("Reading extracted file at {:?}", extracted_path);
-
-            if !extracted_path.exists() {
-                log::info!("Extracted file not found: {:?}", extracted_path);
-                return Err(ArchiveError::NoImages);
-            }
-
-            let mut file = fs::File::open(&extracted_path).map_err(|_| ArchiveError::NoImages)?;
-            let mut buffer = Vec::new();
-            file.read_to_end(&mut buffer)
-                .map_err(|_| ArchiveError::NoImages)?;
-            log::info!(
-                "Successfully read {} bytes from {:?}",
-                buffer.len(),
-                extracted_path
-            );
-            Ok(buffer)
-        })
-        .await
-        .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))?;
-        String::from_utf8(buffer)
-            .map_err(|_| ArchiveError::ManifestError("manifest.toml is not valid UTF-8".into()))
+        let archive = self.clone();
+        tokio::task::spawn_blocking(move || archive.read_manifest_string_sync())
+            .await
+            .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
     }
 
     async fn read_manifest(&self) -> Result<Manifest, ArchiveError> {
@@ -167,7 +390,7 @@ impl ImageArchiveTrait for SevenZipImageArchive {
         Ok(manifest)
     }
 
-    async fn write_manifest(&mut self, _manifest: &Manifest) -> Result<(), ArchiveError> {
+    async fn write_manifest(&self, _manifest: &Manifest) -> Result<(), ArchiveError> {
         // TODO: implement writing manifest with CLI
         Ok(())
     }
@@ -176,26 +399,16 @@ impl ImageArchiveTrait for SevenZipImageArchive {
 #[cfg(not(feature = "async"))]
 // #[async_trait::async_trait]
 impl ImageArchiveTrait for SevenZipImageArchive {
-    fn list_images(&self) -> Vec<String> {
-        self.entries.clone()
+    fn pages(&self) -> PageTable {
+        self.pages.clone()
     }
 
-    fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
-        self.read_file_by_name(filename)
+    fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        self.read_file_by_name_sync(filename)
     }
 
     fn read_manifest_string(&self) -> Result<String, ArchiveError> {
-        match self.read_file_by_name("manifest.toml") {
-            Ok(buffer) => String::from_utf8(buffer).map_err(|_| {
-                ArchiveError::ManifestError("manifest.toml is not valid UTF-8".into())
-            }),
-            Err(_) => {
-                log::info!("manifest.toml not found in archive");
-                Err(ArchiveError::ManifestError(
-                    "manifest.toml not found".into(),
-                ))
-            }
-        }
+        self.read_manifest_string_sync()
     }
 
     fn read_manifest(&self) -> Result<Manifest, ArchiveError> {
@@ -205,7 +418,7 @@ impl ImageArchiveTrait for SevenZipImageArchive {
         Ok(manifest)
     }
 
-    fn write_manifest(&mut self, _manifest: &Manifest) -> Result<(), ArchiveError> {
+    fn write_manifest(&self, _manifest: &Manifest) -> Result<(), ArchiveError> {
         // TODO: implement writing manifest with CLI
         Ok(())
     }
@@ -0,0 +1,123 @@
+//! A local HTTP/1.1 server for testing the web client.
+//!
+//! Every path serves the same body with an `ETag`, so responses are cached but must be
+//! revalidated on each use. Connections are kept alive and counted, responses can be
+//! slowed down, and upcoming requests can be made to fail.
+
+use std::collections::VecDeque;
+use std::io::{BufRead, BufReader, Write};
+use std::net::{SocketAddr, TcpListener, TcpStream};
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+
+const ETAG: &str = "\"v1\"";
+
+/// What to do with a request instead of answering it.
+#[derive(Debug, Clone, Copy)]
+pub enum Fault {
+    /// Close the connection without a response.
+    Drop,
+    /// Answer with this status and an empty body.
+    Status(u16),
+}
+
+#[derive(Default)]
+struct State {
+    connections: AtomicUsize,
+    requests: AtomicUsize,
+    delay_ms: AtomicU64,
+    faults: Mutex<VecDeque<Fault>>,
+}
+
+pub struct TestServer {
+    addr: SocketAddr,
+    state: Arc<State>,
+}
+
+impl TestServer {
+    /// Serve `body` on a free local port until the test process exits.
+    pub fn start(body: Vec<u8>) -> Self {
+        let listener = TcpListener::bind("127.0.0.1:0").expect("bind test server");
+        let addr = listener.local_addr().unwrap();
+        let state = Arc::new(State::default());
+        let body = Arc::new(body);
+        let shared = state.clone();
+        std::thread::spawn(move || {
+            for stream in listener.incoming().flatten() {
+                shared.connections.fetch_add(1, Ordering::SeqCst);
+                let (state, body) = (shared.clone(), body.clone());
+                std::thread::spawn(move || serve(stream, &state, &body));
+            }
+        });
+        Self { addr, state }
+    }
+
+    pub fn url(&self, path: &str) -> String {
+        format!("http://{}/{}", self.addr, path.trim_start_matches('/'))
+    }
+
+    /// Connections accepted so far.
+    pub fn connections(&self) -> usize {
+        self.state.connections.load(Ordering::SeqCst)
+    }
+
+    /// Requests received so far, failed ones included.
+    pub fn requests(&self) -> usize {
+        self.state.requests.load(Ordering::SeqCst)
+    }
+
+    /// Wait this long before answering each request from now on.
+    pub fn set_delay(&self, delay: Duration) {
+        self.state
+            .delay_ms
+            .store(delay.as_millis() as u64, Ordering::SeqCst);
+    }
+
+    /// Fail the next requests, one fault each, in order.
+    pub fn fail_next(&self, faults: impl IntoIterator<Item = Fault>) {
+        self.state.faults.lock().unwrap().extend(faults);
+    }
+}
+
+fn serve(stream: TcpStream, state: &State, body: &[u8]) {
+    let mut reader = BufReader::new(stream.try_clone().unwrap());
+    let mut writer = stream;
+    loop {
+        let mut revalidating = false;
+        let mut line = String::new();
+        if reader.read_line(&mut line).unwrap_or(0) == 0 {
+            return;
+        }
+        loop {
+            line.clear();
+            if reader.read_line(&mut line).unwrap_or(0) == 0 {
+                return;
+            }
+            if line == "\r\n" {
+                break;
+            }
+            let lower = line.to_ascii_lowercase();
+            revalidating |= lower.starts_with("if-none-match:") && line.contains(ETAG);
+        }
+
+        state.requests.fetch_add(1, Ordering::SeqCst);
+        std::thread::sleep(Duration::from_millis(state.delay_ms.load(Ordering::SeqCst)));
+        let fault = state.faults.lock().unwrap().pop_front();
+        let (status, body) = match fault {
+            Some(Fault::Drop) => return,
+            Some(Fault::Status(status)) => (status, &[][..]),
+            None if revalidating => (304, &[][..]),
+            None => (200, body),
+        };
+        let mut response = format!(
+            "HTTP/1.1 {status} Test\r\nContent-Length: {}\r\nETag: {ETAG}\r\n\r\n",
+            body.len()
+        )
+        .into_bytes();
+        response.extend_from_slice(body);
+        if writer.write_all(&response).is_err() {
+            return;
+        }
+    }
+}
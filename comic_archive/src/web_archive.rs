@@ -1,65 +1,175 @@
+use crate::is_supported_format;
 use crate::prelude::*;
+use crate::web_client::WebClient;
+use std::collections::HashSet;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::mpsc;
 
+/// Pages saved per append while mirroring. Each append ends with a new central directory,
+/// so an interrupted mirror keeps every batch written before it stopped.
+const MIRROR_BATCH: usize = 16;
+
+/// An archive whose pages are external URLs listed in the manifest of `inner`.
 pub struct WebImageArchive<T> {
     pub inner: T,
     pub manifest: Manifest,
+    pages: PageTable,
+    client: Arc<WebClient>,
 }
 
 impl<T: ImageArchiveTrait> WebImageArchive<T> {
+    /// Fetch pages through the process-wide `WebClient::shared()`.
     pub fn new(inner: T, manifest: Manifest) -> Self {
-        Self { inner, manifest }
+        Self::with_client(inner, manifest, WebClient::shared())
     }
-}
 
-#[cfg(feature = "async")]
-#[async_trait::async_trait]
-impl<T: ImageArchiveTrait + Send + Sync> ImageArchiveTrait for WebImageArchive<T> {
-    fn list_images(&self) -> Vec<String> {
-        if let Some(images) = self.manifest.external_pages.clone() {
-            images.urls
-        } else {
-            vec![]
+    pub fn with_client(inner: T, manifest: Manifest, client: Arc<WebClient>) -> Self {
+        let pages = manifest
+            .external_pages
+            .as_ref()
+            .map(|pages| pages.urls.iter().map(EntryInfo::from_name).collect())
+            .unwrap_or_default();
+        Self {
+            inner,
+            manifest,
+            pages,
+            client,
         }
     }
+}
 
-    fn read_image_by_name_sync(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
-        let resp = reqwest::blocking::get(filename).map_err(|e| {
-            ArchiveError::NetworkError(format!("Failed to GET {}: {}", filename, e))
+impl WebImageArchive<ZipImageArchive> {
+    /// Download every page into the archive, next to its manifest, `parallel` at a time,
+    /// then mark the manifest local so later opens read the pages from disk. Pages are
+    /// named by their number and saved in batches as they arrive; pages already saved are
+    /// skipped, so an interrupted mirror resumes where it stopped. `progress` gets the
+    /// number of pages saved and the total after each batch.
+    ///
+    /// If any page fails, the rest are still saved and the archive stays a web archive.
+    pub fn mirror(
+        &self,
+        parallel: usize,
+        mut progress: impl FnMut(usize, usize),
+    ) -> Result<(), ArchiveError> {
+        let total = self.pages.len();
+        let width = total.to_string().len().max(3);
+        let stem = |index: usize| format!("{:0width$}", index + 1);
+
+        let saved: HashSet<String> = self
+            .inner
+            .pages()
+            .iter()
+            .filter_map(|entry| entry.name.rsplit_once('.'))
+            .map(|(stem, _)| stem.to_string())
+            .collect();
+        let missing: Vec<usize> = (0..total).filter(|&i| !saved.contains(&stem(i))).collect();
+        let mut done = total - missing.len();
+        log::info!("Mirroring {} of {} pages", missing.len(), total);
+
+        let (tx, rx) = mpsc::sync_channel(parallel.max(1) * 2);
+        let next = AtomicUsize::new(0);
+        let (missing, next) = (&missing, &next);
+        let (failed, first_error) = std::thread::scope(|scope| {
+            for _ in 0..parallel.max(1).min(missing.len()) {
+                let tx = tx.clone();
+                scope.spawn(move || {
+                    while let Some(&index) = missing.get(next.fetch_add(1, Ordering::Relaxed)) {
+                        let result = self.download(&self.pages[index].name);
+                        // The receiver is gone once saving has failed; stop downloading.
+                        if tx.send((index, result)).is_err() {
+                            break;
+                        }
+                    }
+                });
+            }
+            drop(tx);
+
+            let mut batch: Vec<(String, Bytes)> = Vec::with_capacity(MIRROR_BATCH);
+            let mut failed = 0;
+            let mut first_error = None;
+            for (index, result) in rx {
+                let url = &self.pages[index].name;
+                let page = result.and_then(|data| {
+                    let name = ImageFormat::detect(&data, url)
+                        .extension()
+                        .map(|ext| format!("{}.{}", stem(index), ext))
+                        .filter(|name| is_supported_format!(name))
+                        .ok_or_else(|| ArchiveError::Other(format!("{} is not an image", url)))?;
+                    Ok((name, data))
+                });
+                match page {
+                    Ok(page) => batch.push(page),
+                    Err(e) => {
+                        log::warn!("Failed to mirror {}: {}", url, e);
+                        failed += 1;
+                        first_error.get_or_insert(e);
+                    }
+                }
+                if batch.len() == MIRROR_BATCH {
+                    done += self.save(&mut batch)?;
+                    progress(done, total);
+                }
+            }
+            if !batch.is_empty() {
+                done += self.save(&mut batch)?;
+                progress(done, total);
+            }
+            Ok::<_, ArchiveError>((failed, first_error))
         })?;
 
-        if !resp.status().is_success() {
+        if let Some(e) = first_error {
             return Err(ArchiveError::NetworkError(format!(
-                "HTTP error {} for {}",
-                resp.status(),
-                filename
+                "{} of {} pages could not be mirrored; run again to retry them. First error: {}",
+                failed, total, e
             )));
         }
+        let mut manifest = self.manifest.clone();
+        manifest.meta.web_archive = false;
+        self.inner.write_manifest_sync(&manifest)
+    }
 
-        let bytes = resp.bytes().map_err(|e| {
-            ArchiveError::NetworkError(format!("Failed to read bytes from {}: {}", filename, e))
-        })?;
+    fn download(&self, url: &str) -> Result<Bytes, ArchiveError> {
+        #[cfg(feature = "async")]
+        return self.client.get_blocking(url);
+        #[cfg(not(feature = "async"))]
+        return self.client.get(url);
+    }
 
-        Ok(bytes.to_vec())
+    /// Append `batch` to the archive, emptying it. Returns the number of pages saved.
+    fn save(&self, batch: &mut Vec<(String, Bytes)>) -> Result<usize, ArchiveError> {
+        let files: Vec<(&str, &[u8])> = batch
+            .iter()
+            .map(|(name, data)| (name.as_str(), &data[..]))
+            .collect();
+        self.inner.append_files(&files)?;
+        let saved = batch.len();
+        batch.clear();
+        Ok(saved)
     }
+}
 
-    async fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
-        let resp = reqwest::get(filename).await.map_err(|e| {
-            ArchiveError::NetworkError(format!("Failed to GET {}: {}", filename, e))
-        })?;
+#[cfg(feature = "async")]
+#[async_trait::async_trait]
+impl<T: ImageArchiveTrait + Send + Sync> ImageArchiveTrait for WebImageArchive<T> {
+    fn pages(&self) -> PageTable {
+        self.pages.clone()
+    }
 
-        if !resp.status().is_success() {
-            return Err(ArchiveError::NetworkError(format!(
-                "HTTP error {} for {}",
-                resp.status(),
-                filename
-            )));
-        }
+    fn read_image_by_name_sync(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        self.client.get_blocking(filename)
+    }
 
-        let bytes = resp.bytes().await.map_err(|e| {
-            ArchiveError::NetworkError(format!("Failed to read bytes from {}: {}", filename, e))
-        })?;
+    async fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        self.client.get(filename).await
+    }
+
+    fn prefetch_window(&self) -> Option<usize> {
+        self.client.prefetch_window()
+    }
 
-        Ok(bytes.to_vec())
+    async fn prefetch_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        self.client.get_speculative(filename).await
     }
 
     async fn read_manifest_string(&self) -> Result<String, ArchiveError> {
@@ -73,39 +183,23 @@ impl<T: ImageArchiveTrait + Send + Sync> ImageArchiveTrait for WebImageArchive<T
             .or_else(|_| Ok(self.manifest.clone()))
     }
 
-    async fn write_manifest(&mut self, manifest: &Manifest) -> Result<(), ArchiveError> {
+    async fn write_manifest(&self, manifest: &Manifest) -> Result<(), ArchiveError> {
         self.inner.write_manifest(manifest).await
     }
 }
 
 #[cfg(not(feature = "async"))]
 impl<T: ImageArchiveTrait> ImageArchiveTrait for WebImageArchive<T> {
-    fn list_images(&self) -> Vec<String> {
-        if let Some(images) = self.manifest.external_pages.clone() {
-            images.urls
-        } else {
-            vec![]
-        }
+    fn pages(&self) -> PageTable {
+        self.pages.clone()
     }
 
-    fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
-        let resp = reqwest::blocking::get(filename).map_err(|e| {
-            ArchiveError::NetworkError(format!("Failed to GET {}: {}", filename, e))
-        })?;
-
-        if !resp.status().is_success() {
-            return Err(ArchiveError::NetworkError(format!(
-                "HTTP error {} for {}",
-                resp.status(),
-                filename
-            )));
-        }
-
-        let bytes = resp.bytes().map_err(|e| {
-            ArchiveError::NetworkError(format!("Failed to read bytes from {}: {}", filename, e))
-        })?;
+    fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        self.client.get(filename)
+    }
 
-        Ok(bytes.to_vec())
+    fn prefetch_window(&self) -> Option<usize> {
+        self.client.prefetch_window()
     }
 
     fn read_manifest_string(&self) -> Result<String, ArchiveError> {
@@ -118,7 +212,7 @@ impl<T: ImageArchiveTrait> ImageArchiveTrait for WebImageArchive<T> {
             .or_else(|_| Ok(self.manifest.clone()))
     }
 
-    fn write_manifest(&mut self, manifest: &Manifest) -> Result<(), ArchiveError> {
+    fn write_manifest(&self, manifest: &Manifest) -> Result<(), ArchiveError> {
         self.inner.write_manifest(manifest)
     }
 }
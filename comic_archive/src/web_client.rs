@@ -0,0 +1,931 @@
+//! The HTTP client shared by web archives.
+//!
+//! One pooled client serves every page request, so pages from the same host reuse warm
+//! connections, multiplexed over HTTP/2 when the server offers it through ALPN, instead
+//! of paying a TCP and TLS handshake per page. Requests in flight to each host are
+//! capped, so a read-ahead burst queues up rather than opening a connection per page.
+//! Responses go through an on-disk cache (see `http_cache`) when one is configured.
+//!
+//! Completed downloads feed a running estimate of latency and throughput, which sizes the
+//! prefetch window. Speculative fetches wait while a page being displayed is downloading,
+//! and never take a host's last free slot, so prefetching cannot delay what is on screen.
+//! A host limited to a single slot is the exception: prefetching shares that slot, and
+//! only waiting for visible fetches keeps it out of their way.
+//!
+//! Each `get` runs under a deadline. Timeouts, dropped connections and 5xx responses are
+//! retried with exponential backoff, and a visible request that runs past the 95th
+//! percentile of recent downloads is hedged with a second copy; the first to finish wins.
+
+use std::collections::{HashMap, VecDeque};
+use std::path::PathBuf;
+#[cfg(feature = "async")]
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex, OnceLock};
+use std::time::{Duration, Instant};
+
+use bytes::Bytes;
+
+use crate::error::ArchiveError;
+use crate::http_cache::{CacheEntry, CacheMeta, HttpCache};
+use crate::model::CacheStats;
+
+/// Settings for a `WebClient`.
+#[derive(Debug, Clone)]
+pub struct WebClientConfig {
+    /// Limit on establishing a connection, TLS handshake included.
+    pub connect_timeout: Duration,
+    /// Limit on one attempt, from sending the request to the last byte of the body.
+    pub request_timeout: Duration,
+    /// Limit on a whole `get`, retries included.
+    pub deadline: Duration,
+    /// Attempts after the first, for failures that may pass: timeouts, dropped
+    /// connections, 5xx, 408 and 429.
+    pub retries: u32,
+    /// Wait before the first retry; it doubles for each retry after that.
+    pub retry_backoff: Duration,
+    /// Send a second copy of a visible request once it is slower than the 95th
+    /// percentile of recent downloads.
+    pub hedge: bool,
+    /// How long an idle connection is kept open for reuse.
+    pub pool_idle_timeout: Duration,
+    /// Requests in flight to one host at a time.
+    pub max_per_host: usize,
+    /// Where responses are cached on disk, or `None` to always download.
+    pub cache_dir: Option<PathBuf>,
+    /// Most bytes of response bodies kept in `cache_dir`.
+    pub cache_max_bytes: u64,
+}
+
+impl Default for WebClientConfig {
+    fn default() -> Self {
+        Self {
+            connect_timeout: Duration::from_secs(10),
+            request_timeout: Duration::from_secs(20),
+            deadline: Duration::from_secs(60),
+            retries: 3,
+            retry_backoff: Duration::from_millis(250),
+            hedge: true,
+            pool_idle_timeout: Duration::from_secs(90),
+            max_per_host: 6,
+            cache_dir: crate::user_cache_dir().map(|dir| dir.join("http")),
+            cache_max_bytes: 1024 * 1024 * 1024,
+        }
+    }
+}
+
+static SHARED: OnceLock<Arc<WebClient>> = OnceLock::new();
+
+/// Download time the prefetch window is sized to cover.
+const PREFETCH_HORIZON: Duration = Duration::from_secs(4);
+/// Most pages a web archive asks to have prefetched.
+const MAX_PREFETCH: usize = 32;
+/// Weight of the newest download in the running estimates.
+const ESTIMATE_WEIGHT: f64 = 0.25;
+/// Download times kept for the hedging delay.
+const RECENT_DOWNLOADS: usize = 64;
+/// Download times needed before requests are hedged.
+#[cfg(any(test, feature = "async"))]
+const MIN_HEDGE_SAMPLES: usize = 16;
+
+/// Network conditions measured from completed downloads.
+#[derive(Debug, Clone, Copy)]
+pub struct LinkEstimate {
+    /// Seconds from sending a request to receiving its response headers.
+    pub latency: f64,
+    /// Body bytes per second of a single download.
+    pub throughput: f64,
+    /// Average body size in bytes.
+    pub page_bytes: f64,
+}
+
+impl LinkEstimate {
+    /// Seconds one more page takes to download.
+    pub fn page_time(&self) -> f64 {
+        self.latency + self.page_bytes / self.throughput
+    }
+
+    /// Pages `parallel` downloads get through in `PREFETCH_HORIZON`, at least one and at
+    /// most `MAX_PREFETCH`.
+    fn prefetch_window(&self, parallel: usize) -> usize {
+        let pages = parallel as f64 * PREFETCH_HORIZON.as_secs_f64() / self.page_time();
+        (pages.round() as usize).clamp(1, MAX_PREFETCH)
+    }
+
+    fn update(estimate: &mut Option<Self>, sample: Self) {
+        let blend = |old: f64, new: f64| old + ESTIMATE_WEIGHT * (new - old);
+        *estimate = Some(match *estimate {
+            Some(old) => LinkEstimate {
+                latency: blend(old.latency, sample.latency),
+                throughput: blend(old.throughput, sample.throughput),
+                page_bytes: blend(old.page_bytes, sample.page_bytes),
+            },
+            None => sample,
+        });
+    }
+}
+
+/// What completed downloads have shown about the network.
+#[derive(Default)]
+struct Link {
+    estimate: Option<LinkEstimate>,
+    /// Durations of the latest downloads, oldest first.
+    recent: VecDeque<Duration>,
+}
+
+impl Link {
+    /// The 95th percentile of recent downloads, once there are enough to tell.
+    #[cfg(any(test, feature = "async"))]
+    fn percentile_95(&self) -> Option<Duration> {
+        if self.recent.len() < MIN_HEDGE_SAMPLES {
+            return None;
+        }
+        let mut recent: Vec<Duration> = self.recent.iter().copied().collect();
+        recent.sort_unstable();
+        Some(recent[recent.len() * 95 / 100])
+    }
+}
+
+/// Whether a page is wanted now or ahead of time.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum FetchPriority {
+    /// The page is being displayed.
+    Visible,
+    /// The page is being prefetched; yields to visible fetches.
+    Speculative,
+}
+
+/// A pooled HTTP client with a per-host cap on concurrent requests.
+pub struct WebClient {
+    config: WebClientConfig,
+    #[cfg(feature = "async")]
+    client: reqwest::Client,
+    #[cfg(not(feature = "async"))]
+    client: reqwest::blocking::Client,
+    hosts: Mutex<HashMap<String, Arc<Host>>>,
+    cache: Option<Arc<HttpCache>>,
+    link: Mutex<Link>,
+    #[cfg(feature = "async")]
+    visible: VisibleGate,
+}
+
+/// Request slots for one host.
+struct Host {
+    slots: HostSlots,
+    /// Held by speculative fetches on top of a slot. One fewer than `slots`, so a visible
+    /// fetch always finds a slot that prefetching cannot take, except with a single slot,
+    /// which prefetching shares rather than never running.
+    #[cfg(feature = "async")]
+    speculative: HostSlots,
+}
+
+/// The outcome of a request that may have been a revalidation.
+enum Fetched {
+    Full(Bytes, Option<CacheMeta>),
+    NotModified(CacheMeta),
+}
+
+/// A failed attempt, and whether another one could succeed.
+struct Failure {
+    error: ArchiveError,
+    transient: bool,
+}
+
+impl Failure {
+    /// Anything but a malformed request or a redirect loop may go through on a retry.
+    fn request(what: String, e: reqwest::Error) -> Self {
+        Self {
+            transient: !(e.is_builder() || e.is_redirect()),
+            error: ArchiveError::NetworkError(format!("{what}: {e}")),
+        }
+    }
+
+    fn status(url: &str, status: reqwest::StatusCode) -> Self {
+        Self {
+            transient: status.is_server_error()
+                || status == reqwest::StatusCode::REQUEST_TIMEOUT
+                || status == reqwest::StatusCode::TOO_MANY_REQUESTS,
+            error: ArchiveError::NetworkError(format!("HTTP error {} for {}", status, url)),
+        }
+    }
+}
+
+impl WebClient {
+    pub fn new(config: WebClientConfig) -> Result<Self, ArchiveError> {
+        #[cfg(feature = "async")]
+        let builder = reqwest::Client::builder();
+        #[cfg(not(feature = "async"))]
+        let builder = reqwest::blocking::Client::builder();
+
+        let client = builder
+            .connect_timeout(config.connect_timeout)
+            .timeout(config.request_timeout)
+            .pool_idle_timeout(config.pool_idle_timeout)
+            .pool_max_idle_per_host(config.max_per_host)
+            .tcp_keepalive(config.pool_idle_timeout)
+            .build()
+            .map_err(|e| ArchiveError::NetworkError(format!("Failed to build client: {}", e)))?;
+
+        let cache = config
+            .cache_dir
+            .clone()
+            .map(|dir| Arc::new(HttpCache::new(dir, config.cache_max_bytes)));
+
+        Ok(Self {
+            config,
+            client,
+            hosts: Mutex::new(HashMap::new()),
+            cache,
+            link: Mutex::new(Link::default()),
+            #[cfg(feature = "async")]
+            visible: VisibleGate::default(),
+        })
+    }
+
+    /// The client used by web archives unless they are given their own. Built with the
+    /// default config on first use, unless `install_shared` came first.
+    pub fn shared() -> Arc<WebClient> {
+        SHARED
+            .get_or_init(|| {
+                Arc::new(
+                    WebClient::new(WebClientConfig::default())
+                        .expect("HTTP client with default settings"),
+                )
+            })
+            .clone()
+    }
+
+    /// Build the shared client with `config`. Fails if it is already in use.
+    pub fn install_shared(config: WebClientConfig) -> Result<(), ArchiveError> {
+        let client = Arc::new(WebClient::new(config)?);
+        SHARED
+            .set(client)
+            .map_err(|_| ArchiveError::Other("Shared HTTP client already in use".into()))
+    }
+
+    pub fn config(&self) -> &WebClientConfig {
+        &self.config
+    }
+
+    /// Latency and throughput measured so far, if anything has been downloaded.
+    pub fn estimate(&self) -> Option<LinkEstimate> {
+        self.link.lock().unwrap().estimate
+    }
+
+    /// Pages worth prefetching: as many as the spare slots of a host can download in
+    /// `PREFETCH_HORIZON` at the measured speed. `None` before the first download.
+    pub fn prefetch_window(&self) -> Option<usize> {
+        let estimate = self.estimate()?;
+        Some(estimate.prefetch_window(self.config.max_per_host.saturating_sub(1).max(1)))
+    }
+
+    /// Fold a completed download into the estimate.
+    fn record(&self, started: Instant, headers_at: Instant, bytes: usize) {
+        let transfer = headers_at.elapsed().as_secs_f64().max(0.001);
+        let mut link = self.link.lock().unwrap();
+        LinkEstimate::update(
+            &mut link.estimate,
+            LinkEstimate {
+                latency: (headers_at - started).as_secs_f64(),
+                throughput: bytes.max(1) as f64 / transfer,
+                page_bytes: bytes as f64,
+            },
+        );
+        if link.recent.len() == RECENT_DOWNLOADS {
+            link.recent.pop_front();
+        }
+        link.recent.push_back(started.elapsed());
+    }
+
+    /// How long a visible request may run before it is hedged: the 95th percentile of
+    /// recent downloads. `None` when hedging is off or there are too few to tell.
+    #[cfg(feature = "async")]
+    fn hedge_delay(&self) -> Option<Duration> {
+        if !self.config.hedge {
+            return None;
+        }
+        self.link.lock().unwrap().percentile_95()
+    }
+
+    /// How long to wait before retrying after `failure`, or `None` to give up because
+    /// the failure is permanent, the retries are used up or the wait would pass
+    /// `deadline`. The wait doubles with each attempt, with jitter so that pages which
+    /// failed together do not all retry at the same moment.
+    fn retry_delay(&self, attempt: u32, failure: &Failure, deadline: Instant) -> Option<Duration> {
+        if !failure.transient || attempt >= self.config.retries {
+            return None;
+        }
+        let backoff = self
+            .config
+            .retry_backoff
+            .saturating_mul(1 << attempt.min(16));
+        let delay = backoff.mul_f64(0.5 + 0.5 * jitter());
+        (Instant::now() + delay < deadline).then_some(delay)
+    }
+
+    /// Time left for one attempt before `deadline`.
+    fn attempt_timeout(&self, deadline: Instant) -> Duration {
+        self.config
+            .request_timeout
+            .min(deadline.saturating_duration_since(Instant::now()))
+    }
+
+    /// Hit, miss and eviction counters of the disk cache, if there is one. Revalidated
+    /// entries count as hits.
+    pub fn cache_stats(&self) -> Option<CacheStats> {
+        self.cache.as_ref().map(|cache| cache.stats())
+    }
+
+    /// Settle a request against the cached entry it may have revalidated: store what
+    /// came back, or fall back to the cached body if the request failed.
+    fn settle(
+        cache: &HttpCache,
+        url: &str,
+        cached: Option<CacheEntry>,
+        fetched: Result<Fetched, ArchiveError>,
+    ) -> Result<Bytes, ArchiveError> {
+        match (fetched, cached) {
+            (Ok(Fetched::NotModified(meta)), Some(entry)) => {
+                cache.record_hit();
+                cache.store_meta(&meta);
+                Ok(entry.body)
+            }
+            (Ok(Fetched::NotModified(_)), None) => Err(ArchiveError::NetworkError(format!(
+                "Unexpected 304 for {}",
+                url
+            ))),
+            (Ok(Fetched::Full(body, meta)), _) => {
+                cache.record_miss();
+                if let Some(meta) = meta {
+                    cache.store(&meta, &body);
+                }
+                Ok(body)
+            }
+            (Err(e), Some(entry)) => {
+                log::warn!("Serving cached copy of {}: {}", url, e);
+                cache.record_hit();
+                Ok(entry.body)
+            }
+            (Err(e), None) => Err(e),
+        }
+    }
+
+    /// The request slots for the host (and port) of `url`.
+    fn host(&self, url: &str) -> Arc<Host> {
+        let host = reqwest::Url::parse(url)
+            .ok()
+            .and_then(|url| {
+                let host = url.host_str()?.to_string();
+                Some(match url.port_or_known_default() {
+                    Some(port) => format!("{host}:{port}"),
+                    None => host,
+                })
+            })
+            .unwrap_or_default();
+        self.hosts
+            .lock()
+            .unwrap()
+            .entry(host)
+            .or_insert_with(|| {
+                let slots = self.config.max_per_host.max(1);
+                Arc::new(Host {
+                    slots: HostSlots::new(slots),
+                    #[cfg(feature = "async")]
+                    speculative: HostSlots::new(slots.saturating_sub(1).max(1)),
+                })
+            })
+            .clone()
+    }
+
+    /// GET `url`, from the disk cache when it holds a fresh copy, revalidating a stale
+    /// one, and otherwise downloading it.
+    #[cfg(feature = "async")]
+    pub async fn get(&self, url: &str) -> Result<Bytes, ArchiveError> {
+        self.get_with(url, FetchPriority::Visible).await
+    }
+
+    /// `get` for a page that is only being prefetched.
+    #[cfg(feature = "async")]
+    pub async fn get_speculative(&self, url: &str) -> Result<Bytes, ArchiveError> {
+        self.get_with(url, FetchPriority::Speculative).await
+    }
+
+    #[cfg(feature = "async")]
+    async fn get_with(&self, url: &str, priority: FetchPriority) -> Result<Bytes, ArchiveError> {
+        let Some(cache) = self.cache.clone() else {
+            return match self.fetch(url, None, priority).await? {
+                Fetched::Full(body, _) => Ok(body),
+                Fetched::NotModified(_) => unreachable!("request was not conditional"),
+            };
+        };
+
+        let lookup = {
+            let (cache, url) = (cache.clone(), url.to_string());
+            move || cache.lookup(&url)
+        };
+        let cached = tokio::task::spawn_blocking(lookup).await.ok().flatten();
+        if let Some(entry) = cached.as_ref().filter(|entry| entry.meta.is_fresh()) {
+            cache.record_hit();
+            return Ok(entry.body.clone());
+        }
+
+        let fetched = self
+            .fetch(url, cached.as_ref().map(|entry| &entry.meta), priority)
+            .await;
+        let url = url.to_string();
+        tokio::task::spawn_blocking(move || Self::settle(&cache, &url, cached, fetched))
+            .await
+            .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
+    }
+
+    /// Send a GET, conditional on `cached` if given, retrying transient failures until
+    /// the deadline. Speculative fetches first wait until no visible fetch is running.
+    #[cfg(feature = "async")]
+    async fn fetch(
+        &self,
+        url: &str,
+        cached: Option<&CacheMeta>,
+        priority: FetchPriority,
+    ) -> Result<Fetched, ArchiveError> {
+        let host = self.host(url);
+        let closed = |e| ArchiveError::Other(format!("Host limiter closed: {e}"));
+        let _visible = match priority {
+            FetchPriority::Visible => Some(self.visible.enter()),
+            FetchPriority::Speculative => {
+                self.visible.idle().await;
+                None
+            }
+        };
+        let _speculative = match priority {
+            FetchPriority::Visible => None,
+            FetchPriority::Speculative => Some(host.speculative.acquire().await.map_err(closed)?),
+        };
+
+        let deadline = Instant::now() + self.config.deadline;
+        let mut attempt = 0;
+        loop {
+            let timeout = self.attempt_timeout(deadline);
+            let result = {
+                let _slot = host.slots.acquire().await.map_err(closed)?;
+                match priority {
+                    FetchPriority::Visible => self.send_hedged(&host, url, cached, timeout).await,
+                    FetchPriority::Speculative => self.send(url, cached, timeout).await,
+                }
+            };
+            let failure = match result {
+                Ok(fetched) => return Ok(fetched),
+                Err(failure) => failure,
+            };
+            let Some(delay) = self.retry_delay(attempt, &failure, deadline) else {
+                return Err(failure.error);
+            };
+            log::debug!("Retrying {} in {:?}: {}", url, delay, failure.error);
+            tokio::time::sleep(delay).await;
+            attempt += 1;
+        }
+    }
+
+    /// `send`, plus a second copy of the request if the first is still running after
+    /// `hedge_delay` and the host has a slot to spare. The first success wins and the
+    /// other request is dropped, which cancels it.
+    #[cfg(feature = "async")]
+    async fn send_hedged(
+        &self,
+        host: &Host,
+        url: &str,
+        cached: Option<&CacheMeta>,
+        timeout: Duration,
+    ) -> Result<Fetched, Failure> {
+        let first = self.send(url, cached, timeout);
+        let Some(delay) = self.hedge_delay().filter(|&delay| delay < timeout) else {
+            return first.await;
+        };
+        tokio::pin!(first);
+        tokio::select! {
+            result = &mut first => return result,
+            _ = tokio::time::sleep(delay) => {}
+        }
+        let Ok(_slot) = host.slots.try_acquire() else {
+            return first.await;
+        };
+        log::debug!("Hedging {} after {:?}", url, delay);
+        let second = self.send(url, cached, timeout - delay);
+        tokio::pin!(second);
+        tokio::select! {
+            result = &mut first => match result {
+                Ok(fetched) => Ok(fetched),
+                Err(_) => second.await,
+            },
+            result = &mut second => match result {
+                Ok(fetched) => Ok(fetched),
+                Err(_) => first.await,
+            },
+        }
+    }
+
+    /// One attempt at a GET, conditional on `cached` if given.
+    #[cfg(feature = "async")]
+    async fn send(
+        &self,
+        url: &str,
+        cached: Option<&CacheMeta>,
+        timeout: Duration,
+    ) -> Result<Fetched, Failure> {
+        let started = Instant::now();
+        let mut request = self.client.get(url).timeout(timeout);
+        if let Some(meta) = cached {
+            request = request.headers(meta.conditional_headers());
+        }
+        let resp = request
+            .send()
+            .await
+            .map_err(|e| Failure::request(format!("Failed to GET {}", url), e))?;
+        let headers_at = Instant::now();
+        if let (Some(meta), reqwest::StatusCode::NOT_MODIFIED) = (cached, resp.status()) {
+            return Ok(Fetched::NotModified(meta.revalidated(resp.headers())));
+        }
+        if !resp.status().is_success() {
+            return Err(Failure::status(url, resp.status()));
+        }
+        let meta = CacheMeta::from_headers(url, resp.headers());
+        let body = resp
+            .bytes()
+            .await
+            .map_err(|e| Failure::request(format!("Failed to read bytes from {}", url), e))?;
+        self.record(started, headers_at, body.len());
+        Ok(Fetched::Full(body, meta))
+    }
+
+    /// Blocking `get` through the same pool. Call it from a blocking context such as
+    /// `spawn_blocking`. Outside a runtime the request runs on a small background runtime,
+    /// started on first use and kept so its connections stay open for the next request.
+    #[cfg(feature = "async")]
+    pub fn get_blocking(&self, url: &str) -> Result<Bytes, ArchiveError> {
+        static BACKGROUND: OnceLock<tokio::runtime::Runtime> = OnceLock::new();
+        if let Ok(handle) = tokio::runtime::Handle::try_current() {
+            return handle.block_on(self.get(url));
+        }
+        let runtime = match BACKGROUND.get() {
+            Some(runtime) => runtime,
+            None => {
+                let runtime = tokio::runtime::Builder::new_multi_thread()
+                    .worker_threads(2)
+                    .thread_name("web-client")
+                    .enable_all()
+                    .build()?;
+                BACKGROUND.get_or_init(|| runtime)
+            }
+        };
+        runtime.block_on(self.get(url))
+    }
+
+    /// GET `url`, from the disk cache when it holds a fresh copy, revalidating a stale
+    /// one, and otherwise downloading it.
+    #[cfg(not(feature = "async"))]
+    pub fn get(&self, url: &str) -> Result<Bytes, ArchiveError> {
+        let Some(cache) = self.cache.as_deref() else {
+            return match self.fetch(url, None)? {
+                Fetched::Full(body, _) => Ok(body),
+                Fetched::NotModified(_) => unreachable!("request was not conditional"),
+            };
+        };
+
+        let cached = cache.lookup(url);
+        if let Some(entry) = cached.as_ref().filter(|entry| entry.meta.is_fresh()) {
+            cache.record_hit();
+            return Ok(entry.body.clone());
+        }
+        let fetched = self.fetch(url, cached.as_ref().map(|entry| &entry.meta));
+        Self::settle(cache, url, cached, fetched)
+    }
+
+    /// Send a GET, conditional on `cached` if given, retrying transient failures until
+    /// the deadline. Requests are not hedged without the async runtime.
+    #[cfg(not(feature = "async"))]
+    fn fetch(&self, url: &str, cached: Option<&CacheMeta>) -> Result<Fetched, ArchiveError> {
+        let host = self.host(url);
+        let deadline = Instant::now() + self.config.deadline;
+        let mut attempt = 0;
+        loop {
+            let timeout = self.attempt_timeout(deadline);
+            let result = {
+                let _slot = host.slots.acquire();
+                self.send(url, cached, timeout)
+            };
+            let failure = match result {
+                Ok(fetched) => return Ok(fetched),
+                Err(failure) => failure,
+            };
+            let Some(delay) = self.retry_delay(attempt, &failure, deadline) else {
+                return Err(failure.error);
+            };
+            log::debug!("Retrying {} in {:?}: {}", url, delay, failure.error);
+            std::thread::sleep(delay);
+            attempt += 1;
+        }
+    }
+
+    /// One attempt at a GET, conditional on `cached` if given.
+    #[cfg(not(feature = "async"))]
+    fn send(
+        &self,
+        url: &str,
+        cached: Option<&CacheMeta>,
+        timeout: Duration,
+    ) -> Result<Fetched, Failure> {
+        let started = Instant::now();
+        let mut request = self.client.get(url).timeout(timeout);
+        if let Some(meta) = cached {
+            request = request.headers(meta.conditional_headers());
+        }
+        let resp = request
+            .send()
+            .map_err(|e| Failure::request(format!("Failed to GET {}", url), e))?;
+        let headers_at = Instant::now();
+        if let (Some(meta), reqwest::StatusCode::NOT_MODIFIED) = (cached, resp.status()) {
+            return Ok(Fetched::NotModified(meta.revalidated(resp.headers())));
+        }
+        if !resp.status().is_success() {
+            return Err(Failure::status(url, resp.status()));
+        }
+        let meta = CacheMeta::from_headers(url, resp.headers());
+        let body = resp
+            .bytes()
+            .map_err(|e| Failure::request(format!("Failed to read bytes from {}", url), e))?;
+        self.record(started, headers_at, body.len());
+        Ok(Fetched::Full(body, meta))
+    }
+}
+
+#[cfg(feature = "async")]
+type HostSlots = tokio::sync::Semaphore;
+
+/// Counts visible fetches in flight, so speculative ones can wait for them to finish.
+#[cfg(feature = "async")]
+#[derive(Default)]
+struct VisibleGate {
+    running: AtomicUsize,
+    idle: tokio::sync::Notify,
+}
+
+#[cfg(feature = "async")]
+impl VisibleGate {
+    fn enter(&self) -> VisibleFetch<'_> {
+        self.running.fetch_add(1, Ordering::AcqRel);
+        VisibleFetch(self)
+    }
+
+    /// Wait until no visible fetch is running.
+    async fn idle(&self) {
+        loop {
+            let notified = self.idle.notified();
+            if self.running.load(Ordering::Acquire) == 0 {
+                return;
+            }
+            notified.await;
+        }
+    }
+}
+
+#[cfg(feature = "async")]
+struct VisibleFetch<'a>(&'a VisibleGate);
+
+#[cfg(feature = "async")]
+impl Drop for VisibleFetch<'_> {
+    fn drop(&mut self) {
+        if self.0.running.fetch_sub(1, Ordering::AcqRel) == 1 {
+            self.0.idle.notify_waiters();
+        }
+    }
+}
+
+/// A counting semaphore for the blocking client.
+#[cfg(not(feature = "async"))]
+struct HostSlots {
+    free: Mutex<usize>,
+    released: std::sync::Condvar,
+}
+
+#[cfg(not(feature = "async"))]
+impl HostSlots {
+    fn new(slots: usize) -> Self {
+        Self {
+            free: Mutex::new(slots),
+            released: std::sync::Condvar::new(),
+        }
+    }
+
+    fn acquire(&self) -> HostSlot<'_> {
+        let mut free = self.free.lock().unwrap();
+        while *free == 0 {
+            free = self.released.wait(free).unwrap();
+        }
+        *free -= 1;
+        HostSlot(self)
+    }
+}
+
+#[cfg(not(feature = "async"))]
+struct HostSlot<'a>(&'a HostSlots);
+
+#[cfg(not(feature = "async"))]
+impl Drop for HostSlot<'_> {
+    fn drop(&mut self) {
+        *self.0.free.lock().unwrap() += 1;
+        self.0.released.notify_one();
+    }
+}
+
+/// A number in [0, 1) that differs from call to call, for retry jitter.
+fn jitter() -> f64 {
+    use std::hash::{BuildHasher, Hasher};
+    let hash = std::collections::hash_map::RandomState::new()
+        .build_hasher()
+        .finish();
+    (hash >> 11) as f64 / (1u64 << 53) as f64
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_server::{Fault, TestServer};
+
+    fn config(max_per_host: usize) -> WebClientConfig {
+        WebClientConfig {
+            max_per_host,
+            cache_dir: None,
+            ..WebClientConfig::default()
+        }
+    }
+
+    fn get(client: &WebClient, url: &str) -> Result<Bytes, ArchiveError> {
+        #[cfg(feature = "async")]
+        return client.get_blocking(url);
+        #[cfg(not(feature = "async"))]
+        return client.get(url);
+    }
+
+    #[test]
+    fn pages_from_one_host_share_pooled_connections() {
+        let server = TestServer::start(vec![7; 4096]);
+        server.set_delay(Duration::from_millis(5));
+        let client = WebClient::new(config(2)).unwrap();
+        std::thread::scope(|scope| {
+            for reader in 0..8 {
+                let (client, server) = (&client, &server);
+                scope.spawn(move || {
+                    for page in 0..10 {
+                        let body = get(client, &server.url(&format!("{reader}-{page}.png")));
+                        assert_eq!(body.unwrap().len(), 4096);
+                    }
+                });
+            }
+        });
+        assert_eq!(server.requests(), 80);
+        assert!(
+            server.connections() <= 2,
+            "{} connections for 80 requests",
+            server.connections()
+        );
+    }
+
+    #[test]
+    fn prefetch_window_is_clamped() {
+        let estimate = |latency| LinkEstimate {
+            latency,
+            throughput: 1e6,
+            page_bytes: 1e5,
+        };
+        assert_eq!(estimate(0.0).prefetch_window(5), MAX_PREFETCH);
+        assert_eq!(estimate(60.0).prefetch_window(5), 1);
+        // 0.4 s a page, 10 pages a slot in the 4 s horizon.
+        assert_eq!(estimate(0.3).prefetch_window(2), 20);
+    }
+
+    #[test]
+    fn prefetch_window_shrinks_when_the_server_slows_down() {
+        let server = TestServer::start(vec![7; 4096]);
+        let client = WebClient::new(config(2)).unwrap();
+        assert_eq!(client.prefetch_window(), None);
+        for page in 0..4 {
+            get(&client, &server.url(&format!("{page}.png"))).unwrap();
+        }
+        assert_eq!(client.prefetch_window(), Some(MAX_PREFETCH));
+
+        server.set_delay(Duration::from_millis(250));
+        for page in 4..12 {
+            get(&client, &server.url(&format!("{page}.png"))).unwrap();
+        }
+        // The latency estimate is past 0.2 s, so one spare slot covers at most 20 pages.
+        let window = client.prefetch_window().unwrap();
+        assert!((1..=20).contains(&window), "window {window}");
+    }
+
+    #[test]
+    fn hedge_delay_is_the_95th_percentile_of_recent_downloads() {
+        let mut link = Link::default();
+        link.recent
+            .extend((1..MIN_HEDGE_SAMPLES as u64).map(Duration::from_millis));
+        assert_eq!(link.percentile_95(), None);
+
+        link.recent.clear();
+        link.recent.extend(
+            (1..=RECENT_DOWNLOADS as u64)
+                .rev()
+                .map(Duration::from_millis),
+        );
+        assert_eq!(link.percentile_95(), Some(Duration::from_millis(61)));
+    }
+
+    #[test]
+    fn recent_downloads_are_capped() {
+        let server = TestServer::start(vec![7; 16]);
+        let client = WebClient::new(config(2)).unwrap();
+        for page in 0..RECENT_DOWNLOADS + 8 {
+            get(&client, &server.url(&format!("{page}.png"))).unwrap();
+        }
+        let link = client.link.lock().unwrap();
+        assert_eq!(link.recent.len(), RECENT_DOWNLOADS);
+        assert!(link.percentile_95().is_some());
+    }
+
+    fn retrying(retries: u32) -> WebClientConfig {
+        WebClientConfig {
+            retries,
+            retry_backoff: Duration::from_millis(10),
+            ..config(2)
+        }
+    }
+
+    #[test]
+    fn transient_failures_are_retried() {
+        let server = TestServer::start(vec![7; 64]);
+        let client = WebClient::new(retrying(3)).unwrap();
+        server.fail_next([Fault::Status(503), Fault::Drop, Fault::Status(429)]);
+        assert_eq!(get(&client, &server.url("1.png")).unwrap().len(), 64);
+        assert_eq!(server.requests(), 4);
+    }
+
+    #[test]
+    fn retries_stop_when_used_up() {
+        let server = TestServer::start(vec![7; 64]);
+        let client = WebClient::new(retrying(2)).unwrap();
+        server.fail_next([Fault::Status(500); 5]);
+        assert!(get(&client, &server.url("1.png")).is_err());
+        assert_eq!(server.requests(), 3);
+    }
+
+    #[test]
+    fn permanent_failures_are_not_retried() {
+        let server = TestServer::start(vec![7; 64]);
+        let client = WebClient::new(retrying(3)).unwrap();
+        server.fail_next([Fault::Status(404)]);
+        assert!(get(&client, &server.url("1.png")).is_err());
+        assert_eq!(server.requests(), 1);
+    }
+
+    #[test]
+    fn retries_stop_at_the_deadline() {
+        let server = TestServer::start(vec![7; 64]);
+        let client = WebClient::new(WebClientConfig {
+            retries: 10,
+            retry_backoff: Duration::from_millis(100),
+            deadline: Duration::from_millis(500),
+            ..config(2)
+        })
+        .unwrap();
+        server.fail_next([Fault::Status(503); 10]);
+        let started = Instant::now();
+        assert!(get(&client, &server.url("1.png")).is_err());
+        // Waits of 50-100, 100-200 and 200-400 ms fill the deadline after three retries
+        // at most, and no wait is started that would end past it.
+        assert!(started.elapsed() < Duration::from_millis(500));
+        assert!(
+            (2..=4).contains(&server.requests()),
+            "{} requests",
+            server.requests()
+        );
+    }
+
+    #[test]
+    fn failed_revalidation_serves_the_cached_copy() {
+        let dir = tempfile::tempdir().unwrap();
+        let server = TestServer::start(vec![7; 64]);
+        let client = WebClient::new(WebClientConfig {
+            cache_dir: Some(dir.path().to_path_buf()),
+            ..retrying(1)
+        })
+        .unwrap();
+        let url = server.url("1.png");
+        assert_eq!(get(&client, &url).unwrap().len(), 64);
+
+        // Revalidated with a 304.
+        assert_eq!(get(&client, &url).unwrap().len(), 64);
+        assert_eq!(server.requests(), 2);
+
+        server.fail_next([Fault::Status(503), Fault::Drop]);
+        assert_eq!(get(&client, &url).unwrap().len(), 64);
+        assert_eq!(server.requests(), 4);
+        let stats = client.cache_stats().unwrap();
+        assert_eq!((stats.hits, stats.misses), (2, 1));
+    }
+}
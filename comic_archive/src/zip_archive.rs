@@ -1,24 +1,461 @@
 use crate::error::ArchiveError;
 use crate::is_supported_format;
 use crate::prelude::*;
+use crate::zip_index::{MAX_ENTRY_LEN, ZipEntry, ZipIndex};
+use crate::zip_writer::{self, ZipBuilder};
 
+use std::collections::HashMap;
 use std::fs::File;
-use std::io::Read;
+use std::io::{BufWriter, Read};
 use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex, OnceLock, RwLock};
 
 use zip::read::ZipArchive;
+use zip::result::ZipError;
 
+/// Compact once dead space passes both this size and `COMPACT_DEAD_RATIO` of the file.
+const COMPACT_MIN_DEAD: u64 = 4 * 1024 * 1024;
+const COMPACT_DEAD_RATIO: f64 = 0.25;
+
+/// Clones share the open archive, so a clone can be moved into a blocking task.
+#[derive(Clone)]
 pub struct ZipImageArchive {
     path: PathBuf,
+    inner: Arc<RwLock<Arc<ZipInner>>>,
+    /// Serialises appends and compaction.
+    write_lock: Arc<Mutex<()>>,
+}
+
+/// The open file handle and parsed central directory, shared with blocking read tasks.
+/// Reads are positional, so any number of threads can use it at once.
+struct ZipInner {
+    file: File,
+    /// A read-only mapping of the whole archive. Stored entries are returned as slices of
+    /// it, so a page read neither copies nor allocates.
+    #[cfg(feature = "mmap")]
+    map: Option<Bytes>,
+    index: ZipIndex,
+    pages: PageTable,
+    /// `ZipIndex::dead_space`, once it has been worked out.
+    dead: OnceLock<u64>,
+}
+
+impl ZipInner {
+    /// Open `path` and read its central directory. The page table is built from the
+    /// directory unless `known` supplies it.
+    fn open(path: &Path, mapped: bool, known: Option<PageTable>) -> Result<Self, ArchiveError> {
+        let mut file = File::open(path)?;
+        let index = ZipIndex::read(&mut file)?;
+        let map = map_file(&file, path, mapped);
+        let pages = known
+            .unwrap_or_else(|| page_table(&index, |entry| page_info(entry, &file, map.as_ref())));
+        Ok(Self::new(file, map, index, pages, OnceLock::new()))
+    }
+
+    /// Open `path` after entries were appended to `previous`, starting at offset
+    /// `appended_from`. Only the appended entries are described anew; the page info, resolved
+    /// data offsets and dead space of the rest carry over, so saving costs the same
+    /// however many pages the archive has.
+    fn after_append(
+        path: &Path,
+        previous: &ZipInner,
+        appended_from: u64,
+    ) -> Result<Self, ArchiveError> {
+        let mut file = File::open(path)?;
+        let index = ZipIndex::read(&mut file)?;
+        index.carry_over(&previous.index);
+        let map = map_file(&file, path, true);
+
+        let known: HashMap<&str, &EntryInfo> = previous
+            .pages
+            .iter()
+            .map(|page| (page.name.as_str(), page))
+            .collect();
+        let pages = page_table(&index, |entry| match known.get(entry.name.as_str()) {
+            Some(&page) if entry.header_offset < appended_from => page.clone(),
+            _ => page_info(entry, &file, map.as_ref()),
+        });
+
+        // The old directory is dead now, and so is every entry that lost its name to a
+        // newer one in this append.
+        let shadowed = |index: &ZipIndex, entry: &ZipEntry| {
+            index.by_name(&entry.name).map(|live| live.header_offset) != Some(entry.header_offset)
+        };
+        let mut dead = previous.dead_space()? + (appended_from - previous.index.cd_start);
+        for entry in previous.index.live_entries() {
+            if shadowed(&index, entry) {
+                dead += entry.record_len(&file)?;
+            }
+        }
+        for entry in &index.entries {
+            if entry.header_offset >= appended_from && shadowed(&index, entry) {
+                dead += entry.record_len(&file)?;
+            }
+        }
+
+        Ok(Self::new(file, map, index, pages, OnceLock::from(dead)))
+    }
+
+    #[cfg_attr(not(feature = "mmap"), allow(unused_variables))]
+    fn new(
+        file: File,
+        map: Option<Bytes>,
+        index: ZipIndex,
+        pages: PageTable,
+        dead: OnceLock<u64>,
+    ) -> Self {
+        Self {
+            file,
+            #[cfg(feature = "mmap")]
+            map,
+            index,
+            pages,
+            dead,
+        }
+    }
+
+    /// Bytes before the central directory that no live entry uses.
+    fn dead_space(&self) -> Result<u64, ArchiveError> {
+        if let Some(&dead) = self.dead.get() {
+            return Ok(dead);
+        }
+        let dead = self.index.dead_space(&self.file)?;
+        Ok(*self.dead.get_or_init(|| dead))
+    }
+
+    fn read_file(&self, path: &Path, filename: &str) -> Result<Bytes, ArchiveError> {
+        let entry = self.index.by_name(filename).ok_or(ZipError::FileNotFound)?;
+        if !entry.is_natively_supported() {
+            return read_with_zip_crate(path, filename);
+        }
+        #[cfg(feature = "mmap")]
+        if let Some(map) = &self.map {
+            return entry.decode(entry.slice_raw(map)?);
+        }
+        let raw = entry.read_raw(&self.file)?;
+        entry.decode(raw)
+    }
+}
+
+/// Fallback for entries using compression methods or encryption the index reader does not
+/// handle itself.
+fn read_with_zip_crate(path: &Path, filename: &str) -> Result<Bytes, ArchiveError> {
+    let file = File::open(path)?;
+    let mut zip = ZipArchive::new(file)?;
+    let mut file = zip.by_name(filename)?;
+    if file.size() > MAX_ENTRY_LEN {
+        return Err(ZipError::UnsupportedArchive("Entry too large to read").into());
+    }
+    let mut buf = Vec::with_capacity(file.size() as usize);
+    file.read_to_end(&mut buf)?;
+    Ok(buf.into())
+}
+
+/// Map the whole of `file` read-only if `mapped` and the `mmap` feature allow it.
+#[cfg_attr(not(feature = "mmap"), allow(unused_variables))]
+fn map_file(file: &File, path: &Path, mapped: bool) -> Option<Bytes> {
+    #[cfg(feature = "mmap")]
+    if mapped {
+        // SAFETY: the mapping is read-only and no write here touches the bytes it
+        // covers. `append_files` only writes past the current end of the file, and a
+        // failed append truncates back to that end. `compact_locked` swaps in an
+        // unmapped index and renames a rebuilt file over the path, so the old file,
+        // and any pages still borrowing its mapping, is never written. Other programs
+        // writing to or truncating the archive while it is open are not supported.
+        match unsafe { memmap2::Mmap::map(file) } {
+            Ok(mmap) => return Some(Bytes::from_owner(mmap)),
+            Err(e) => log::warn!("Failed to map {:?}, falling back to reads: {}", path, e),
+        }
+    }
+    None
+}
+
+/// The pages of `index`: its live image entries, sorted by name, described by `info`.
+fn page_table(index: &ZipIndex, info: impl Fn(&ZipEntry) -> EntryInfo) -> PageTable {
+    let mut pages: Vec<EntryInfo> = index
+        .live_entries()
+        .filter(|entry| !entry.is_dir() && is_supported_format!(&entry.name))
+        .map(info)
+        .collect();
+    pages.sort_by(|a, b| a.name.cmp(&b.name));
+    pages.into()
+}
+
+/// Describe an entry. The format comes from its extension, and the data is only sniffed
+/// when the extension names none: sniffing costs a read and a partial inflate per page at
+/// open, and the decoder checks the signature of the bytes it gets anyway.
+fn page_info(entry: &ZipEntry, file: &File, map: Option<&Bytes>) -> EntryInfo {
+    let format = match ImageFormat::from_name(&entry.name) {
+        ImageFormat::Unknown => entry.sniff_format(file, map),
+        format => format,
+    };
+    EntryInfo {
+        name: entry.name.clone(),
+        size: entry.uncompressed_size,
+        compressed_size: entry.compressed_size,
+        crc32: Some(entry.crc32),
+        format,
+        position: entry.header_offset,
+    }
+}
+
+/// Where an archive for `dest` is built before it is renamed into place.
+fn temp_path(dest: &Path) -> PathBuf {
+    dest.with_extension("rebuild.tmp.zip")
+}
+
+/// Write a new archive with `fill` to `temp_path(dest)`, synced to disk before returning.
+/// A partly written file is removed on failure.
+fn build_temp(
+    dest: &Path,
+    comment: &[u8],
+    fill: impl FnOnce(&mut ZipBuilder<BufWriter<File>>) -> Result<(), ArchiveError>,
+) -> Result<PathBuf, ArchiveError> {
+    let temp = temp_path(dest);
+    let result: Result<(), ArchiveError> = (|| {
+        let mut builder = ZipBuilder::new(BufWriter::new(File::create(&temp)?));
+        fill(&mut builder)?;
+        let file = builder
+            .finish(comment)?
+            .into_inner()
+            .map_err(|e| e.into_error())?;
+        file.sync_all()?;
+        Ok(())
+    })();
+    match result {
+        Ok(()) => Ok(temp),
+        Err(e) => {
+            let _ = std::fs::remove_file(&temp);
+            Err(e)
+        }
+    }
+}
+
+/// Write a new archive at `dest` with `fill`. It is built next to `dest` and renamed over
+/// it, so `dest` is never truncated or left half written, even if it is open.
+fn build_archive(
+    dest: &Path,
+    comment: &[u8],
+    fill: impl FnOnce(&mut ZipBuilder<BufWriter<File>>) -> Result<(), ArchiveError>,
+) -> Result<(), ArchiveError> {
+    let temp = build_temp(dest, comment, fill)?;
+    std::fs::rename(&temp, dest).map_err(|e| {
+        let _ = std::fs::remove_file(&temp);
+        ArchiveError::from(e)
+    })
+}
+
+/// Whether `a` and `b` are the same file, however they are spelled.
+fn same_file(a: &Path, b: &Path) -> bool {
+    match (std::fs::canonicalize(a), std::fs::canonicalize(b)) {
+        (Ok(a), Ok(b)) => a == b,
+        _ => false,
+    }
 }
 
 impl ZipImageArchive {
     pub fn new(path: &Path) -> Result<Self, ArchiveError> {
+        Self::open(path, None)
+    }
+
+    /// Open with a page table saved from an earlier open of the same, unchanged file. The
+    /// central directory is still read, since reads and writes go through it.
+    pub(crate) fn with_pages(path: &Path, pages: PageTable) -> Result<Self, ArchiveError> {
+        Self::open(path, Some(pages))
+    }
+
+    fn open(path: &Path, known: Option<PageTable>) -> Result<Self, ArchiveError> {
         Ok(Self {
             path: path.to_path_buf(),
+            inner: Arc::new(RwLock::new(Arc::new(ZipInner::open(path, true, known)?))),
+            write_lock: Arc::new(Mutex::new(())),
+        })
+    }
+
+    /// The current index; replaced whenever the archive is rewritten.
+    fn inner(&self) -> Arc<ZipInner> {
+        self.inner.read().unwrap().clone()
+    }
+
+    fn reopen(&self) -> Result<(), ArchiveError> {
+        let inner = Arc::new(ZipInner::open(&self.path, true, None)?);
+        *self.inner.write().unwrap() = inner;
+        Ok(())
+    }
+
+    /// Pick up entries appended to the file, starting at `appended_from`.
+    fn reopen_after_append(&self, appended_from: u64) -> Result<(), ArchiveError> {
+        let inner = Arc::new(ZipInner::after_append(
+            &self.path,
+            &self.inner(),
+            appended_from,
+        )?);
+        *self.inner.write().unwrap() = inner;
+        Ok(())
+    }
+
+    /// Swap in an index without a mapping (so the file can be replaced) or with one again.
+    /// Pages already handed out keep their part of an old mapping alive until they are
+    /// dropped.
+    fn set_mapped(&self, mapped: bool) -> Result<(), ArchiveError> {
+        #[cfg(feature = "mmap")]
+        {
+            // The file is unchanged, so the page table carries over.
+            let pages = self.inner().pages.clone();
+            let inner = Arc::new(ZipInner::open(&self.path, mapped, Some(pages))?);
+            *self.inner.write().unwrap() = inner;
+        }
+        #[cfg(not(feature = "mmap"))]
+        let _ = mapped;
+        Ok(())
+    }
+
+    /// Add or replace files in the archive by appending them, stored, after the existing
+    /// data, followed by a new central directory. Existing entries are not rewritten, so
+    /// the cost does not depend on the size of the archive. Replaced entries are left as
+    /// dead space; once there is enough of it the archive is compacted.
+    pub fn append_files(&self, files: &[(&str, &[u8])]) -> Result<(), ArchiveError> {
+        let _guard = self.write_lock.lock().unwrap();
+        let inner = self.inner();
+        let mut file = std::fs::OpenOptions::new().write(true).open(&self.path)?;
+        let appended_from = zip_writer::append(&mut file, &inner.index, files)?;
+        drop(file);
+        drop(inner);
+        self.reopen_after_append(appended_from)?;
+
+        let inner = self.inner();
+        let dead = inner.dead_space()?;
+        let len = inner.file.metadata()?.len();
+        drop(inner);
+        if dead > COMPACT_MIN_DEAD && dead as f64 > len as f64 * COMPACT_DEAD_RATIO {
+            log::info!(
+                "Compacting {:?}: {} of {} bytes are dead",
+                &self.path,
+                dead,
+                len
+            );
+            self.compact_locked()?;
+        }
+        Ok(())
+    }
+
+    /// Rewrite the archive with only its live entries, dropping dead space.
+    pub fn compact(&self) -> Result<(), ArchiveError> {
+        let _guard = self.write_lock.lock().unwrap();
+        self.compact_locked()
+    }
+
+    /// Build the compacted archive next to the original and rename it into place. Where
+    /// the original cannot be replaced while open (on Windows, while pages still hold
+    /// its mapping), compaction is skipped and the archive is left as it was.
+    fn compact_locked(&self) -> Result<(), ArchiveError> {
+        self.set_mapped(false)?;
+        let inner = self.inner();
+        let mut entries: Vec<&ZipEntry> = inner.index.live_entries().collect();
+        entries.sort_by_key(|entry| entry.header_offset);
+
+        let temp_path = build_temp(&self.path, &inner.index.comment, |builder| {
+            for entry in entries {
+                builder.copy_entry(&inner.file, entry, None)?;
+            }
+            Ok(())
+        })?;
+        drop(inner);
+
+        if let Err(e) = std::fs::rename(&temp_path, &self.path) {
+            log::warn!(
+                "Not compacting {:?}, it cannot be replaced: {}",
+                &self.path,
+                e
+            );
+            let _ = std::fs::remove_file(&temp_path);
+            return self.set_mapped(true);
+        }
+
+        // The rebuilt archive has a new layout, so re-read its central directory.
+        self.reopen()
+    }
+
+    /// Write the pages at `indices` (into `pages()`) to a new archive at `dest`, along
+    /// with the manifest if there is one. Entries are copied without recompression.
+    pub fn extract_pages(&self, indices: &[usize], dest: &Path) -> Result<(), ArchiveError> {
+        if same_file(dest, &self.path) {
+            return Err(ArchiveError::Other(
+                "Destination is the source archive".to_string(),
+            ));
+        }
+        let inner = self.inner();
+        let mut entries = Vec::with_capacity(indices.len() + 1);
+        for &index in indices {
+            let page = inner
+                .pages
+                .get(index)
+                .ok_or(ArchiveError::IndexOutOfBounds)?;
+            entries.push(
+                inner
+                    .index
+                    .by_name(&page.name)
+                    .ok_or(ZipError::FileNotFound)?,
+            );
+        }
+        entries.extend(inner.index.by_name("manifest.toml"));
+        entries.sort_by_key(|entry| entry.header_offset);
+        entries.dedup_by_key(|entry| entry.header_offset);
+
+        build_archive(dest, &[], |builder| {
+            for entry in entries {
+                builder.copy_entry(&inner.file, entry, None)?;
+            }
+            Ok(())
+        })
+    }
+
+    /// Write the pages of `volumes`, in order, to a new archive at `dest`. Each volume's
+    /// pages go in a numbered folder so they keep their order and cannot collide, and the
+    /// first volume's manifest is kept. Entries are copied without recompression.
+    pub fn merge(volumes: &[ZipImageArchive], dest: &Path) -> Result<(), ArchiveError> {
+        if volumes.iter().any(|volume| same_file(&volume.path, dest)) {
+            return Err(ArchiveError::Other(
+                "Destination is one of the source archives".to_string(),
+            ));
+        }
+        let width = volumes.len().to_string().len().max(2);
+        build_archive(dest, &[], |builder| {
+            for (n, volume) in volumes.iter().enumerate() {
+                let inner = volume.inner();
+                let mut entries: Vec<&ZipEntry> = inner
+                    .pages
+                    .iter()
+                    .filter_map(|page| inner.index.by_name(&page.name))
+                    .collect();
+                entries.sort_by_key(|entry| entry.header_offset);
+                for entry in entries {
+                    let name = format!("{:0width$}/{}", n + 1, entry.name);
+                    builder.copy_entry(&inner.file, entry, Some(&name))?;
+                }
+                if n == 0 {
+                    if let Some(manifest) = inner.index.by_name("manifest.toml") {
+                        builder.copy_entry(&inner.file, manifest, None)?;
+                    }
+                }
+            }
+            Ok(())
         })
     }
 
+    /// Read and parse `manifest.toml`, upgrading old versions.
+    pub fn read_manifest_sync(&self) -> Result<Manifest, ArchiveError> {
+        Manifest::upgrade_from_v0_to_v1(&self.read_manifest_string_sync()?)
+            .map_err(|e| ArchiveError::ManifestError(format!("Invalid TOML: {}", e)))
+    }
+
+    /// Replace `manifest.toml` by appending the new one.
+    pub fn write_manifest_sync(&self, manifest: &Manifest) -> Result<(), ArchiveError> {
+        let toml = toml::to_string_pretty(manifest)
+            .map_err(|e| ArchiveError::ManifestError(format!("Invalid TOML: {}", e)))?;
+        self.append_files(&[("manifest.toml", toml.as_bytes())])
+    }
+
     pub fn create_from_path(path: &Path) -> Result<(), ArchiveError> {
         use std::io::Write;
         use zip::{ZipWriter, write::FileOptions};
@@ -45,72 +482,45 @@ impl ZipImageArchive {
     }
 
     /// Synchronously read a file from the zip archive by name.
-    pub fn read_file_by_name_sync(&self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
-        let file = File::open(&self.path)?;
-        let mut zip = ZipArchive::new(file)?;
-        let mut file = zip.by_name(filename)?;
-        let mut buf = Vec::new();
-        file.read_to_end(&mut buf)?;
-        Ok(buf)
+    pub fn read_file_by_name_sync(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        self.inner().read_file(&self.path, filename)
+    }
+
+    /// Read manifest.toml through the already-parsed index.
+    pub(crate) fn read_manifest_string_sync(&self) -> Result<String, ArchiveError> {
+        let buf = self
+            .read_file_by_name_sync("manifest.toml")
+            .map_err(|_| ArchiveError::ManifestError("Manifest not found".to_string()))?;
+        String::from_utf8(buf.to_vec())
+            .map_err(|e| ArchiveError::ManifestError(format!("Failed to read manifest: {}", e)))
     }
 }
 
 #[cfg(feature = "async")]
 #[async_trait::async_trait]
 impl ImageArchiveTrait for ZipImageArchive {
-    fn list_images(&self) -> Vec<String> {
-        let file = match File::open(&self.path) {
-            Ok(f) => f,
-            Err(_) => return vec![],
-        };
-        let mut zip = match ZipArchive::new(file) {
-            Ok(z) => z,
-            Err(_) => return vec![],
-        };
-
-        let mut images = Vec::new();
-        for i in 0..zip.len() {
-            if let Ok(file) = zip.by_index(i) {
-                let name = file.name().to_string();
-                if is_supported_format!(&name) {
-                    images.push(name);
-                }
-            }
-        }
-        images.sort();
-        images
+    fn pages(&self) -> PageTable {
+        self.inner().pages.clone()
     }
 
-    fn read_image_by_name_sync(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
-        let file = File::open(&self.path)?;
-        let mut zip = ZipArchive::new(file)?;
-        let mut file = zip.by_name(filename)?;
-        let mut buf = Vec::new();
-        file.read_to_end(&mut buf)?;
-        Ok(buf)
+    fn read_image_by_name_sync(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        self.read_file_by_name_sync(filename)
     }
 
-    async fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
+    async fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
         let path = self.path.clone();
+        let inner = self.inner();
         let filename = filename.to_string();
-        tokio::task::spawn_blocking(move || {
-            let archive = ZipImageArchive { path };
-            archive.read_file_by_name_sync(&filename)
-        })
-        .await
-        .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
+        tokio::task::spawn_blocking(move || inner.read_file(&path, &filename))
+            .await
+            .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
     }
 
     async fn read_manifest_string(&self) -> Result<String, ArchiveError> {
-        let path = self.path.clone();
-        tokio::task::spawn_blocking(move || {
-            let archive = ZipImageArchive { path };
-            let buf = archive.read_file_by_name_sync("manifest.toml")?;
-            String::from_utf8(buf)
-                .map_err(|e| ArchiveError::ManifestError(format!("UTF-8 error: {e}")))
-        })
-        .await
-        .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
+        let archive = self.clone();
+        tokio::task::spawn_blocking(move || archive.read_manifest_string_sync())
+            .await
+            .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
     }
 
     async fn read_manifest(&self) -> Result<Manifest, ArchiveError> {
@@ -120,85 +530,20 @@ impl ImageArchiveTrait for ZipImageArchive {
         Ok(manifest)
     }
 
-    async fn write_manifest(&mut self, manifest: &Manifest) -> Result<(), ArchiveError> {
-        let path = self.path.clone();
+    async fn write_manifest(&self, manifest: &Manifest) -> Result<(), ArchiveError> {
+        let archive = self.clone();
         let manifest = manifest.clone();
-        tokio::task::spawn_blocking(move || {
-            use std::fs::{File, remove_file, rename};
-            use std::io::Write;
-            use zip::{ZipWriter, write::FileOptions};
-
-            let file = File::open(&path)?;
-            let mut zip = ZipArchive::new(file)?;
-
-            let temp_path = path.with_extension("rebuild.tmp.zip");
-            let mut temp_file = File::create(&temp_path)?;
-
-            {
-                let mut writer = ZipWriter::new(&mut temp_file);
-                let options =
-                    FileOptions::default().compression_method(zip::CompressionMethod::Stored);
-
-                for i in 0..zip.len() {
-                    let mut file = zip.by_index(i)?;
-                    let name = file.name().to_string();
-
-                    if name == "manifest.toml" {
-                        continue;
-                    }
-
-                    writer.start_file(name.clone(), options)?;
-                    std::io::copy(&mut file, &mut writer)?;
-                }
-
-                writer.start_file("manifest.toml", options)?;
-                let toml = toml::to_string_pretty(&manifest)
-                    .map_err(|e| ArchiveError::ManifestError(format!("Invalid TOML: {}", e)))?;
-                writer.write_all(toml.as_bytes())?;
-                writer.finish()?;
-            }
-
-            drop(temp_file);
-
-            remove_file(&path).map_err(|e| {
-                ArchiveError::ManifestError(format!("Failed to remove original file: {}", e))
-            })?;
-
-            rename(&temp_path, &path).map_err(|e| {
-                ArchiveError::ManifestError(format!("Failed to rename temp file: {}", e))
-            })?;
-
-            Ok(())
-        })
-        .await
-        .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
+        tokio::task::spawn_blocking(move || archive.write_manifest_sync(&manifest))
+            .await
+            .unwrap_or_else(|e| Err(ArchiveError::Other(format!("Join error: {e}"))))
     }
 }
 
 #[cfg(not(feature = "async"))]
 impl ImageArchiveTrait for ZipImageArchive {
-    /// List all image filenames in the ZIP archive.
-    fn list_images(&self) -> Vec<String> {
-        let file = match File::open(&self.path) {
-            Ok(f) => f,
-            Err(_) => return vec![],
-        };
-        let mut zip = match ZipArchive::new(file) {
-            Ok(z) => z,
-            Err(_) => return vec![],
-        };
-
-        let mut images = Vec::new();
-        for i in 0..zip.len() {
-            if let Ok(file) = zip.by_index(i) {
-                let name = file.name().to_string();
-                if is_supported_format!(&name) {
-                    images.push(name);
-                }
-            }
-        }
-        images.sort();
-        images
+    /// The image pages in the ZIP archive, sorted by name.
+    fn pages(&self) -> PageTable {
+        self.inner().pages.clone()
     }
 
     /// Extract and return the raw bytes of an image by filename.
@@ -209,28 +554,14 @@ impl ImageArchiveTrait for ZipImageArchive {
     ///
     /// # Returns
     ///
-    /// A vector of bytes containing the image data, or an `ArchiveError` on failure.
-    fn read_image_by_name(&mut self, filename: &str) -> Result<Vec<u8>, ArchiveError> {
-        let file = File::open(&self.path)?;
-        let mut zip = ZipArchive::new(file)?;
-        let mut file = zip.by_name(filename)?;
-        let mut buf = Vec::new();
-        file.read_to_end(&mut buf)?;
-        Ok(buf)
+    /// The image bytes, or an `ArchiveError` on failure.
+    fn read_image_by_name(&self, filename: &str) -> Result<Bytes, ArchiveError> {
+        self.read_file_by_name_sync(filename)
     }
 
     /// Read the manifest.toml file as a raw string from the ZIP archive.
     fn read_manifest_string(&self) -> Result<String, ArchiveError> {
-        let file = File::open(&self.path)?;
-        let mut zip = ZipArchive::new(file)?;
-        let mut manifest_file = zip
-            .by_name("manifest.toml")
-            .map_err(|_| ArchiveError::ManifestError("Manifest not found".to_string()))?;
-        let mut contents = String::new();
-        manifest_file
-            .read_to_string(&mut contents)
-            .map_err(|e| ArchiveError::ManifestError(format!("Failed to read manifest: {}", e)))?;
-        Ok(contents)
+        self.read_manifest_string_sync()
     }
 
     /// Read and parse the manifest from the ZIP archive.
@@ -247,6 +578,9 @@ impl ImageArchiveTrait for ZipImageArchive {
 
     /// Write the manifest to the ZIP archive, replacing any existing manifest.
     ///
+    /// The new manifest is appended along with a new central directory; the rest of the
+    /// archive is left in place.
+    ///
     /// # Arguments
     ///
     /// * `manifest` - The manifest to write.
@@ -254,70 +588,381 @@ impl ImageArchiveTrait for ZipImageArchive {
     /// # Returns
     ///
     /// Returns `Ok(())` on success, or an `ArchiveError` if writing fails.
-    fn write_manifest(&mut self, manifest: &Manifest) -> Result<(), ArchiveError> {
-        use std::fs::{File, remove_file, rename};
-        use std::io::Write;
-        use zip::{ZipWriter, write::FileOptions};
+    fn write_manifest(&self, manifest: &Manifest) -> Result<(), ArchiveError> {
+        self.write_manifest_sync(manifest)?;
+        log::info!("Manifest successfully written to {:?}", &self.path);
+        Ok(())
+    }
+}
 
-        log::info!("Opening zip file at {:?}", &self.path);
-        let file = File::open(&self.path)?;
-        let mut zip = ZipArchive::new(file)?;
-        log::info!("Zip archive opened, contains {} entries", zip.len());
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::zip_index::{CENTRAL_HEADER_LEN, LOCAL_HEADER_LEN, le_u16, read_exact_at};
+
+    /// An empty ZIP archive: only the end of central directory record.
+    const EMPTY_ZIP: [u8; 22] = [
+        0x50, 0x4b, 0x05, 0x06, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    ];
+
+    /// A JPEG signature followed by bytes that differ for every `seed`.
+    fn page(seed: u8, len: usize) -> Vec<u8> {
+        let mut data: Vec<u8> = (0..len)
+            .map(|i| (i as u8).wrapping_mul(31) ^ seed)
+            .collect();
+        data[..4].copy_from_slice(&[0xFF, 0xD8, 0xFF, 0xE0]);
+        data
+    }
 
-        // Prepare paths
-        let temp_path = self.path.with_extension("rebuild.tmp.zip");
-        log::info!("Creating temporary file at {:?}", temp_path);
-        let mut temp_file = File::create(&temp_path)?;
+    /// Write a CBZ at `path` holding `files`, through `append_files`.
+    fn write_cbz(path: &Path, files: &[(&str, &[u8])]) -> ZipImageArchive {
+        std::fs::write(path, EMPTY_ZIP).unwrap();
+        let archive = ZipImageArchive::new(path).unwrap();
+        archive.append_files(files).unwrap();
+        archive
+    }
 
-        {
-            let mut writer = ZipWriter::new(&mut temp_file);
-            let options = FileOptions::default().compression_method(zip::CompressionMethod::Stored);
+    #[test]
+    fn writing_over_a_source_under_another_name_is_refused() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("comic.cbz");
+        let first = page(1, 1000);
+        let archive = write_cbz(&path, &[("001.jpg", &first)]);
+        let alias = dir.path().join(".").join("comic.cbz");
+
+        assert!(archive.extract_pages(&[0], &alias).is_err());
+        assert!(ZipImageArchive::merge(&[archive.clone()], &alias).is_err());
+        assert_eq!(
+            &archive.read_file_by_name_sync("001.jpg").unwrap()[..],
+            &first[..]
+        );
+    }
 
-            // Copy existing entries, skipping manifest.toml
-            for i in 0..zip.len() {
-                let mut file = zip.by_index(i)?;
-                let name = file.name().to_string();
+    #[test]
+    fn extracting_replaces_an_existing_destination() {
+        let dir = tempfile::tempdir().unwrap();
+        let (first, second) = (page(1, 1000), page(2, 1000));
+        let archive = write_cbz(
+            &dir.path().join("comic.cbz"),
+            &[("001.jpg", &first), ("002.jpg", &second)],
+        );
+        let dest = dir.path().join("volume.cbz");
+        std::fs::write(&dest, b"not a zip").unwrap();
+
+        archive.extract_pages(&[1], &dest).unwrap();
+        let volume = ZipImageArchive::new(&dest).unwrap();
+        assert_eq!(volume.pages().len(), 1);
+        assert_eq!(
+            &volume.read_file_by_name_sync("002.jpg").unwrap()[..],
+            &second[..]
+        );
+        assert!(!temp_path(&dest).exists());
+    }
 
-                log::info!("Processing entry: {}", name);
+    /// Read `name` through the `zip` crate, which checks the CRC.
+    fn read_with_zip(path: &Path, name: &str) -> Vec<u8> {
+        let mut zip = ZipArchive::new(File::open(path).unwrap()).unwrap();
+        let mut data = Vec::new();
+        zip.by_name(name).unwrap().read_to_end(&mut data).unwrap();
+        data
+    }
 
-                if name == "manifest.toml" {
-                    log::info!("Skipping old manifest.toml");
-                    continue;
-                }
+    #[test]
+    fn appended_entries_read_back_through_the_index_and_the_zip_crate() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("comic.cbz");
+        let pages: Vec<Vec<u8>> = (1..=3).map(|seed| page(seed, 20_000)).collect();
+        let archive = write_cbz(&path, &[("001.jpg", &pages[0]), ("002.jpg", &pages[1])]);
+        let replaced = page(9, 5_000);
+        archive
+            .append_files(&[("002.jpg", &replaced), ("003.jpg", &pages[2])])
+            .unwrap();
+
+        let expected = [
+            ("001.jpg", &pages[0]),
+            ("002.jpg", &replaced),
+            ("003.jpg", &pages[2]),
+        ];
+        let reopened = ZipImageArchive::new(&path).unwrap();
+        for archive in [&archive, &reopened] {
+            let names: Vec<String> = archive
+                .pages()
+                .iter()
+                .map(|page| page.name.clone())
+                .collect();
+            assert_eq!(names, ["001.jpg", "002.jpg", "003.jpg"]);
+        }
+        let zip = ZipArchive::new(File::open(&path).unwrap()).unwrap();
+        assert_eq!(zip.len(), expected.len());
+        for (name, data) in expected {
+            assert_eq!(
+                &archive.read_file_by_name_sync(name).unwrap()[..],
+                &data[..]
+            );
+            assert_eq!(
+                &reopened.read_file_by_name_sync(name).unwrap()[..],
+                &data[..]
+            );
+            assert_eq!(&read_with_zip(&path, name), data);
+        }
+    }
 
-                writer.start_file(name.clone(), options)?;
-                std::io::copy(&mut file, &mut writer)?;
-                log::info!("Copied entry: {}", name);
-            }
+    #[test]
+    fn dead_space_follows_replaced_manifests() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("comic.cbz");
+        let first = page(1, 10_000);
+        let archive = write_cbz(&path, &[("001.jpg", &first), ("manifest.toml", b"v = 1")]);
+        // The first append left the empty archive's end record behind.
+        let mut expected = EMPTY_ZIP.len() as u64;
+        assert_eq!(archive.inner().dead_space().unwrap(), expected);
+
+        // Each replacement leaves the old manifest and the directory after it dead: the
+        // bytes from the old manifest's header to the old end of the file.
+        for manifest in [&b"v = 2"[..], &b"v = 3, longer"[..]] {
+            let len = std::fs::metadata(&path).unwrap().len();
+            let old = archive
+                .inner()
+                .index
+                .by_name("manifest.toml")
+                .unwrap()
+                .header_offset;
+            expected += len - old;
+            archive
+                .append_files(&[("manifest.toml", manifest)])
+                .unwrap();
+            assert_eq!(archive.inner().dead_space().unwrap(), expected);
+        }
+
+        let reopened = ZipImageArchive::new(&path).unwrap();
+        assert_eq!(reopened.inner().dead_space().unwrap(), expected);
+        assert_eq!(&read_with_zip(&path, "manifest.toml"), b"v = 3, longer");
+        assert_eq!(&read_with_zip(&path, "001.jpg"), &first);
+    }
 
-            // Write new manifest.toml
-            log::info!("Writing new manifest.toml");
-            writer.start_file("manifest.toml", options)?;
-            let toml = toml::to_string_pretty(manifest)
-                .map_err(|e| ArchiveError::ManifestError(format!("Invalid TOML: {}", e)))?;
-            writer.write_all(toml.as_bytes())?;
-            writer.finish()?;
-            log::info!("Finished writing new manifest.toml");
+    #[test]
+    fn crossing_the_dead_space_threshold_compacts() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("comic.cbz");
+        let pages: Vec<Vec<u8>> = (1..=4).map(|seed| page(seed, 1 << 20)).collect();
+        let files: Vec<(String, &[u8])> = pages
+            .iter()
+            .enumerate()
+            .map(|(i, data)| (format!("{:03}.jpg", i + 1), data.as_slice()))
+            .collect();
+        let files: Vec<(&str, &[u8])> = files
+            .iter()
+            .map(|(name, data)| (name.as_str(), *data))
+            .collect();
+        let archive = write_cbz(&path, &files);
+
+        // A large entry replaced twice leaves more dead space than COMPACT_MIN_DEAD and
+        // COMPACT_DEAD_RATIO of the file allow.
+        let big = page(7, COMPACT_MIN_DEAD as usize);
+        archive.append_files(&[("999.jpg", &big)]).unwrap();
+        let before = std::fs::metadata(&path).unwrap().len();
+        let replacement = page(8, 1000);
+        archive.append_files(&[("999.jpg", &replacement)]).unwrap();
+
+        assert!(std::fs::metadata(&path).unwrap().len() < before);
+        assert_eq!(archive.inner().dead_space().unwrap(), 0);
+        assert!(!temp_path(&path).exists());
+        let reopened = ZipImageArchive::new(&path).unwrap();
+        let pages = reopened.pages();
+        assert_eq!(pages.len(), 5);
+        for entry in pages.iter() {
+            let data = reopened.read_file_by_name_sync(&entry.name).unwrap();
+            assert_eq!(Some(crc32fast::hash(&data)), entry.crc32, "{}", entry.name);
+            assert_eq!(read_with_zip(&path, &entry.name), &data[..]);
         }
+        assert_eq!(
+            &reopened.read_file_by_name_sync("999.jpg").unwrap()[..],
+            &replacement[..]
+        );
+    }
 
-        // Close temp_file before renaming
-        drop(temp_file);
+    #[test]
+    fn failed_append_truncates_to_the_old_end() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("comic.cbz");
+        let first = page(1, 1000);
+        let archive = write_cbz(&path, &[("001.jpg", &first)]);
+        let len = std::fs::metadata(&path).unwrap().len();
+
+        // The first file is written out before the second one's name is refused.
+        let written = page(2, 100_000);
+        let too_long = "x".repeat(u16::MAX as usize + 1);
+        assert!(
+            archive
+                .append_files(&[("002.jpg", &written), (&too_long, b"")])
+                .is_err()
+        );
+
+        assert_eq!(std::fs::metadata(&path).unwrap().len(), len);
+        assert_eq!(ZipImageArchive::new(&path).unwrap().pages().len(), 1);
+        assert_eq!(&read_with_zip(&path, "001.jpg"), &first);
+        archive.append_files(&[("002.jpg", &written)]).unwrap();
+        assert_eq!(&read_with_zip(&path, "002.jpg"), &written);
+    }
 
-        // Remove the original file
-        log::info!("Removing original file {:?}", &self.path);
-        remove_file(&self.path).map_err(|e| {
-            log::error!("Failed to remove original file: {}", e);
-            ArchiveError::ManifestError(format!("Failed to remove original file: {}", e))
-        })?;
+    /// The Info-ZIP Unicode Path field for `name`, as other tools write it.
+    fn unicode_path(name: &str) -> Vec<u8> {
+        let mut field = Vec::new();
+        field.extend_from_slice(&0x7075u16.to_le_bytes());
+        field.extend_from_slice(&(5 + name.len() as u16).to_le_bytes());
+        field.push(1);
+        field.extend_from_slice(&crc32fast::hash(name.as_bytes()).to_le_bytes());
+        field.extend_from_slice(name.as_bytes());
+        field
+    }
 
-        // Rename temp file to original path
-        log::info!("Renaming {:?} to {:?}", temp_path, &self.path);
-        rename(&temp_path, &self.path).map_err(|e| {
-            log::error!("Failed to rename temp file: {}", e);
-            ArchiveError::ManifestError(format!("Failed to rename temp file: {}", e))
-        })?;
+    /// Write a ZIP at `path` the way streaming writers do: each entry is stored with a
+    /// data descriptor after it (flag 0x08, zero CRC and sizes in the local header) and
+    /// carries a Unicode Path field.
+    fn write_streamed_zip(path: &Path, files: &[(&str, &[u8])]) {
+        fn put(out: &mut Vec<u8>, fields: &[u32], widths: &[usize]) {
+            for (value, width) in fields.iter().zip(widths) {
+                out.extend_from_slice(&value.to_le_bytes()[..*width]);
+            }
+        }
+        let mut out = Vec::new();
+        let mut central = Vec::new();
+        for (name, data) in files {
+            let offset = out.len() as u32;
+            let (crc, size) = (crc32fast::hash(data), data.len() as u32);
+            let (name_len, extra) = (name.len() as u32, unicode_path(name));
+            let extra_len = extra.len() as u32;
+
+            // Signature, version, flags, method, time, date, CRC, sizes, name and extra
+            // lengths.
+            put(
+                &mut out,
+                &[
+                    0x04034b50, 20, 0x08, 0, 0, 0x21, 0, 0, 0, name_len, extra_len,
+                ],
+                &[4, 2, 2, 2, 2, 2, 4, 4, 4, 2, 2],
+            );
+            out.extend_from_slice(name.as_bytes());
+            out.extend_from_slice(&extra);
+            out.extend_from_slice(data);
+            put(&mut out, &[0x08074b50, crc, size, size], &[4; 4]);
+
+            // As above after made-by, then comment length, disk, attributes and offset.
+            put(
+                &mut central,
+                &[
+                    0x02014b50, 20, 20, 0x08, 0, 0, 0x21, crc, size, size, name_len, extra_len, 0,
+                    0, 0, 0, offset,
+                ],
+                &[4, 2, 2, 2, 2, 2, 2, 4, 4, 4, 2, 2, 2, 2, 2, 4, 4],
+            );
+            central.extend_from_slice(name.as_bytes());
+            central.extend_from_slice(&extra);
+        }
+        let (cd_offset, count) = (out.len() as u32, files.len() as u32);
+        out.extend_from_slice(&central);
+        put(
+            &mut out,
+            &[
+                0x06054b50,
+                0,
+                0,
+                count,
+                count,
+                central.len() as u32,
+                cd_offset,
+                0,
+            ],
+            &[4, 2, 2, 2, 2, 4, 4, 2],
+        );
+        std::fs::write(path, out).unwrap();
+    }
 
-        log::info!("Manifest successfully written to {:?}", &self.path);
-        Ok(())
+    /// Ids of the extra fields in the local and central headers of `entry`.
+    fn extra_ids(file: &File, entry: &ZipEntry) -> (Vec<u16>, Vec<u16>) {
+        fn ids(mut extra: &[u8]) -> Vec<u16> {
+            let mut ids = Vec::new();
+            while extra.len() >= 4 {
+                ids.push(le_u16(extra, 0));
+                extra = &extra[(4 + le_u16(extra, 2) as usize).min(extra.len())..];
+            }
+            ids
+        }
+        let mut local = [0u8; LOCAL_HEADER_LEN as usize];
+        read_exact_at(file, &mut local, entry.header_offset).unwrap();
+        let mut local_extra = vec![0u8; le_u16(&local, 28) as usize];
+        let extra_offset = entry.header_offset + LOCAL_HEADER_LEN + le_u16(&local, 26) as u64;
+        read_exact_at(file, &mut local_extra, extra_offset).unwrap();
+
+        let extra_start = CENTRAL_HEADER_LEN + le_u16(&entry.central, 28) as usize;
+        let extra_end = extra_start + le_u16(&entry.central, 30) as usize;
+        (
+            ids(&local_extra),
+            ids(&entry.central[extra_start..extra_end]),
+        )
+    }
+
+    #[test]
+    fn extracting_copies_entries_with_data_descriptors() {
+        let dir = tempfile::tempdir().unwrap();
+        let source = dir.path().join("streamed.cbz");
+        let pages: Vec<Vec<u8>> = (1..=3).map(|seed| page(seed, 5_000)).collect();
+        write_streamed_zip(
+            &source,
+            &[
+                ("001.jpg", &pages[0]),
+                ("002.jpg", &pages[1]),
+                ("003.jpg", &pages[2]),
+            ],
+        );
+        let archive = ZipImageArchive::new(&source).unwrap();
+        let dest = dir.path().join("extract.cbz");
+        archive.extract_pages(&[0, 2], &dest).unwrap();
+
+        let extract = ZipImageArchive::new(&dest).unwrap();
+        let inner = extract.inner();
+        assert_eq!(inner.pages.len(), 2);
+        // Descriptors are copied with the data, so the records fill the file exactly.
+        assert_eq!(inner.dead_space().unwrap(), 0);
+        for (name, data) in [("001.jpg", &pages[0]), ("003.jpg", &pages[2])] {
+            assert_eq!(
+                &extract.read_file_by_name_sync(name).unwrap()[..],
+                &data[..]
+            );
+            assert_eq!(&read_with_zip(&dest, name), data);
+            let entry = inner.index.by_name(name).unwrap();
+            assert_eq!(extra_ids(&inner.file, entry), (vec![0x7075], vec![0x7075]));
+        }
+    }
+
+    #[test]
+    fn merging_renames_entries_and_drops_their_unicode_paths() {
+        let dir = tempfile::tempdir().unwrap();
+        let (first, second, third) = (page(1, 5_000), page(2, 5_000), page(3, 5_000));
+        let streamed = dir.path().join("v1.cbz");
+        write_streamed_zip(&streamed, &[("001.jpg", &first), ("002.jpg", &second)]);
+        let volumes = [
+            ZipImageArchive::new(&streamed).unwrap(),
+            write_cbz(&dir.path().join("v2.cbz"), &[("001.jpg", &third)]),
+        ];
+        let dest = dir.path().join("merged.cbz");
+        ZipImageArchive::merge(&volumes, &dest).unwrap();
+
+        let merged = ZipImageArchive::new(&dest).unwrap();
+        let inner = merged.inner();
+        let names: Vec<String> = inner.pages.iter().map(|page| page.name.clone()).collect();
+        assert_eq!(names, ["01/001.jpg", "01/002.jpg", "02/001.jpg"]);
+        assert_eq!(inner.dead_space().unwrap(), 0);
+        for (name, data) in [
+            ("01/001.jpg", &first),
+            ("01/002.jpg", &second),
+            ("02/001.jpg", &third),
+        ] {
+            assert_eq!(&merged.read_file_by_name_sync(name).unwrap()[..], &data[..]);
+            // The zip crate also checks that both headers carry the new name.
+            assert_eq!(&read_with_zip(&dest, name), data);
+            let entry = inner.index.by_name(name).unwrap();
+            assert_eq!(extra_ids(&inner.file, entry), (vec![], vec![]));
+        }
     }
 }
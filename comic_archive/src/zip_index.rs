@@ -0,0 +1,527 @@
+//! Central-directory index for ZIP/CBZ archives.
+//!
+//! The central directory is parsed once when the archive is opened; page reads then
+//! go straight to the entry's local header with a single seek instead of re-scanning
+//! the whole directory through `zip::ZipArchive`. Entry reads are positional, so one
+//! shared file handle can serve many threads at once.
+
+use std::collections::HashMap;
+use std::fs::File;
+use std::io::{Read, Seek, SeekFrom};
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use bytes::Bytes;
+use zip::result::ZipError;
+
+use crate::error::ArchiveError;
+use crate::model::ImageFormat;
+
+pub(crate) const LOCAL_HEADER_SIG: u32 = 0x04034b50;
+pub(crate) const CENTRAL_HEADER_SIG: u32 = 0x02014b50;
+pub(crate) const EOCD_SIG: u32 = 0x06054b50;
+pub(crate) const ZIP64_EOCD_SIG: u32 = 0x06064b50;
+pub(crate) const ZIP64_LOCATOR_SIG: u32 = 0x07064b50;
+const DATA_DESCRIPTOR_SIG: u32 = 0x08074b50;
+
+pub(crate) const LOCAL_HEADER_LEN: u64 = 30;
+pub(crate) const CENTRAL_HEADER_LEN: usize = 46;
+const EOCD_LEN: u64 = 22;
+const ZIP64_LOCATOR_LEN: u64 = 20;
+pub(crate) const ZIP64_EXTRA_ID: u16 = 0x0001;
+
+pub(crate) const METHOD_STORED: u16 = 0;
+pub(crate) const METHOD_DEFLATED: u16 = 8;
+
+/// Largest entry that is read into memory. Sizes come from the central directory, so they
+/// are checked before anything is allocated for them.
+pub(crate) const MAX_ENTRY_LEN: u64 = 512 * 1024 * 1024;
+
+/// Compressed bytes inflated to sniff an entry's format; plenty for `ImageFormat::MAGIC_LEN`.
+const SNIFF_RAW_LEN: u64 = 256;
+
+const FLAG_ENCRYPTED: u16 = 0x0001;
+const FLAG_DATA_DESCRIPTOR: u16 = 0x0008;
+pub(crate) const FLAG_UTF8: u16 = 0x0800;
+
+/// A single entry from the central directory.
+#[derive(Debug)]
+pub(crate) struct ZipEntry {
+    pub name: String,
+    pub flags: u16,
+    pub method: u16,
+    pub crc32: u32,
+    pub compressed_size: u64,
+    pub uncompressed_size: u64,
+    /// Absolute offset of the local file header.
+    pub header_offset: u64,
+    /// The entry's central directory record, verbatim, for rewriting the directory.
+    pub central: Box<[u8]>,
+    /// Absolute offset of the entry data, resolved from the local header on first read.
+    /// Zero until known.
+    data_offset: AtomicU64,
+}
+
+impl ZipEntry {
+    pub fn is_dir(&self) -> bool {
+        self.name.ends_with('/')
+    }
+
+    /// Resolve the absolute offset of the entry data, reading the local header if needed.
+    pub fn data_offset(&self, file: &File) -> Result<u64, ArchiveError> {
+        let cached = self.data_offset.load(Ordering::Relaxed);
+        if cached != 0 {
+            return Ok(cached);
+        }
+
+        let mut header = [0u8; LOCAL_HEADER_LEN as usize];
+        read_exact_at(file, &mut header, self.header_offset)?;
+        self.data_offset_from_header(&header)
+    }
+
+    /// Parse the fixed part of the local header and cache the resulting data offset.
+    fn data_offset_from_header(&self, header: &[u8]) -> Result<u64, ArchiveError> {
+        if header.len() < LOCAL_HEADER_LEN as usize || le_u32(header, 0) != LOCAL_HEADER_SIG {
+            return Err(ZipError::InvalidArchive("Invalid local file header").into());
+        }
+        let name_len = le_u16(header, 26) as u64;
+        let extra_len = le_u16(header, 28) as u64;
+        let offset = self.header_offset + LOCAL_HEADER_LEN + name_len + extra_len;
+        self.data_offset.store(offset, Ordering::Relaxed);
+        Ok(offset)
+    }
+
+    /// Read the raw (possibly compressed) bytes of this entry.
+    pub fn read_raw(&self, file: &File) -> Result<Bytes, ArchiveError> {
+        self.check_size()?;
+        let offset = self.data_offset(file)?;
+        if offset.saturating_add(self.compressed_size) > file.metadata()?.len() {
+            return Err(ZipError::InvalidArchive("Entry data out of bounds").into());
+        }
+        let mut raw = vec![0u8; self.compressed_size as usize];
+        read_exact_at(file, &mut raw, offset)?;
+        Ok(raw.into())
+    }
+
+    /// Slice the raw (possibly compressed) bytes of this entry out of a mapping of the
+    /// whole archive, without copying.
+    pub fn slice_raw(&self, map: &Bytes) -> Result<Bytes, ArchiveError> {
+        let offset = match self.data_offset.load(Ordering::Relaxed) {
+            0 => {
+                let start = self.header_offset as usize;
+                let header = map
+                    .get(start..start + LOCAL_HEADER_LEN as usize)
+                    .ok_or(ZipError::InvalidArchive("Local header out of bounds"))?;
+                self.data_offset_from_header(header)?
+            }
+            cached => cached,
+        };
+        let end = offset.saturating_add(self.compressed_size);
+        if end > map.len() as u64 {
+            return Err(ZipError::InvalidArchive("Entry data out of bounds").into());
+        }
+        Ok(map.slice(offset as usize..end as usize))
+    }
+
+    /// Refuse entries whose stated sizes are too large to read into memory.
+    fn check_size(&self) -> Result<(), ArchiveError> {
+        if self.compressed_size.max(self.uncompressed_size) > MAX_ENTRY_LEN {
+            return Err(ZipError::UnsupportedArchive("Entry too large to read").into());
+        }
+        Ok(())
+    }
+
+    /// Turn the raw bytes returned by `read_raw` or `slice_raw` into the uncompressed entry
+    /// contents, verifying the CRC. Stored entries are returned as-is, so a slice of a
+    /// mapping stays zero-copy.
+    pub fn decode(&self, raw: Bytes) -> Result<Bytes, ArchiveError> {
+        if self.flags & FLAG_ENCRYPTED != 0 {
+            return Err(ZipError::UnsupportedArchive(ZipError::PASSWORD_REQUIRED).into());
+        }
+
+        self.check_size()?;
+
+        let data = match self.method {
+            METHOD_STORED => raw,
+            METHOD_DEFLATED => {
+                // Output past the stated size is cut off; it then fails the CRC check.
+                let mut out = Vec::with_capacity(self.uncompressed_size as usize);
+                flate2::read::DeflateDecoder::new(&raw[..])
+                    .take(self.uncompressed_size)
+                    .read_to_end(&mut out)?;
+                out.into()
+            }
+            _ => {
+                return Err(
+                    ZipError::UnsupportedArchive("Compression method not supported").into(),
+                );
+            }
+        };
+
+        if crc32fast::hash(&data) != self.crc32 {
+            return Err(ZipError::Io(std::io::Error::new(
+                std::io::ErrorKind::InvalidData,
+                format!("Invalid checksum for {}", self.name),
+            ))
+            .into());
+        }
+        Ok(data)
+    }
+
+    /// Identify the entry's image format from the start of its contents, falling back to
+    /// its name. Only the first few hundred bytes are read and inflated, and the data
+    /// offset resolved on the way is kept for the first real read.
+    pub fn sniff_format(&self, file: &File, map: Option<&Bytes>) -> ImageFormat {
+        if !self.is_natively_supported() {
+            return ImageFormat::from_name(&self.name);
+        }
+        let raw_len = self.compressed_size.min(SNIFF_RAW_LEN) as usize;
+        let raw = match map {
+            Some(map) => self.slice_raw(map).map(|raw| raw.slice(..raw_len)),
+            None => self.data_offset(file).and_then(|offset| {
+                let mut raw = vec![0u8; raw_len];
+                read_exact_at(file, &mut raw, offset)?;
+                Ok(Bytes::from(raw))
+            }),
+        };
+        let Ok(raw) = raw else {
+            return ImageFormat::from_name(&self.name);
+        };
+
+        let mut prefix = Vec::with_capacity(ImageFormat::MAGIC_LEN);
+        if self.method == METHOD_STORED {
+            prefix.extend_from_slice(&raw[..raw.len().min(ImageFormat::MAGIC_LEN)]);
+        } else {
+            // The input is cut short, so the decoder errors once it runs dry; whatever it
+            // produced before that is kept in `prefix`.
+            let _ = flate2::read::DeflateDecoder::new(&raw[..])
+                .take(ImageFormat::MAGIC_LEN as u64)
+                .read_to_end(&mut prefix);
+        }
+        ImageFormat::detect(&prefix, &self.name)
+    }
+
+    /// Length of the data descriptor that follows the entry data, if it has one.
+    pub fn descriptor_len(&self, file: &File) -> Result<u64, ArchiveError> {
+        if self.flags & FLAG_DATA_DESCRIPTOR == 0 {
+            return Ok(0);
+        }
+        let mut signature = [0u8; 4];
+        read_exact_at(
+            file,
+            &mut signature,
+            self.data_offset(file)? + self.compressed_size,
+        )?;
+        let signature_len = if le_u32(&signature, 0) == DATA_DESCRIPTOR_SIG {
+            4
+        } else {
+            0
+        };
+        let zip64 = self.compressed_size >= 0xFFFF_FFFF || self.uncompressed_size >= 0xFFFF_FFFF;
+        let sizes_len = if zip64 { 16 } else { 8 };
+        Ok(signature_len + 4 + sizes_len)
+    }
+
+    /// Bytes the entry occupies in the file: local header, data and data descriptor.
+    pub fn record_len(&self, file: &File) -> Result<u64, ArchiveError> {
+        Ok(self.data_offset(file)? - self.header_offset
+            + self.compressed_size
+            + self.descriptor_len(file)?)
+    }
+
+    /// Whether `decode` can handle this entry without falling back to the `zip` crate.
+    pub fn is_natively_supported(&self) -> bool {
+        self.flags & FLAG_ENCRYPTED == 0
+            && (self.method == METHOD_STORED || self.method == METHOD_DEFLATED)
+    }
+}
+
+/// The parsed central directory of a ZIP archive.
+#[derive(Debug, Default)]
+pub(crate) struct ZipIndex {
+    pub entries: Vec<ZipEntry>,
+    by_name: HashMap<String, usize>,
+    /// Length of any data prepended to the archive; stored offsets are relative to it.
+    pub archive_offset: u64,
+    /// Absolute offset of the central directory.
+    pub cd_start: u64,
+    /// The archive comment from the end-of-central-directory record.
+    pub comment: Vec<u8>,
+}
+
+impl ZipIndex {
+    /// Parse the central directory of `file`.
+    pub fn read(file: &mut File) -> Result<Self, ArchiveError> {
+        let file_len = file.seek(SeekFrom::End(0))?;
+        let (eocd_pos, eocd) = find_eocd(file, file_len)?;
+
+        let mut entry_count = le_u16(&eocd, 10) as u64;
+        let mut cd_size = le_u32(&eocd, 12) as u64;
+        let mut cd_offset = le_u32(&eocd, 16) as u64;
+        let mut cd_end = eocd_pos;
+
+        if entry_count == 0xFFFF || cd_size == 0xFFFF_FFFF || cd_offset == 0xFFFF_FFFF {
+            if let Some((pos, zip64)) = read_zip64_eocd(file, eocd_pos)? {
+                entry_count = le_u64(&zip64, 32);
+                cd_size = le_u64(&zip64, 40);
+                cd_offset = le_u64(&zip64, 48);
+                cd_end = pos;
+            }
+        }
+
+        // Data prepended to the archive (e.g. self-extracting stubs) shifts every offset.
+        let cd_start = cd_end
+            .checked_sub(cd_size)
+            .ok_or(ZipError::InvalidArchive("Invalid central directory size"))?;
+        let archive_offset = cd_start
+            .checked_sub(cd_offset)
+            .ok_or(ZipError::InvalidArchive("Invalid central directory offset"))?;
+
+        let mut comment = vec![0u8; le_u16(&eocd, 20) as usize];
+        file.seek(SeekFrom::Start(eocd_pos + EOCD_LEN))?;
+        if file.read_exact(&mut comment).is_err() {
+            comment.clear();
+        }
+
+        let mut cd = vec![0u8; cd_size as usize];
+        file.seek(SeekFrom::Start(cd_start))?;
+        file.read_exact(&mut cd)?;
+
+        let mut index = ZipIndex {
+            entries: Vec::with_capacity(entry_count.min(u16::MAX as u64) as usize),
+            by_name: HashMap::with_capacity(entry_count.min(u16::MAX as u64) as usize),
+            archive_offset,
+            cd_start,
+            comment,
+        };
+
+        let mut pos = 0usize;
+        while pos + CENTRAL_HEADER_LEN <= cd.len() {
+            if le_u32(&cd, pos) != CENTRAL_HEADER_SIG {
+                break;
+            }
+            let entry = parse_central_header(&cd, &mut pos, archive_offset)?;
+            index.push(entry);
+        }
+
+        Ok(index)
+    }
+
+    fn push(&mut self, entry: ZipEntry) {
+        // Later entries win, matching the behaviour of `zip::ZipArchive::by_name`.
+        self.by_name.insert(entry.name.clone(), self.entries.len());
+        self.entries.push(entry);
+    }
+
+    /// Reuse the data offsets `previous`, an earlier index of the same file, resolved for
+    /// entries that are still in place.
+    pub fn carry_over(&self, previous: &ZipIndex) {
+        for entry in &self.entries {
+            let Some(old) = previous.by_name(&entry.name) else {
+                continue;
+            };
+            if old.header_offset == entry.header_offset {
+                let offset = old.data_offset.load(Ordering::Relaxed);
+                entry.data_offset.store(offset, Ordering::Relaxed);
+            }
+        }
+    }
+
+    pub fn by_name(&self, name: &str) -> Option<&ZipEntry> {
+        self.by_name.get(name).map(|&i| &self.entries[i])
+    }
+
+    /// Entries not shadowed by a later entry of the same name, in directory order.
+    pub fn live_entries(&self) -> impl Iterator<Item = &ZipEntry> {
+        self.entries
+            .iter()
+            .enumerate()
+            .filter(|(i, entry)| self.by_name.get(&entry.name) == Some(i))
+            .map(|(_, entry)| entry)
+    }
+
+    /// Bytes before the central directory that no live entry uses: replaced entries and
+    /// the directories left behind by earlier appends.
+    pub fn dead_space(&self, file: &File) -> Result<u64, ArchiveError> {
+        let mut live = 0;
+        for entry in self.live_entries() {
+            live += entry.record_len(file)?;
+        }
+        Ok((self.cd_start - self.archive_offset).saturating_sub(live))
+    }
+}
+
+fn parse_central_header(
+    cd: &[u8],
+    pos: &mut usize,
+    archive_offset: u64,
+) -> Result<ZipEntry, ArchiveError> {
+    let h = *pos;
+    let flags = le_u16(cd, h + 8);
+    let method = le_u16(cd, h + 10);
+    let crc32 = le_u32(cd, h + 16);
+    let mut compressed_size = le_u32(cd, h + 20) as u64;
+    let mut uncompressed_size = le_u32(cd, h + 24) as u64;
+    let name_len = le_u16(cd, h + 28) as usize;
+    let extra_len = le_u16(cd, h + 30) as usize;
+    let comment_len = le_u16(cd, h + 32) as usize;
+    let mut header_offset = le_u32(cd, h + 42) as u64;
+
+    let name_start = h + CENTRAL_HEADER_LEN;
+    let extra_start = name_start + name_len;
+    let next = extra_start + extra_len + comment_len;
+    if next > cd.len() {
+        return Err(ZipError::InvalidArchive("Truncated central directory entry").into());
+    }
+
+    let raw_name = &cd[name_start..extra_start];
+    let name = if flags & FLAG_UTF8 != 0 {
+        String::from_utf8_lossy(raw_name).into_owned()
+    } else {
+        String::from_utf8(raw_name.to_vec())
+            .unwrap_or_else(|_| raw_name.iter().map(|&b| b as char).collect())
+    };
+
+    // The ZIP64 extra field only carries the values whose 32-bit slot is saturated,
+    // in this fixed order.
+    let mut extra = &cd[extra_start..extra_start + extra_len];
+    while extra.len() >= 4 {
+        let id = le_u16(extra, 0);
+        let len = le_u16(extra, 2) as usize;
+        let body = &extra[4..(4 + len).min(extra.len())];
+        if id == ZIP64_EXTRA_ID {
+            let mut field = 0;
+            if uncompressed_size == 0xFFFF_FFFF && body.len() >= field + 8 {
+                uncompressed_size = le_u64(body, field);
+                field += 8;
+            }
+            if compressed_size == 0xFFFF_FFFF && body.len() >= field + 8 {
+                compressed_size = le_u64(body, field);
+                field += 8;
+            }
+            if header_offset == 0xFFFF_FFFF && body.len() >= field + 8 {
+                header_offset = le_u64(body, field);
+            }
+        }
+        extra = &extra[(4 + len).min(extra.len())..];
+    }
+
+    *pos = next;
+    Ok(ZipEntry {
+        name,
+        flags,
+        method,
+        crc32,
+        compressed_size,
+        uncompressed_size,
+        header_offset: header_offset + archive_offset,
+        central: cd[h..next].into(),
+        data_offset: AtomicU64::new(0),
+    })
+}
+
+/// Locate the end-of-central-directory record, which may be followed by a comment.
+fn find_eocd(file: &mut File, file_len: u64) -> Result<(u64, Vec<u8>), ArchiveError> {
+    if file_len < EOCD_LEN {
+        return Err(ZipError::InvalidArchive("Invalid zip header").into());
+    }
+    let search_len = file_len.min(EOCD_LEN + u16::MAX as u64);
+    let search_start = file_len - search_len;
+
+    let mut tail = vec![0u8; search_len as usize];
+    file.seek(SeekFrom::Start(search_start))?;
+    file.read_exact(&mut tail)?;
+
+    let mut pos = tail.len() - EOCD_LEN as usize;
+    loop {
+        if le_u32(&tail, pos) == EOCD_SIG {
+            let record = tail[pos..pos + EOCD_LEN as usize].to_vec();
+            return Ok((search_start + pos as u64, record));
+        }
+        if pos == 0 {
+            return Err(ZipError::InvalidArchive("Could not find central directory end").into());
+        }
+        pos -= 1;
+    }
+}
+
+/// Read the ZIP64 end-of-central-directory record referenced by the locator that
+/// directly precedes the regular EOCD, if there is one.
+fn read_zip64_eocd(file: &mut File, eocd_pos: u64) -> Result<Option<(u64, Vec<u8>)>, ArchiveError> {
+    if eocd_pos < ZIP64_LOCATOR_LEN {
+        return Ok(None);
+    }
+    let locator_pos = eocd_pos - ZIP64_LOCATOR_LEN;
+    let mut locator = [0u8; ZIP64_LOCATOR_LEN as usize];
+    file.seek(SeekFrom::Start(locator_pos))?;
+    file.read_exact(&mut locator)?;
+    if le_u32(&locator, 0) != ZIP64_LOCATOR_SIG {
+        return Ok(None);
+    }
+
+    // The locator's offset is relative to the start of the archive; the record itself
+    // sits immediately before the locator, which also covers prepended data.
+    let mut record = [0u8; 56];
+    let record_pos = locator_pos
+        .checked_sub(record.len() as u64)
+        .ok_or(ZipError::InvalidArchive("Invalid ZIP64 locator"))?;
+    file.seek(SeekFrom::Start(record_pos))?;
+    file.read_exact(&mut record)?;
+    if le_u32(&record, 0) != ZIP64_EOCD_SIG {
+        let stated = le_u64(&locator, 8);
+        file.seek(SeekFrom::Start(stated))?;
+        file.read_exact(&mut record)?;
+        if le_u32(&record, 0) != ZIP64_EOCD_SIG {
+            return Err(ZipError::InvalidArchive("Invalid ZIP64 end of central directory").into());
+        }
+        return Ok(Some((stated, record.to_vec())));
+    }
+    Ok(Some((record_pos, record.to_vec())))
+}
+
+/// Fill `buf` from `offset` without touching any shared cursor state, so concurrent
+/// readers of the same handle do not interfere.
+#[cfg(unix)]
+pub(crate) fn read_exact_at(file: &File, buf: &mut [u8], offset: u64) -> std::io::Result<()> {
+    use std::os::unix::fs::FileExt;
+    file.read_exact_at(buf, offset)
+}
+
+#[cfg(windows)]
+pub(crate) fn read_exact_at(
+    file: &File,
+    mut buf: &mut [u8],
+    mut offset: u64,
+) -> std::io::Result<()> {
+    use std::os::windows::fs::FileExt;
+    while !buf.is_empty() {
+        match file.seek_read(buf, offset) {
+            Ok(0) => {
+                return Err(std::io::Error::new(
+                    std::io::ErrorKind::UnexpectedEof,
+                    "failed to fill whole buffer",
+                ));
+            }
+            Ok(n) => {
+                buf = &mut buf[n..];
+                offset += n as u64;
+            }
+            Err(e) if e.kind() == std::io::ErrorKind::Interrupted => {}
+            Err(e) => return Err(e),
+        }
+    }
+    Ok(())
+}
+
+pub(crate) fn le_u16(buf: &[u8], at: usize) -> u16 {
+    u16::from_le_bytes([buf[at], buf[at + 1]])
+}
+
+pub(crate) fn le_u32(buf: &[u8], at: usize) -> u32 {
+    u32::from_le_bytes([buf[at], buf[at + 1], buf[at + 2], buf[at + 3]])
+}
+
+pub(crate) fn le_u64(buf: &[u8], at: usize) -> u64 {
+    let mut bytes = [0u8; 8];
+    bytes.copy_from_slice(&buf[at..at + 8]);
+    u64::from_le_bytes(bytes)
+}
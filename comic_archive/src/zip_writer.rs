@@ -0,0 +1,501 @@
+//! Writing ZIP/CBZ archives without recompressing anything.
+//!
+//! `ZipBuilder` writes an archive entry by entry, then its central directory. Entries from
+//! another archive are copied verbatim, compressed bytes, method and CRC included, so
+//! repacking is bound by I/O rather than inflate/deflate. New files are stored.
+//!
+//! `append` uses it to update an archive in place: new entries go after the current end of
+//! the file, followed by a fresh central directory that lists the surviving entries (their
+//! records copied verbatim) and the new ones. Nothing already in the file is touched, so
+//! saving costs the size of the new data plus the directory, however large the archive
+//! is. Replaced entries and the old directory become dead space, reported by
+//! `ZipIndex::dead_space`, until the archive is compacted.
+
+use std::collections::HashSet;
+use std::fs::File;
+use std::io::{BufWriter, Seek, SeekFrom, Write};
+use std::time::{SystemTime, UNIX_EPOCH};
+
+use zip::result::ZipError;
+
+use crate::error::ArchiveError;
+use crate::zip_index::{
+    CENTRAL_HEADER_LEN, CENTRAL_HEADER_SIG, EOCD_SIG, FLAG_UTF8, LOCAL_HEADER_LEN,
+    LOCAL_HEADER_SIG, METHOD_STORED, ZIP64_EOCD_SIG, ZIP64_EXTRA_ID, ZIP64_LOCATOR_SIG, ZipEntry,
+    ZipIndex, le_u16, le_u32, read_exact_at,
+};
+
+/// Version 4.5 of the spec (ZIP64), made on Unix.
+const VERSION_MADE_BY: u16 = (3 << 8) | 45;
+const VERSION_NEEDED: u16 = 20;
+const VERSION_NEEDED_ZIP64: u16 = 45;
+/// Regular file, rw-r--r--, matching what `create_from_path` writes.
+const EXTERNAL_ATTRIBUTES: u32 = 0o100644 << 16;
+/// Chunk size for copying entry data between files.
+const COPY_CHUNK: u64 = 1024 * 1024;
+/// Info-ZIP Unicode Path extra field: a UTF-8 copy of the name that readers prefer over
+/// the name itself, so a renamed entry must not keep it.
+const UNICODE_PATH_EXTRA_ID: u16 = 0x7075;
+
+/// Append `files` (name, contents) to the archive, stored uncompressed. Entries with the
+/// same name as a new file are dropped from the directory. Returns the old end of the
+/// file, where the appended entries start.
+///
+/// On failure the file is truncated back to its old end. A partial write left in place
+/// would push the old end record out of the tail that `ZipIndex::read` searches, making
+/// the archive unreadable.
+pub(crate) fn append(
+    file: &mut File,
+    index: &ZipIndex,
+    files: &[(&str, &[u8])],
+) -> Result<u64, ArchiveError> {
+    let end = file.seek(SeekFrom::End(0))?;
+    let result = write_appended(file, index, files, end);
+    if let Err(e) = &result {
+        log::warn!("Append failed, truncating to {} bytes: {}", end, e);
+        if let Err(e) = file.set_len(end) {
+            log::error!("Failed to truncate after a failed append: {}", e);
+        }
+    }
+    result.map(|()| end)
+}
+
+fn write_appended(
+    file: &mut File,
+    index: &ZipIndex,
+    files: &[(&str, &[u8])],
+    end: u64,
+) -> Result<(), ArchiveError> {
+    let replaced: HashSet<&str> = files.iter().map(|(name, _)| *name).collect();
+    let mut builder = ZipBuilder::at(BufWriter::new(&mut *file), end, index.archive_offset);
+    for entry in index.live_entries() {
+        if !replaced.contains(entry.name.as_str()) {
+            builder.keep_entry(entry);
+        }
+    }
+    for (name, data) in files {
+        builder.add_stored(name, data)?;
+    }
+    builder.finish(&index.comment)?;
+
+    file.sync_data()?;
+    Ok(())
+}
+
+/// Writes an archive entry by entry, collecting the central directory as it goes.
+pub(crate) struct ZipBuilder<W: Write> {
+    out: Sink<W>,
+    /// Directory offsets are relative to this position.
+    archive_offset: u64,
+    central: Vec<u8>,
+    count: u64,
+    time: u16,
+    date: u16,
+}
+
+impl<W: Write> ZipBuilder<W> {
+    /// Start a new archive at the beginning of `out`.
+    pub fn new(out: W) -> Self {
+        Self::at(out, 0, 0)
+    }
+
+    /// Continue writing at absolute position `pos` of an archive that starts at
+    /// `archive_offset`.
+    fn at(out: W, pos: u64, archive_offset: u64) -> Self {
+        let (time, date) = dos_datetime(SystemTime::now());
+        Self {
+            out: Sink { inner: out, pos },
+            archive_offset,
+            central: Vec::new(),
+            count: 0,
+            time,
+            date,
+        }
+    }
+
+    /// List an entry that is already in the output file, without writing it again.
+    fn keep_entry(&mut self, entry: &ZipEntry) {
+        self.central.extend_from_slice(&entry.central);
+        self.count += 1;
+    }
+
+    /// Add a new file, stored uncompressed.
+    pub fn add_stored(&mut self, name: &str, data: &[u8]) -> Result<(), ArchiveError> {
+        if name.len() > u16::MAX as usize {
+            return Err(ZipError::InvalidArchive("File name too long").into());
+        }
+        let entry = NewEntry {
+            name,
+            crc32: crc32fast::hash(data),
+            size: data.len() as u64,
+            offset: self.out.pos - self.archive_offset,
+            time: self.time,
+            date: self.date,
+        };
+        entry.write_local_header(&mut self.out)?;
+        self.out.write_all(data)?;
+        entry.write_central_header(&mut self.central);
+        self.count += 1;
+        Ok(())
+    }
+
+    /// Copy an entry from `src` verbatim: local header, compressed data and data
+    /// descriptor. With `rename`, the name in both headers changes and any Unicode Path
+    /// field, which would carry the old name, is dropped.
+    pub fn copy_entry(
+        &mut self,
+        src: &File,
+        entry: &ZipEntry,
+        rename: Option<&str>,
+    ) -> Result<(), ArchiveError> {
+        let mut local = [0u8; LOCAL_HEADER_LEN as usize];
+        read_exact_at(src, &mut local, entry.header_offset)?;
+        let local_name_len = le_u16(&local, 26) as u64;
+        let mut local_extra = vec![0u8; le_u16(&local, 28) as usize];
+        read_exact_at(
+            src,
+            &mut local_extra,
+            entry.header_offset + LOCAL_HEADER_LEN + local_name_len,
+        )?;
+
+        if rename.is_some() {
+            local_extra = without_field(&local_extra, UNICODE_PATH_EXTRA_ID);
+        }
+
+        let central_name_len = le_u16(&entry.central, 28) as usize;
+        let (name, flags) = match rename {
+            Some(name) if !name.is_ascii() => (name.as_bytes(), entry.flags | FLAG_UTF8),
+            Some(name) => (name.as_bytes(), entry.flags),
+            None => (
+                &entry.central[CENTRAL_HEADER_LEN..CENTRAL_HEADER_LEN + central_name_len],
+                entry.flags,
+            ),
+        };
+
+        let offset = self.out.pos - self.archive_offset;
+        local[6..8].copy_from_slice(&flags.to_le_bytes());
+        local[26..28].copy_from_slice(&(name.len() as u16).to_le_bytes());
+        local[28..30].copy_from_slice(&(local_extra.len() as u16).to_le_bytes());
+        self.out.write_all(&local)?;
+        self.out.write_all(name)?;
+        self.out.write_all(&local_extra)?;
+
+        let data_len = entry.compressed_size + entry.descriptor_len(src)?;
+        copy_range(src, entry.data_offset(src)?, data_len, &mut self.out)?;
+
+        relocate_central(
+            &entry.central,
+            name,
+            rename.is_some(),
+            flags,
+            offset,
+            &mut self.central,
+        );
+        self.count += 1;
+        Ok(())
+    }
+
+    /// Write the central directory and end record, returning the underlying writer.
+    pub fn finish(mut self, comment: &[u8]) -> Result<W, ArchiveError> {
+        let cd_offset = self.out.pos - self.archive_offset;
+        self.out.write_all(&self.central)?;
+        write_end_of_directory(
+            &mut self.out,
+            self.count,
+            self.central.len() as u64,
+            cd_offset,
+            comment,
+        )?;
+        self.out.flush()?;
+        Ok(self.out.inner)
+    }
+}
+
+/// Copy `len` bytes starting at `offset` in `src` to `out`.
+fn copy_range(src: &File, offset: u64, len: u64, out: &mut impl Write) -> Result<(), ArchiveError> {
+    let mut buf = vec![0u8; len.min(COPY_CHUNK) as usize];
+    let mut done = 0;
+    while done < len {
+        let n = (len - done).min(COPY_CHUNK) as usize;
+        read_exact_at(src, &mut buf[..n], offset + done)?;
+        out.write_all(&buf[..n])?;
+        done += n as u64;
+    }
+    Ok(())
+}
+
+/// Append a copy of the central directory `record` to `out` with a new name, flags and
+/// local header offset. The ZIP64 extra field is rebuilt so it carries the offset only
+/// when it no longer fits in 32 bits, and the Unicode Path field is dropped if the entry
+/// was `renamed`; every other field is kept.
+fn relocate_central(
+    record: &[u8],
+    name: &[u8],
+    renamed: bool,
+    flags: u16,
+    offset: u64,
+    out: &mut Vec<u8>,
+) {
+    let name_len = le_u16(record, 28) as usize;
+    let extra_len = le_u16(record, 30) as usize;
+    let comment_len = le_u16(record, 32) as usize;
+    let extra_start = CENTRAL_HEADER_LEN + name_len;
+    let comment_start = extra_start + extra_len;
+
+    // The ZIP64 field holds the saturated values in a fixed order: uncompressed size,
+    // compressed size, then header offset.
+    let mut extra = Vec::with_capacity(extra_len + 8);
+    let mut zip64 = Vec::new();
+    let mut rest = &record[extra_start..comment_start];
+    while rest.len() >= 4 {
+        let id = le_u16(rest, 0);
+        let len = (4 + le_u16(rest, 2) as usize).min(rest.len());
+        if id == ZIP64_EXTRA_ID {
+            let body = &rest[4..len];
+            let mut field = 0;
+            for at in [24, 20] {
+                if le_u32(record, at) == 0xFFFF_FFFF && body.len() >= field + 8 {
+                    zip64.extend_from_slice(&body[field..field + 8]);
+                    field += 8;
+                }
+            }
+        } else if !(renamed && id == UNICODE_PATH_EXTRA_ID) {
+            extra.extend_from_slice(&rest[..len]);
+        }
+        rest = &rest[len..];
+    }
+    if offset >= 0xFFFF_FFFF {
+        put_u64(&mut zip64, offset);
+    }
+    if !zip64.is_empty() {
+        put_u16(&mut extra, ZIP64_EXTRA_ID);
+        put_u16(&mut extra, zip64.len() as u16);
+        extra.extend_from_slice(&zip64);
+    }
+
+    let start = out.len();
+    out.extend_from_slice(&record[..CENTRAL_HEADER_LEN]);
+    out[start + 8..start + 10].copy_from_slice(&flags.to_le_bytes());
+    out[start + 28..start + 30].copy_from_slice(&(name.len() as u16).to_le_bytes());
+    out[start + 30..start + 32].copy_from_slice(&(extra.len() as u16).to_le_bytes());
+    out[start + 42..start + 46].copy_from_slice(&saturate(offset).to_le_bytes());
+    out.extend_from_slice(name);
+    out.extend_from_slice(&extra);
+    out.extend_from_slice(&record[comment_start..comment_start + comment_len]);
+}
+
+/// The fields of `extra` other than those with id `drop`.
+fn without_field(extra: &[u8], drop: u16) -> Vec<u8> {
+    let mut kept = Vec::with_capacity(extra.len());
+    let mut rest = extra;
+    while rest.len() >= 4 {
+        let len = (4 + le_u16(rest, 2) as usize).min(rest.len());
+        if le_u16(rest, 0) != drop {
+            kept.extend_from_slice(&rest[..len]);
+        }
+        rest = &rest[len..];
+    }
+    kept.extend_from_slice(rest);
+    kept
+}
+
+/// A writer that tracks its absolute position in the file.
+struct Sink<W> {
+    inner: W,
+    pos: u64,
+}
+
+impl<W: Write> Write for Sink<W> {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        let n = self.inner.write(buf)?;
+        self.pos += n as u64;
+        Ok(n)
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        self.inner.flush()
+    }
+}
+
+/// A stored entry being appended.
+struct NewEntry<'a> {
+    name: &'a str,
+    crc32: u32,
+    size: u64,
+    /// Offset of the local header, relative to the start of the archive.
+    offset: u64,
+    time: u16,
+    date: u16,
+}
+
+impl NewEntry<'_> {
+    fn flags(&self) -> u16 {
+        if self.name.is_ascii() { 0 } else { FLAG_UTF8 }
+    }
+
+    fn write_local_header(&self, out: &mut impl Write) -> std::io::Result<()> {
+        let zip64 = self.size >= 0xFFFF_FFFF;
+        let mut extra = Vec::new();
+        if zip64 {
+            put_u16(&mut extra, ZIP64_EXTRA_ID);
+            put_u16(&mut extra, 16);
+            put_u64(&mut extra, self.size);
+            put_u64(&mut extra, self.size);
+        }
+
+        let mut header = Vec::with_capacity(30 + self.name.len() + extra.len());
+        put_u32(&mut header, LOCAL_HEADER_SIG);
+        put_u16(
+            &mut header,
+            if zip64 {
+                VERSION_NEEDED_ZIP64
+            } else {
+                VERSION_NEEDED
+            },
+        );
+        put_u16(&mut header, self.flags());
+        put_u16(&mut header, METHOD_STORED);
+        put_u16(&mut header, self.time);
+        put_u16(&mut header, self.date);
+        put_u32(&mut header, self.crc32);
+        put_u32(&mut header, saturate(self.size));
+        put_u32(&mut header, saturate(self.size));
+        put_u16(&mut header, self.name.len() as u16);
+        put_u16(&mut header, extra.len() as u16);
+        header.extend_from_slice(self.name.as_bytes());
+        header.extend_from_slice(&extra);
+        out.write_all(&header)
+    }
+
+    fn write_central_header(&self, out: &mut Vec<u8>) {
+        // The ZIP64 extra field carries only the saturated values, in this fixed order.
+        let mut extra = Vec::new();
+        if self.size >= 0xFFFF_FFFF {
+            put_u64(&mut extra, self.size);
+            put_u64(&mut extra, self.size);
+        }
+        if self.offset >= 0xFFFF_FFFF {
+            put_u64(&mut extra, self.offset);
+        }
+        if !extra.is_empty() {
+            let mut field = Vec::with_capacity(4 + extra.len());
+            put_u16(&mut field, ZIP64_EXTRA_ID);
+            put_u16(&mut field, extra.len() as u16);
+            field.extend_from_slice(&extra);
+            extra = field;
+        }
+
+        put_u32(out, CENTRAL_HEADER_SIG);
+        put_u16(out, VERSION_MADE_BY);
+        put_u16(
+            out,
+            if extra.is_empty() {
+                VERSION_NEEDED
+            } else {
+                VERSION_NEEDED_ZIP64
+            },
+        );
+        put_u16(out, self.flags());
+        put_u16(out, METHOD_STORED);
+        put_u16(out, self.time);
+        put_u16(out, self.date);
+        put_u32(out, self.crc32);
+        put_u32(out, saturate(self.size));
+        put_u32(out, saturate(self.size));
+        put_u16(out, self.name.len() as u16);
+        put_u16(out, extra.len() as u16);
+        put_u16(out, 0); // comment length
+        put_u16(out, 0); // disk number start
+        put_u16(out, 0); // internal attributes
+        put_u32(out, EXTERNAL_ATTRIBUTES);
+        put_u32(out, saturate(self.offset));
+        out.extend_from_slice(self.name.as_bytes());
+        out.extend_from_slice(&extra);
+    }
+}
+
+/// Write the end-of-central-directory record, preceded by the ZIP64 record and locator
+/// when any value does not fit the classic fields.
+fn write_end_of_directory<W: Write>(
+    out: &mut Sink<W>,
+    count: u64,
+    cd_size: u64,
+    cd_offset: u64,
+    comment: &[u8],
+) -> std::io::Result<()> {
+    let mut tail = Vec::with_capacity(98 + comment.len());
+    if count >= 0xFFFF || cd_size >= 0xFFFF_FFFF || cd_offset >= 0xFFFF_FFFF {
+        let record_offset = cd_offset + cd_size;
+        put_u32(&mut tail, ZIP64_EOCD_SIG);
+        put_u64(&mut tail, 44); // size of the rest of the record
+        put_u16(&mut tail, VERSION_MADE_BY);
+        put_u16(&mut tail, VERSION_NEEDED_ZIP64);
+        put_u32(&mut tail, 0); // this disk
+        put_u32(&mut tail, 0); // disk with the central directory
+        put_u64(&mut tail, count);
+        put_u64(&mut tail, count);
+        put_u64(&mut tail, cd_size);
+        put_u64(&mut tail, cd_offset);
+
+        put_u32(&mut tail, ZIP64_LOCATOR_SIG);
+        put_u32(&mut tail, 0); // disk with the ZIP64 record
+        put_u64(&mut tail, record_offset);
+        put_u32(&mut tail, 1); // total disks
+    }
+
+    let count16 = count.min(0xFFFF) as u16;
+    put_u32(&mut tail, EOCD_SIG);
+    put_u16(&mut tail, 0); // this disk
+    put_u16(&mut tail, 0); // disk with the central directory
+    put_u16(&mut tail, count16);
+    put_u16(&mut tail, count16);
+    put_u32(&mut tail, saturate(cd_size));
+    put_u32(&mut tail, saturate(cd_offset));
+    put_u16(&mut tail, comment.len() as u16);
+    tail.extend_from_slice(comment);
+    out.write_all(&tail)
+}
+
+fn saturate(value: u64) -> u32 {
+    value.min(0xFFFF_FFFF) as u32
+}
+
+fn put_u16(buf: &mut Vec<u8>, value: u16) {
+    buf.extend_from_slice(&value.to_le_bytes());
+}
+
+fn put_u32(buf: &mut Vec<u8>, value: u32) {
+    buf.extend_from_slice(&value.to_le_bytes());
+}
+
+fn put_u64(buf: &mut Vec<u8>, value: u64) {
+    buf.extend_from_slice(&value.to_le_bytes());
+}
+
+/// MS-DOS (time, date) for `now` in UTC, clamped to the format's 1980 epoch.
+fn dos_datetime(now: SystemTime) -> (u16, u16) {
+    let secs = now
+        .duration_since(UNIX_EPOCH)
+        .map(|d| d.as_secs())
+        .unwrap_or(0);
+    let days = (secs / 86_400) as i64;
+    let rem = secs % 86_400;
+
+    // Civil date from days since 1970-01-01 (Howard Hinnant's algorithm).
+    let z = days + 719_468;
+    let era = z.div_euclid(146_097);
+    let doe = z.rem_euclid(146_097);
+    let yoe = (doe - doe / 1460 + doe / 36_524 - doe / 146_096) / 365;
+    let doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    let mp = (5 * doy + 2) / 153;
+    let day = doy - (153 * mp + 2) / 5 + 1;
+    let month = if mp < 10 { mp + 3 } else { mp - 9 };
+    let year = yoe + era * 400 + if month <= 2 { 1 } else { 0 };
+
+    if year < 1980 {
+        return (0, (1 << 5) | 1);
+    }
+    let time = ((rem / 3600) << 11 | (rem % 3600 / 60) << 5 | (rem % 60) / 2) as u16;
+    let date = (((year - 1980).min(127) << 9) | (month << 5) | day) as u16;
+    (time, date)
+}
@@ -10,8 +10,8 @@ use tokio::sync::Semaphore;
 /// The main application struct, holding all state.
 pub struct CBZViewerApp {
     pub archive_path: Option<PathBuf>,
-    pub archive: Option<Arc<Mutex<ImageArchive>>>,
-    pub filenames: Option<Vec<String>>,
+    pub archive: Option<Arc<RwLock<ImageArchive>>>,
+    pub pages: Option<PageTable>,
     pub image_lru: SharedImageCache,
     pub current_page: usize,
     pub texture_cache: TextureCache,
@@ -24,6 +24,8 @@ pub struct CBZViewerApp {
     pub right_to_left: bool,
     pub has_initialised_zoom: bool,
     pub loading_pages: Arc<Mutex<HashSet<usize>>>,
+    /// Running page loads, so they can be cancelled once the reader moves away.
+    pub prefetch_tasks: std::collections::HashMap<usize, tokio::task::AbortHandle>,
     pub page_goto_box: String,
     pub show_manifest_editor: bool,
     pub on_goto_page: bool,
@@ -36,6 +38,8 @@ pub struct CBZViewerApp {
     pub show_thumbnail_grid: bool,
     pub thumbnail_cache: Arc<Mutex<std::collections::HashMap<usize, image::DynamicImage>>>,
     pub thumb_semaphore: Arc<Semaphore>,
+    /// Pages whose thumbnails are being made.
+    pub thumbnails_loading: Arc<Mutex<HashSet<usize>>>,
     pub new_page: Option<PathBuf>,
     pub show_debug_menu: bool,
     pub slideshow_mode: bool,
@@ -50,8 +54,8 @@ impl Default for CBZViewerApp {
         Self {
             archive_path: None,
             archive: None,
-            filenames: None,
-            image_lru: new_image_cache(CACHE_SIZE),
+            pages: None,
+            image_lru: new_image_cache(IMAGE_CACHE_BUDGET),
             current_page: 0,
             texture_cache: TextureCache::new(),
             ui_logger: Arc::new(Mutex::new(UiLogger::new())),
@@ -63,6 +67,7 @@ impl Default for CBZViewerApp {
             right_to_left: DEFAULT_RIGHT_TO_LEFT,
             has_initialised_zoom: false,
             loading_pages: Arc::new(Mutex::new(HashSet::new())),
+            prefetch_tasks: std::collections::HashMap::new(),
             page_goto_box: "1".to_string(),
             show_manifest_editor: false,
             on_goto_page: false,
@@ -75,6 +80,7 @@ impl Default for CBZViewerApp {
             show_thumbnail_grid: false,
             thumbnail_cache: Arc::new(Mutex::new(std::collections::HashMap::new())),
             thumb_semaphore: Arc::new(Semaphore::new(8)), // Limit to 8 concurrent thumbnail loads
+            thumbnails_loading: Arc::new(Mutex::new(HashSet::new())),
             new_page: None,
             show_debug_menu: false,
             slideshow_mode: false,
@@ -136,8 +142,8 @@ impl CBZViewerApp {
     /// Go to a specific page (with bounds checking).
     pub fn goto_page(&mut self, page: usize) -> bool {
         self.on_page_changed();
-        if let Some(filenames) = &self.filenames {
-            if page >= filenames.len() {
+        if let Some(pages) = &self.pages {
+            if page >= pages.len() {
                 if let Ok(mut logger) = self.ui_logger.lock() {
                     logger.warn(
                         format!("Requested page {} is out of bounds.", page + 1),
@@ -165,28 +171,58 @@ impl CBZViewerApp {
 
         let archive = ImageArchive::process(&path).await?;
 
-        let archive = Arc::new(Mutex::new(archive));
-        if let Ok(guard) = archive.lock() {
-            let filenames = guard.list_images();
-            new_self.filenames = Some(filenames);
+        let archive = Arc::new(RwLock::new(archive));
+        if let Ok(guard) = archive.read() {
+            new_self.pages = Some(guard.pages());
             new_self.is_web_archive = guard.manifest.meta.web_archive;
         }
         new_self.archive_path = Some(path);
-        new_self.total_pages = new_self.filenames.as_ref().map_or(0, |f| f.len());
+        new_self.total_pages = new_self.pages.as_ref().map_or(0, |p| p.len());
         new_self.archive = Some(Arc::clone(&archive));
-        new_self.image_lru = new_image_cache(CACHE_SIZE);
+        new_self.image_lru = new_image_cache(IMAGE_CACHE_BUDGET);
         new_self.current_page = 0;
 
         // Move new_self's fields into self
+        self.cancel_prefetch();
         *self = new_self;
 
         Ok(())
     }
 
-    /// Called whenever the page changes: resets zoom, pan, and clears texture cache.
+    /// Pick up pages added to, removed from or rewritten in the archive since it was
+    /// opened, as happens with a watched folder. Cached images are keyed by page index, so
+    /// they are only kept when the new pages extend the list without shifting or changing
+    /// it.
+    fn refresh_pages(&mut self) {
+        let (Some(archive), Some(current)) = (self.archive.as_ref(), self.pages.as_ref()) else {
+            return;
+        };
+        let latest = archive.read().unwrap().pages();
+        if Arc::ptr_eq(current, &latest) {
+            return;
+        }
+
+        let appended = latest.len() >= current.len()
+            && current.iter().zip(latest.iter()).all(|(a, b)| a.name == b.name && a.size == b.size);
+        if !appended {
+            let current_name = current.get(self.current_page).map(|entry| entry.name.clone());
+            self.cancel_prefetch();
+            self.image_lru.clear();
+            self.thumbnail_cache.lock().unwrap().clear();
+            self.texture_cache.clear();
+            self.current_page = current_name
+                .and_then(|name| latest.iter().position(|entry| entry.name == name))
+                .unwrap_or_else(|| self.current_page.min(latest.len().saturating_sub(1)));
+        }
+        debug!("Page list changed: {} -> {} pages", current.len(), latest.len());
+        self.total_pages = latest.len();
+        self.pages = Some(latest);
+    }
+
+    /// Called whenever the page changes: resets zoom and pan. Textures are kept, so
+    /// turning back does not upload the page again.
     pub fn on_page_changed(&mut self) {
         self.has_initialised_zoom = false;
-        self.texture_cache.clear();
         self.pan_offset = Vec2::ZERO;
     }
 
@@ -194,7 +230,7 @@ impl CBZViewerApp {
         // Set the window title based on the archive name or path
         if let Some(archive) = self.archive.as_ref() {
             let mut title = NAME.to_string();
-            if let Ok(archive) = archive.lock() {
+            if let Ok(archive) = archive.read() {
                 if !archive.manifest.meta.title.is_empty()
                     && archive.manifest.meta.title != "Unknown"
                 {
@@ -219,55 +255,76 @@ impl CBZViewerApp {
         }
     }
 
-    pub fn preload_images(&mut self, ctx: &egui::Context, archive: Arc<Mutex<ImageArchive>>) {
-        let filenames = self.filenames.clone().unwrap_or_default();
+    pub fn preload_images(&mut self, ctx: &egui::Context, backend: Arc<dyn ImageArchiveTrait>) {
+        let Some(pages) = self.pages.clone() else {
+            return;
+        };
 
-        // Preload images for current view and next pages
-        let mut pages_to_preload = vec![self.current_page];
-        let read_ahead = if self.is_web_archive {
+        // Preload images for current view and next pages. Web archives size the window
+        // from their measured download speed.
+        let read_ahead = backend.prefetch_window().unwrap_or(if self.is_web_archive {
             READ_AHEAD_WEB
         } else {
             READ_AHEAD
+        });
+        let visible = if self.double_page_mode { 2 } else { 1 };
+        // Read no further ahead than the image cache can hold, and pin what is read so
+        // nothing else evicts it. Trimming here also lets the cache shrink under memory
+        // pressure while the reader is idle.
+        let read_ahead = match self.image_lru.pages_that_fit() {
+            Some(fit) => read_ahead.min(fit.saturating_sub(1)).max(visible - 1),
+            None => read_ahead,
         };
+        let wanted = self.current_page..(self.current_page + read_ahead + 1).min(self.total_pages);
+        self.image_lru.pin(wanted.clone());
+        self.image_lru.trim();
+
+        // Cancel loads the reader has moved away from, so a jump does not leave the
+        // network busy with pages nobody will look at.
+        self.prefetch_tasks.retain(|page, task| {
+            let keep = !task.is_finished() && wanted.contains(page);
+            if !keep {
+                task.abort();
+            }
+            keep
+        });
 
-        for offset in 1..=read_ahead {
-            let next = self.current_page + offset;
-            if next < self.total_pages {
-                pages_to_preload.push(next);
+        for page in wanted {
+            if self.prefetch_tasks.contains_key(&page)
+                || self.image_lru.contains(&page)
+            {
+                continue;
             }
-        }
-        for &page in &pages_to_preload {
-            let filenames = Arc::new(filenames.clone());
-            let archive = archive.clone();
+            let pages = pages.clone();
+            let backend = backend.clone();
             let image_lru = self.image_lru.clone();
             let loading_pages = self.loading_pages.clone();
             let ctx = ctx.clone();
-            tokio::spawn(async move {
-                // Do NOT lock any mutex here before await!
-                let _ =
-                    load_image_async(page, filenames, archive, image_lru, loading_pages, ctx).await;
+            let speculative = page >= self.current_page + visible;
+            let task = tokio::spawn(async move {
+                if let Err(e) = load_image_async(
+                    page,
+                    pages,
+                    backend,
+                    image_lru,
+                    loading_pages,
+                    ctx,
+                    speculative,
+                )
+                .await
+                {
+                    warn!("Failed to load page {}: {}", page, e);
+                }
             });
+            self.prefetch_tasks.insert(page, task.abort_handle());
         }
     }
 
-    /// Try to get the full-size image for a page from the LRU cache.
-    pub fn get_image_from_cache(&self, page_idx: usize) -> Option<image::DynamicImage> {
-        use crate::cache::image_cache::PageImage;
-
-        // Try LRU cache first
-        if let Some(entry) = self.image_lru.lock().unwrap().get(&page_idx) {
-            if let PageImage::Static(ref dyn_img) = entry.image {
-                return Some(dyn_img.clone());
-            }
-        }
-
-        // Optionally, try thumbnail cache (not full-size)
-        if let Some(thumb) = self.thumbnail_cache.lock().unwrap().get(&page_idx) {
-            return Some(thumb.clone());
+    /// Abort every running page load.
+    fn cancel_prefetch(&mut self) {
+        for (_, task) in self.prefetch_tasks.drain() {
+            task.abort();
         }
-
-        // Not found in cache
-        None
     }
 
     pub fn on_changes(&mut self) {
@@ -321,39 +378,23 @@ impl CBZViewerApp {
         if self.on_save_image {
             self.on_save_image = false;
             let ui_logger = self.ui_logger.clone();
-            let archive = self.archive.clone();
-            let filenames = self.filenames.clone();
+            let backend = self
+                .archive
+                .as_ref()
+                .map(|archive| archive.read().unwrap().backend());
+            let pages = self.pages.clone();
             let current_page = self.current_page;
             // Spawn a background task to avoid blocking the UI
             tokio::spawn(async move {
-                if let Some(archive_mutex) = archive {
-                    // Lock and extract the filename while holding the lock
-                    let filename = filenames
+                if let Some(backend) = backend {
+                    let filename = pages
                         .as_ref()
-                        .and_then(|f| f.get(current_page).cloned())
+                        .and_then(|p| p.get(current_page).map(|entry| entry.name.clone()))
                         .unwrap_or_else(|| "image".to_string());
 
-                    // Clone the Arc<Mutex<ImageArchive>> for use in async block
-                    let archive_clone = archive_mutex.clone();
-
-                    // Clone the filename for use after the lock is dropped
-                    let filename_clone = filename.clone();
-
-                    // Lock the archive, extract what is needed, and drop the guard before await
-                    let image_data = {
-                        let mut archive_guard = archive_clone.lock().unwrap();
-                        // Clone the data needed for the async call
-                        let filename_owned = filename_clone.clone();
-                        // Call the async function and await it while holding the lock
-                        // If possible, refactor read_image_by_name to not borrow self
-                        futures::executor::block_on(
-                            archive_guard.read_image_by_name(&filename_owned),
-                        )
-                    };
+                    let image_data = backend.read_image_by_name(&filename).await;
 
                     if let Ok(image) = image_data {
-                        let image_vec: Vec<u8> = image.into();
-
                         use std::path::Path;
                         let basename = Path::new(&filename)
                             .file_name()
@@ -369,7 +410,7 @@ impl CBZViewerApp {
                             use tokio::io::AsyncWriteExt;
                             match tokio::fs::File::create(&save_path).await {
                                 Ok(mut file) => {
-                                    if let Err(e) = file.write_all(&image_vec).await {
+                                    if let Err(e) = file.write_all(&image).await {
                                         if let Ok(mut logger) = ui_logger.lock() {
                                             logger.error(
                                                 format!("Failed to save image: {}", e),
@@ -431,6 +472,7 @@ impl eframe::App for CBZViewerApp {
         }
 
         self.update_window_title(ctx);
+        self.refresh_pages();
 
         // Only preload images if we have an archive and not in manifest editor mode
         if self.show_manifest_editor {
@@ -439,8 +481,8 @@ impl eframe::App for CBZViewerApp {
             }
         } else {
             if let Some(archive) = self.archive.as_ref() {
-                let archive: Arc<Mutex<ImageArchive>> = Arc::clone(archive);
-                self.preload_images(ctx, archive);
+                let backend = archive.read().unwrap().backend();
+                self.preload_images(ctx, backend);
             }
         }
 
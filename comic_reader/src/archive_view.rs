@@ -2,8 +2,8 @@ use crate::prelude::*;
 
 pub struct ArchiveView {
     pub archive_path: Option<PathBuf>,
-    pub archive: Option<Arc<Mutex<ImageArchive>>>,
-    pub filenames: Option<Vec<String>>,
+    pub archive: Option<Arc<RwLock<ImageArchive>>>,
+    pub pages: Option<PageTable>,
     pub current_page: usize,
     pub texture_cache: TextureCache,
     pub zoom: f32,
@@ -20,7 +20,7 @@ impl Default for ArchiveView {
         Self {
             archive_path: None,
             archive: None,
-            filenames: None,
+            pages: None,
             current_page: 0,
             texture_cache: TextureCache::new(),
             zoom: 1.0,
@@ -48,8 +48,8 @@ impl ArchiveView {
     }
 
     pub fn goto_page(&mut self, page: usize) -> bool {
-        if let Some(filenames) = &self.filenames {
-            if page >= filenames.len() {
+        if let Some(pages) = &self.pages {
+            if page >= pages.len() {
                 return false;
             }
             self.current_page = page;
@@ -71,12 +71,13 @@ impl ArchiveView {
 
     pub fn on_page_changed(&mut self) {
         self.has_initialised_zoom = false;
-        self.texture_cache.clear();
         self.pan_offset = Vec2::ZERO;
     }
 
     pub fn preload_images(&mut self, ctx: &egui::Context, is_web_archive: bool) {
-        let filenames = self.filenames.clone().unwrap_or_default();
+        let Some(pages) = self.pages.clone() else {
+            return;
+        };
         let mut pages_to_preload = vec![self.current_page];
         let read_ahead = if is_web_archive { READ_AHEAD_WEB } else { READ_AHEAD };
         for offset in 1..=read_ahead {
@@ -86,27 +87,27 @@ impl ArchiveView {
             }
         }
         for &page in &pages_to_preload {
-            let filenames = Arc::new(filenames.clone());
-            let archive = self.archive.clone().unwrap();
-            let image_lru = new_image_cache(CACHE_SIZE);
+            let pages = pages.clone();
+            let backend = self.archive.as_ref().unwrap().read().unwrap().backend();
+            let image_lru = new_image_cache(IMAGE_CACHE_BUDGET);
             let loading_pages = self.loading_pages.clone();
             let ctx = ctx.clone();
+            let speculative = page != self.current_page;
             tokio::spawn(async move {
-                let _ = load_image_async(page, filenames, archive, image_lru, loading_pages, ctx).await;
+                if let Err(e) = load_image_async(
+                    page,
+                    pages,
+                    backend,
+                    image_lru,
+                    loading_pages,
+                    ctx,
+                    speculative,
+                )
+                .await
+                {
+                    warn!("Failed to load page {}: {}", page, e);
+                }
             });
         }
     }
-
-    pub fn get_image_from_cache(&self, image_lru: &SharedImageCache, thumbnail_cache: &Arc<Mutex<std::collections::HashMap<usize, image::DynamicImage>>>, page_idx: usize) -> Option<image::DynamicImage> {
-        use crate::cache::image_cache::PageImage;
-        if let Some(entry) = image_lru.lock().unwrap().get(&page_idx) {
-            if let PageImage::Static(ref dyn_img) = entry.image {
-                return Some(dyn_img.clone());
-            }
-        }
-        if let Some(thumb) = thumbnail_cache.lock().unwrap().get(&page_idx) {
-            return Some(thumb.clone());
-        }
-        None
-    }
 }
\ No newline at end of file
@@ -1,16 +1,22 @@
 //! LRU cache for decoded images and async image loading.
 
+use crate::cache::two_queue::TwoQueue;
 use crate::prelude::*;
+use std::collections::HashMap;
 use std::io::Cursor;
+use std::ops::Range;
+use std::sync::RwLockReadGuard;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use sysinfo::System;
 
-use futures::executor::block_on;
 #[cfg(feature = "webp_animation")]
 use webp_animation::Decoder as WebpAnimDecoder;
 
 /// Represents a decoded page image (static or animated).
 #[derive(Clone)]
 pub enum PageImage {
-    Static(DynamicImage),
+    /// Pixels ready to upload as a texture, converted by the decode worker.
+    Static(Arc<egui::ColorImage>),
     AnimatedGif {
         frames: Vec<egui::TextureHandle>,
         delays: Vec<u16>,
@@ -24,10 +30,43 @@ pub enum PageImage {
 }
 
 impl PageImage {
+    /// Convert a decoded image into the pixels egui uploads. Called on decode workers, so
+    /// the UI thread only hands the result to egui.
+    pub fn from_dynamic(img: DynamicImage) -> Self {
+        let size = [img.width() as usize, img.height() as usize];
+        let color_image = match img {
+            DynamicImage::ImageRgb8(rgb) => egui::ColorImage::from_rgb(size, rgb.as_raw()),
+            img => egui::ColorImage::from_rgba_unmultiplied(size, img.into_rgba8().as_raw()),
+        };
+        PageImage::Static(Arc::new(color_image))
+    }
+
+    /// A `size` by `size` thumbnail of a static page, resized straight from the cached
+    /// pixels. Resizing premultiplied colours keeps transparent pixels from bleeding into
+    /// their neighbours; the thumbnail is converted back to unmultiplied colours.
+    pub fn thumbnail(&self, size: u32) -> Option<DynamicImage> {
+        let PageImage::Static(img) = self else {
+            return None;
+        };
+        let [w, h] = img.size;
+        let pixels = image::ImageBuffer::<image::Rgba<u8>, &[u8]>::from_raw(
+            w as u32,
+            h as u32,
+            img.as_raw(),
+        )?;
+        let mut thumb =
+            image::imageops::resize(&pixels, size, size, image::imageops::FilterType::Lanczos3);
+        for pixel in thumb.pixels_mut() {
+            let [r, g, b, a] = pixel.0;
+            pixel.0 = egui::Color32::from_rgba_premultiplied(r, g, b, a).to_srgba_unmultiplied();
+        }
+        Some(DynamicImage::ImageRgba8(thumb))
+    }
+
     /// Returns the dimensions of the image.
     pub fn dimensions(&self) -> (u32, u32) {
         match self {
-            PageImage::Static(img) => img.dimensions(),
+            PageImage::Static(img) => (img.size[0] as u32, img.size[1] as u32),
             PageImage::AnimatedGif { frames, .. } | PageImage::AnimatedWebP { frames, .. } => {
                 if let Some(frame) = frames.first() {
                     (frame.size()[0] as u32, frame.size()[1] as u32)
@@ -37,6 +76,16 @@ impl PageImage {
             }
         }
     }
+
+    /// Bytes of decoded pixels held for the image, every frame of an animation included.
+    pub fn bytes(&self) -> usize {
+        match self {
+            PageImage::Static(img) => img.pixels.len() * std::mem::size_of::<egui::Color32>(),
+            PageImage::AnimatedGif { frames, .. } | PageImage::AnimatedWebP { frames, .. } => {
+                frames.iter().map(|frame| frame.byte_size()).sum()
+            }
+        }
+    }
 }
 
 /// A loaded page, ready for display.
@@ -47,12 +96,254 @@ pub struct LoadedPage {
     pub filename: String,
 }
 
-/// Shared LRU cache for images.
-pub type SharedImageCache = Arc<Mutex<LruCache<usize, LoadedPage>>>;
+/// A cached page, with a mark the reader sets when it looks at the page.
+struct CachedPage {
+    page: Arc<LoadedPage>,
+    used: AtomicBool,
+}
+
+/// What lookups see. Writers patch in only the pages an insert or eviction changed,
+/// under a write lock held for a few map operations, so a lookup never waits for
+/// eviction or the memory check.
+#[derive(Default)]
+struct Published {
+    pages: HashMap<usize, Arc<CachedPage>>,
+    bytes: usize,
+    probation_bytes: usize,
+    budget: usize,
+    evictions: u64,
+}
+
+/// Replacement state, only touched by writers.
+struct Policy {
+    queue: TwoQueue<Arc<CachedPage>>,
+    max_bytes: usize,
+    budget: usize,
+    evictions: u64,
+    system: System,
+    checked: Option<Instant>,
+}
+
+impl Policy {
+    /// Recompute the budget from available memory, at most every
+    /// `IMAGE_CACHE_MEMORY_CHECK`. Returns whether it changed.
+    fn refresh_budget(&mut self) -> bool {
+        if self
+            .checked
+            .is_some_and(|checked| checked.elapsed() < IMAGE_CACHE_MEMORY_CHECK)
+        {
+            return false;
+        }
+        self.checked = Some(Instant::now());
+        self.system.refresh_memory();
+        // Count what this cache holds as available, so filling it does not shrink it.
+        let available = self.system.available_memory() as usize;
+        let budget = if available == 0 {
+            self.max_bytes
+        } else {
+            let share = (available + self.queue.bytes()) / IMAGE_CACHE_MEMORY_SHARE;
+            share.clamp(IMAGE_CACHE_MIN_BUDGET, self.max_bytes.max(IMAGE_CACHE_MIN_BUDGET))
+        };
+        if budget < self.budget {
+            debug!(
+                "Image cache budget cut to {} MB, {} MB of memory available",
+                budget / (1024 * 1024),
+                available / (1024 * 1024)
+            );
+        }
+        std::mem::replace(&mut self.budget, budget) != budget
+    }
+}
+
+/// Decoded pages, kept under a byte budget by a scan-resistant policy (see `two_queue`).
+///
+/// The budget is `max_bytes`, lowered to a share of the memory the system has available
+/// when that runs short, so the reader gives memory back instead of pushing the system
+/// into swap. Pinned pages, the current view and read-ahead, are kept however large.
+///
+/// Lookups read the published pages and never take the lock decode workers insert
+/// under. A lookup that counts as use sets an atomic mark on the page, which the policy
+/// folds in on the next insert or trim.
+pub struct ImageCache {
+    published: RwLock<Published>,
+    policy: Mutex<Policy>,
+    pinned_start: AtomicUsize,
+    pinned_end: AtomicUsize,
+}
+
+impl ImageCache {
+    pub fn new(max_bytes: usize) -> Self {
+        let cache = Self {
+            published: RwLock::default(),
+            policy: Mutex::new(Policy {
+                queue: TwoQueue::new(),
+                max_bytes,
+                budget: max_bytes,
+                evictions: 0,
+                system: System::new(),
+                checked: None,
+            }),
+            pinned_start: AtomicUsize::new(0),
+            pinned_end: AtomicUsize::new(0),
+        };
+        cache.trim();
+        cache
+    }
+
+    /// The published pages and stats. Lookups hold the read lock only while they use it,
+    /// so the pages a writer takes out are never freed on a reader's thread.
+    fn published(&self) -> RwLockReadGuard<'_, Published> {
+        self.published.read().unwrap()
+    }
+
+    /// Look up a page the reader is looking at, which protects it from scans.
+    pub fn get(&self, page: &usize) -> Option<Arc<LoadedPage>> {
+        let published = self.published();
+        let cached = published.pages.get(page)?;
+        cached.used.store(true, Ordering::Relaxed);
+        Some(cached.page.clone())
+    }
+
+    /// Look up a page without counting it as used, as for making its thumbnail.
+    pub fn peek(&self, page: &usize) -> Option<Arc<LoadedPage>> {
+        let published = self.published();
+        published.pages.get(page).map(|cached| cached.page.clone())
+    }
+
+    pub fn contains(&self, page: &usize) -> bool {
+        self.published().pages.contains_key(page)
+    }
+
+    pub fn put(&self, page: usize, loaded: LoadedPage) {
+        let bytes = loaded.image.bytes();
+        let cached = Arc::new(CachedPage {
+            page: Arc::new(loaded),
+            used: AtomicBool::new(false),
+        });
+        let mut policy = self.policy.lock().unwrap();
+        policy.queue.put(page, cached.clone(), bytes);
+        let removed = self.update(&mut policy, true, Some((page, cached)));
+        drop(policy);
+        drop(removed);
+    }
+
+    /// Never evict `pages`: the pages on screen and those being read ahead.
+    pub fn pin(&self, pages: Range<usize>) {
+        self.pinned_start.store(pages.start, Ordering::Relaxed);
+        self.pinned_end.store(pages.end, Ordering::Relaxed);
+    }
+
+    /// Fold in the reader's marks, check available memory and evict down to the budget.
+    /// Called every frame from the UI thread, so it gives up rather than wait for a
+    /// worker that is inserting.
+    pub fn trim(&self) {
+        if let Ok(mut policy) = self.policy.try_lock() {
+            let removed = self.update(&mut policy, false, None);
+            drop(policy);
+            drop(removed);
+        }
+    }
+
+    pub fn clear(&self) {
+        let mut policy = self.policy.lock().unwrap();
+        policy.queue.clear();
+        let pages = std::mem::take(&mut self.published.write().unwrap().pages);
+        let removed = self.update(&mut policy, true, None);
+        drop(policy);
+        drop((pages, removed));
+    }
+
+    /// Apply marks and pins, evict, and bring the published pages up to date with `put`
+    /// and the evictions. Returns the pages taken out: the caller drops them after
+    /// releasing the policy lock, so freeing their pixels holds up no other thread.
+    fn update(
+        &self,
+        policy: &mut Policy,
+        mut changed: bool,
+        put: Option<(usize, Arc<CachedPage>)>,
+    ) -> Vec<Arc<CachedPage>> {
+        changed |= policy.refresh_budget();
+        // Marks only reorder the queue, which lookups do not see, unless they protect a
+        // page on probation.
+        let probation_bytes = policy.queue.probation_bytes();
+        for (page, cached) in &self.published().pages {
+            if cached.used.swap(false, Ordering::Relaxed) {
+                policy.queue.get(page);
+            }
+        }
+        changed |= policy.queue.probation_bytes() != probation_bytes;
+
+        let pinned = self.pinned_start.load(Ordering::Relaxed)
+            ..self.pinned_end.load(Ordering::Relaxed);
+        policy.queue.pin(pinned);
+        let evicted = policy.queue.evict_to(policy.budget);
+        if evicted.is_empty() && !changed {
+            return Vec::new();
+        }
+        policy.evictions += evicted.len() as u64;
+
+        let mut removed = Vec::with_capacity(evicted.len() + 1);
+        let mut published = self.published.write().unwrap();
+        if let Some((page, cached)) = put {
+            removed.extend(published.pages.insert(page, cached));
+        }
+        removed.extend(evicted.iter().filter_map(|page| published.pages.remove(page)));
+        published.bytes = policy.queue.bytes();
+        published.probation_bytes = policy.queue.probation_bytes();
+        published.budget = policy.budget;
+        published.evictions = policy.evictions;
+        removed
+    }
+
+    pub fn len(&self) -> usize {
+        self.published().pages.len()
+    }
+
+    /// The cached pages, in page order.
+    pub fn pages(&self) -> Vec<(usize, Arc<LoadedPage>)> {
+        let mut pages: Vec<_> = self
+            .published()
+            .pages
+            .iter()
+            .map(|(page, cached)| (*page, cached.page.clone()))
+            .collect();
+        pages.sort_by_key(|(page, _)| *page);
+        pages
+    }
+
+    /// Bytes of decoded pixels held.
+    pub fn bytes(&self) -> usize {
+        self.published().bytes
+    }
+
+    /// Bytes held by pages seen only once, which are evicted first.
+    pub fn probation_bytes(&self) -> usize {
+        self.published().probation_bytes
+    }
+
+    /// The current byte budget, after any cut for low memory.
+    pub fn budget(&self) -> usize {
+        self.published().budget
+    }
+
+    pub fn evictions(&self) -> u64 {
+        self.published().evictions
+    }
+
+    /// How many pages of the size seen so far fit in the budget, or `None` while empty.
+    pub fn pages_that_fit(&self) -> Option<usize> {
+        let published = self.published();
+        let average = published.bytes.checked_div(published.pages.len())?.max(1);
+        Some(published.budget / average)
+    }
+}
+
+/// Shared cache of decoded pages.
+pub type SharedImageCache = Arc<ImageCache>;
 
-/// Create a new shared LRU cache for images.
-pub fn new_image_cache(size: usize) -> SharedImageCache {
-    Arc::new(Mutex::new(LruCache::new(NonZeroUsize::new(size).unwrap())))
+/// Create a new shared image cache holding up to `max_bytes` of decoded pixels.
+pub fn new_image_cache(max_bytes: usize) -> SharedImageCache {
+    Arc::new(ImageCache::new(max_bytes))
 }
 
 // Macro to extract frames and delays and upload as egui textures
@@ -131,49 +422,69 @@ fn decode_gif(buf: &[u8], ctx: &egui::Context) -> Option<(Vec<egui::TextureHandl
     }
 }
 
+/// Marks a page as loading until dropped, so a load that fails or is cancelled does not
+/// leave its page stuck in the set.
+pub struct LoadingGuard {
+    page: usize,
+    loading_pages: Arc<Mutex<std::collections::HashSet<usize>>>,
+}
+
+impl LoadingGuard {
+    /// Mark `page` as loading, or `None` if it already is.
+    pub fn claim(
+        page: usize,
+        loading_pages: Arc<Mutex<std::collections::HashSet<usize>>>,
+    ) -> Option<Self> {
+        if !loading_pages.lock().unwrap().insert(page) {
+            return None;
+        }
+        Some(Self {
+            page,
+            loading_pages,
+        })
+    }
+}
+
+impl Drop for LoadingGuard {
+    fn drop(&mut self) {
+        self.loading_pages.lock().unwrap().remove(&self.page);
+    }
+}
+
 /// Asynchronously load an image from the archive and insert into the cache.
+/// `speculative` loads are prefetches, which the backend may serve behind visible pages.
 pub async fn load_image_async(
     page: usize,
-    filenames: Arc<Vec<String>>,
-    archive: Arc<Mutex<ImageArchive>>,
+    pages: PageTable,
+    backend: Arc<dyn ImageArchiveTrait>,
     image_lru: SharedImageCache,
     loading_pages: Arc<Mutex<std::collections::HashSet<usize>>>,
     ctx: egui::Context,
+    speculative: bool,
 ) -> Result<(), AppError> {
-    {
-        let mut loading = loading_pages.lock().unwrap();
-        if loading.contains(&page) {
-            return Ok(());
-        }
-        loading.insert(page);
-    }
+    let Some(guard) = LoadingGuard::claim(page, loading_pages) else {
+        return Ok(());
+    };
 
-    if image_lru.lock().unwrap().get(&page).is_some() {
-        loading_pages.lock().unwrap().remove(&page);
+    if image_lru.contains(&page) {
         return Ok(());
     }
 
-    let filename = filenames[page].clone();
+    let Some(entry) = pages.get(page) else {
+        return Ok(());
+    };
+    let filename = entry.name.clone();
 
-    // Read the image buffer in a blocking task to avoid holding the lock across .await
-    let archive_clone = archive.clone();
-    let buf: Vec<u8> = match tokio::task::spawn_blocking(move || {
-        let mut archive = archive_clone.lock().unwrap();
-        // Use block_on to run the async function synchronously in the blocking thread
-        // This must return a Vec<u8>
-        block_on(archive.read_image_by_index(page))
-    })
-    .await
-    {
-        Ok(Ok(data)) => data,
-        Ok(Err(e)) => {
-            loading_pages.lock().unwrap().remove(&page);
-            debug!("Failed to read image: {:?}", e);
-            return Ok(());
-        }
+    // Backend reads take `&self`, so pages load in parallel without any archive lock.
+    let read = if speculative {
+        backend.prefetch_image_by_name(&filename).await
+    } else {
+        backend.read_image_by_name(&filename).await
+    };
+    let buf = match read {
+        Ok(data) => data,
         Err(e) => {
-            loading_pages.lock().unwrap().remove(&page);
-            debug!("Failed to join blocking task: {:?}", e);
+            debug!("Failed to read image: {:?}", e);
             return Ok(());
         }
     };
@@ -181,10 +492,13 @@ pub async fn load_image_async(
     let filename_clone = filename.clone();
     let ctx_clone = ctx.clone();
     let image_lru_clone = image_lru.clone();
-    let loading_pages_clone = loading_pages.clone();
 
-    tokio::task::spawn_blocking(move || {
-        let loaded_page = if filename_clone.to_lowercase().ends_with(".gif") {
+    // The guard moves into the decode, which runs to completion even if this task is
+    // cancelled while waiting for it.
+    tokio::task::spawn_blocking(move || -> Result<(), AppError> {
+        let _guard = guard;
+        let format = ImageFormat::from_magic(&buf);
+        let loaded_page = if format == ImageFormat::Gif {
             if let Some((frames, delays)) = decode_gif(&buf, &ctx_clone) {
                 PageImage::AnimatedGif {
                     frames,
@@ -192,10 +506,10 @@ pub async fn load_image_async(
                     start_time: Instant::now(),
                 }
             } else {
-                let img = image::load_from_memory(&buf).unwrap();
-                PageImage::Static(img)
+                let img = image::load_from_memory(&buf)?;
+                PageImage::from_dynamic(img)
             }
-        } else if filename_clone.to_lowercase().ends_with(".webp") {
+        } else if format == ImageFormat::WebP {
             #[cfg(feature = "webp_animation")]
             {
                 if let Some((frames, delays)) = try_decode_animated_webp(&buf, &ctx_clone) {
@@ -205,18 +519,18 @@ pub async fn load_image_async(
                         start_time: Instant::now(),
                     }
                 } else {
-                    let img = image::load_from_memory(&buf).unwrap();
-                    PageImage::Static(img)
+                    let img = image::load_from_memory(&buf)?;
+                    PageImage::from_dynamic(img)
                 }
             }
             #[cfg(not(feature = "webp_animation"))]
             {
-                let img = image::load_from_memory(&buf).unwrap();
-                PageImage::Static(img)
+                let img = image::load_from_memory(&buf)?;
+                PageImage::from_dynamic(img)
             }
         } else {
-            let img = image::load_from_memory(&buf).unwrap();
-            PageImage::Static(img)
+            let img = image::load_from_memory(&buf)?;
+            PageImage::from_dynamic(img)
         };
 
         let loaded_page = LoadedPage {
@@ -225,12 +539,119 @@ pub async fn load_image_async(
             filename: filename_clone,
         };
 
-        image_lru_clone.lock().unwrap().put(page, loaded_page);
-        loading_pages_clone.lock().unwrap().remove(&page);
+        image_lru_clone.put(page, loaded_page);
         debug!("Loaded image page {} into LRU cache", page);
+        Ok(())
     })
     .await
-    .unwrap();
+    .map_err(|e| AppError::Other(format!("Decoding page {page} failed: {e}")))?
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::atomic::AtomicU64;
+
+    /// Pages of 4096 x 2048 pixels, 32 MiB each once decoded.
+    const PAGE_SIZE: [usize; 2] = [4096, 2048];
+    const BUDGET: usize = 256 * 1024 * 1024;
+    const PAGES: usize = 64;
+    const RUN_FOR: Duration = Duration::from_secs(3);
+    /// One frame at 144 Hz.
+    const FRAME: Duration = Duration::from_micros(6944);
 
-    Ok(())
+    fn page(index: usize) -> LoadedPage {
+        LoadedPage {
+            image: PageImage::Static(Arc::new(egui::ColorImage::new(
+                PAGE_SIZE,
+                egui::Color32::GRAY,
+            ))),
+            index,
+            filename: format!("{index:03}.png"),
+        }
+    }
+
+    /// Run decoder threads that insert pages as fast as they can next to one reader that
+    /// looks pages up once per frame, and print how long the reader's lookups took.
+    fn contend(label: &str, put: impl Fn(usize, LoadedPage) + Sync, frame: impl Fn(usize) + Sync) {
+        let decoders = std::thread::available_parallelism().map_or(2, |n| n.get().max(3) - 1);
+        let stop = AtomicBool::new(false);
+        let inserted = AtomicU64::new(0);
+        let mut lookups = Vec::new();
+        std::thread::scope(|scope| {
+            for decoder in 0..decoders {
+                let (put, stop, inserted) = (&put, &stop, &inserted);
+                scope.spawn(move || {
+                    let mut index = decoder;
+                    while !stop.load(Ordering::Relaxed) {
+                        put(index % PAGES, page(index % PAGES));
+                        inserted.fetch_add(1, Ordering::Relaxed);
+                        index += decoders;
+                    }
+                });
+            }
+            let start = Instant::now();
+            let mut n = 0;
+            while start.elapsed() < RUN_FOR {
+                let began = Instant::now();
+                frame(n);
+                lookups.push(began.elapsed());
+                n += 1;
+                std::thread::sleep(FRAME.saturating_sub(began.elapsed()));
+            }
+            stop.store(true, Ordering::Relaxed);
+        });
+
+        lookups.sort();
+        let at = |q: f64| lookups[((lookups.len() - 1) as f64 * q) as usize];
+        println!(
+            "{label}: {decoders} decoders, {} pages inserted, {} frames, lookups per frame \
+             p50 {:?} p99 {:?} max {:?}",
+            inserted.load(Ordering::Relaxed),
+            lookups.len(),
+            at(0.5),
+            at(0.99),
+            lookups[lookups.len() - 1]
+        );
+    }
+
+    /// Frame lookups against decode workers inserting 32 MiB pages, compared with the
+    /// single mutex-guarded LRU the cache replaced. Run with
+    /// `cargo test --release -p comic_reader -- --ignored --nocapture published_lookups`.
+    #[test]
+    #[ignore]
+    fn published_lookups_under_insert_contention() {
+        let cache = ImageCache::new(BUDGET);
+        contend(
+            "published",
+            |index, loaded| cache.put(index, loaded),
+            |frame| {
+                // The reader turns a page four times a second.
+                let current = frame / 36 % PAGES;
+                cache.pin(current..current + 2);
+                cache.get(&current);
+                cache.get(&(current + 1));
+                cache.peek(&(current + 2));
+                cache.contains(&(current + 3));
+                cache.trim();
+            },
+        );
+
+        let capacity = NonZeroUsize::new(BUDGET / (PAGE_SIZE[0] * PAGE_SIZE[1] * 4)).unwrap();
+        let locked = Mutex::new(LruCache::<usize, Arc<LoadedPage>>::new(capacity));
+        contend(
+            "mutex",
+            |index, loaded| {
+                locked.lock().unwrap().put(index, Arc::new(loaded));
+            },
+            |frame| {
+                let current = frame / 36 % PAGES;
+                let mut lru = locked.lock().unwrap();
+                lru.get(&current);
+                lru.get(&(current + 1));
+                lru.peek(&(current + 2));
+                lru.contains(&(current + 3));
+            },
+        );
+    }
 }
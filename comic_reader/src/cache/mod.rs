@@ -2,4 +2,5 @@
 
 pub mod image_cache;
 pub mod texture_cache;
+pub mod two_queue;
 pub use image_cache::*;
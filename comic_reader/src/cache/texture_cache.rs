@@ -1,76 +1,55 @@
 //! Texture cache for egui.
 
 use crate::prelude::*;
-use std::collections::HashMap;
 
-/// Key for a cached texture (page index and zoom).
-#[derive(Clone, PartialEq)]
-pub struct TextureKey {
-    pub page_idx: usize,
-    pub zoom: f32,
-}
-
-/// A cached page texture.
-pub struct PageTexture {
-    pub key: TextureKey,
-    pub handle: TextureHandle,
-}
+/// Page textures are sampled with mipmaps, so pages drawn smaller than their size do not
+/// alias. Zoom is applied by the GPU at draw time and never needs a new texture.
+const PAGE_TEXTURE_OPTIONS: egui::TextureOptions = egui::TextureOptions {
+    mipmap_mode: Some(egui::TextureFilter::Linear),
+    ..egui::TextureOptions::LINEAR
+};
 
-/// Texture cache for single and dual page modes.
+/// Full-resolution textures of recently shown pages, keyed by page index only. Enough
+/// are kept for the current, previous and next spreads, so zooming and turning back and
+/// forth reuse textures instead of uploading the page again.
 pub struct TextureCache {
-    pub single: Option<PageTexture>,
-    pub dual: Option<(PageTexture, Option<PageTexture>)>,
-    pub animated: HashMap<String, TextureHandle>, // Add this line
+    pages: LruCache<usize, TextureHandle>,
 }
 
 impl TextureCache {
     pub fn new() -> Self {
         debug!("TextureCache created");
         Self {
-            single: None,
-            dual: None,
-            animated: HashMap::new(), // Initialize the new field
+            pages: LruCache::new(NonZeroUsize::new(TEXTURE_CACHE_PAGES).unwrap()),
         }
     }
 
-    pub fn get_single(&self, page_idx: usize, zoom: f32) -> Option<&TextureHandle> {
-        if let Some(pt) = &self.single {
-            if pt.key.page_idx == page_idx && (pt.key.zoom - zoom).abs() < f32::EPSILON {
-                debug!("TextureCache hit: single page {} @ zoom {}", page_idx, zoom);
-                return Some(&pt.handle);
-            }
+    /// The texture of a static page, uploading it on first use. `None` for animations,
+    /// whose frames are textures already.
+    pub fn get_or_upload(
+        &mut self,
+        ctx: &egui::Context,
+        loaded: &LoadedPage,
+    ) -> Option<TextureHandle> {
+        let PageImage::Static(img) = &loaded.image else {
+            return None;
+        };
+        if let Some(handle) = self.pages.get(&loaded.index) {
+            return Some(handle.clone());
         }
-        debug!(
-            "TextureCache miss: single page {} @ zoom {}",
-            page_idx, zoom
+        debug!("TextureCache upload: page {}", loaded.index);
+        // The pixels were converted by the decode worker; uploading shares them.
+        let handle = ctx.load_texture(
+            format!("page{}", loaded.index),
+            img.clone(),
+            PAGE_TEXTURE_OPTIONS,
         );
-        None
-    }
-
-    pub fn set_single(&mut self, page_idx: usize, zoom: f32, handle: TextureHandle) {
-        debug!("TextureCache set: single page {} @ zoom {}", page_idx, zoom);
-        self.single = Some(PageTexture {
-            key: TextureKey { page_idx, zoom },
-            handle,
-        });
-    }
-
-    /*
-    /// Get cached animated GIF frame texture by key.
-    pub fn get_animated(&self, key: &str) -> Option<&TextureHandle> {
-        self.animated.get(key)
-    }
-
-    /// Set cached animated GIF frame texture by key.
-    pub fn set_animated(&mut self, key: String, handle: TextureHandle) {
-        self.animated.insert(key, handle);
+        self.pages.put(loaded.index, handle.clone());
+        Some(handle)
     }
-    */
 
     pub fn clear(&mut self) {
         debug!("TextureCache cleared");
-        self.single = None;
-        self.dual = None;
-        self.animated.clear(); // Clear animated cache as well
+        self.pages.clear();
     }
 }
@@ -0,0 +1,347 @@
+//! Scan-resistant replacement policy for the page cache.
+//!
+//! A 2Q variant: pages enter a probation queue and move to a protected queue when they
+//! are used again, so a burst of pages seen once (scrolling the thumbnail grid of a web
+//! archive) only churns probation and leaves the pages around the reading position alone.
+//! Eviction takes from probation while it holds more than its share of the budget, and
+//! from protected otherwise. Keys recently evicted from probation are remembered as
+//! ghosts, and a page that comes back after one goes straight to protected. A range of
+//! pinned pages, the current view and read-ahead, is never evicted.
+
+use crate::prelude::*;
+use std::ops::Range;
+
+/// Keys of evicted probation pages remembered for admission. About as many pages as the
+/// cache holds: a longer history lets a second scan over old pages into protected.
+const GHOSTS: usize = 32;
+/// Probation is evicted first while it holds more than 1/N of the budget.
+const PROBATION_SHARE: usize = 2;
+
+pub struct TwoQueue<V> {
+    probation: LruCache<usize, (V, usize)>,
+    protected: LruCache<usize, (V, usize)>,
+    ghosts: LruCache<usize, ()>,
+    probation_bytes: usize,
+    protected_bytes: usize,
+    pinned: Range<usize>,
+}
+
+impl<V> TwoQueue<V> {
+    pub fn new() -> Self {
+        Self {
+            probation: LruCache::unbounded(),
+            protected: LruCache::unbounded(),
+            ghosts: LruCache::new(NonZeroUsize::new(GHOSTS).unwrap()),
+            probation_bytes: 0,
+            protected_bytes: 0,
+            pinned: 0..0,
+        }
+    }
+
+    /// Look up a page, counting it as used: a page on probation is protected from now on.
+    pub fn get(&mut self, key: &usize) -> Option<&V> {
+        if let Some((value, bytes)) = self.probation.pop(key) {
+            self.probation_bytes -= bytes;
+            self.protected_bytes += bytes;
+            self.protected.put(*key, (value, bytes));
+        }
+        self.protected.get(key).map(|(value, _)| value)
+    }
+
+    /// Look up a page without counting it as used.
+    pub fn peek(&self, key: &usize) -> Option<&V> {
+        self.protected
+            .peek(key)
+            .or_else(|| self.probation.peek(key))
+            .map(|(value, _)| value)
+    }
+
+    pub fn contains(&self, key: &usize) -> bool {
+        self.protected.contains(key) || self.probation.contains(key)
+    }
+
+    /// Add or replace a page of `bytes` size. New pages start on probation unless they
+    /// were evicted from it recently.
+    pub fn put(&mut self, key: usize, value: V, bytes: usize) {
+        if let Some(&(_, old)) = self.protected.peek(&key) {
+            self.protected_bytes = self.protected_bytes - old + bytes;
+            self.protected.put(key, (value, bytes));
+        } else if let Some(&(_, old)) = self.probation.peek(&key) {
+            self.probation_bytes = self.probation_bytes - old + bytes;
+            self.probation.put(key, (value, bytes));
+        } else if self.ghosts.pop(&key).is_some() {
+            self.protected_bytes += bytes;
+            self.protected.put(key, (value, bytes));
+        } else {
+            self.probation_bytes += bytes;
+            self.probation.put(key, (value, bytes));
+        }
+    }
+
+    /// Keep the pages in `pinned` however far over budget the cache is.
+    pub fn pin(&mut self, pinned: Range<usize>) {
+        self.pinned = pinned;
+    }
+
+    /// Evict until the pages fit in `budget` or only pinned pages are left. Returns the
+    /// keys evicted.
+    pub fn evict_to(&mut self, budget: usize) -> Vec<usize> {
+        let mut evicted = Vec::new();
+        while self.bytes() > budget {
+            let probation_first =
+                self.probation_bytes > budget / PROBATION_SHARE || self.protected.is_empty();
+            let victim = if probation_first {
+                self.evict_probation().or_else(|| self.evict_protected())
+            } else {
+                self.evict_protected().or_else(|| self.evict_probation())
+            };
+            let Some(key) = victim else {
+                break;
+            };
+            evicted.push(key);
+        }
+        evicted
+    }
+
+    fn evict_probation(&mut self) -> Option<usize> {
+        let key = self.victim(&self.probation)?;
+        if let Some((_, bytes)) = self.probation.pop(&key) {
+            self.probation_bytes -= bytes;
+            self.ghosts.put(key, ());
+        }
+        Some(key)
+    }
+
+    fn evict_protected(&mut self) -> Option<usize> {
+        let key = self.victim(&self.protected)?;
+        if let Some((_, bytes)) = self.protected.pop(&key) {
+            self.protected_bytes -= bytes;
+        }
+        Some(key)
+    }
+
+    /// The least recently used page of `queue` that is not pinned.
+    fn victim(&self, queue: &LruCache<usize, (V, usize)>) -> Option<usize> {
+        queue
+            .iter()
+            .rev()
+            .map(|(key, _)| *key)
+            .find(|key| !self.pinned.contains(key))
+    }
+
+    pub fn clear(&mut self) {
+        self.probation.clear();
+        self.protected.clear();
+        self.ghosts.clear();
+        self.probation_bytes = 0;
+        self.protected_bytes = 0;
+    }
+
+    pub fn len(&self) -> usize {
+        self.probation.len() + self.protected.len()
+    }
+
+    pub fn bytes(&self) -> usize {
+        self.probation_bytes + self.protected_bytes
+    }
+
+    /// Bytes held by pages on probation.
+    pub fn probation_bytes(&self) -> usize {
+        self.probation_bytes
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const PAGE: usize = 100;
+    const BUDGET: usize = 10 * PAGE;
+
+    fn scan(cache: &mut TwoQueue<()>, pages: Range<usize>) {
+        for page in pages {
+            cache.put(page, (), PAGE);
+            cache.evict_to(BUDGET);
+        }
+    }
+
+    #[test]
+    fn scan_leaves_hot_pages_alone() {
+        let mut cache = TwoQueue::new();
+        for page in 0..4 {
+            cache.put(page, (), PAGE);
+        }
+        for page in 0..4 {
+            assert!(cache.get(&page).is_some());
+        }
+        scan(&mut cache, 100..400);
+        assert!((0..4).all(|page| cache.contains(&page)));
+        assert!(cache.bytes() <= BUDGET);
+    }
+
+    #[test]
+    fn scan_leaves_pinned_pages_alone() {
+        let mut cache = TwoQueue::new();
+        cache.pin(50..53);
+        for page in 50..53 {
+            cache.put(page, (), PAGE);
+        }
+        scan(&mut cache, 100..400);
+        assert!((50..53).all(|page| cache.contains(&page)));
+
+        cache.evict_to(0);
+        assert_eq!(cache.len(), 3);
+    }
+
+    #[test]
+    fn page_evicted_from_probation_comes_back_protected() {
+        let mut cache = TwoQueue::new();
+        scan(&mut cache, 0..20);
+        assert!(!cache.contains(&0));
+        cache.put(0, (), PAGE);
+        assert_eq!(cache.probation_bytes(), cache.bytes() - PAGE);
+        scan(&mut cache, 100..400);
+        assert!(cache.contains(&0));
+    }
+
+    /// A reader access in a replayed trace.
+    enum Access {
+        /// The reader shows a page; `after_scroll` if it looks back after a grid scroll.
+        Read { page: usize, after_scroll: bool },
+        /// A page is decoded without being shown: read-ahead or a grid scroll.
+        Load(usize),
+    }
+
+    const TRACE_PAGES: usize = 400;
+    const READ_AHEAD: usize = 4;
+    /// About 40 pages, the cache of a reader with a few hundred MB to spare.
+    const TRACE_BUDGET: usize = 40 * PAGE;
+    /// Pages decoded by each grid scroll, more than the budget holds.
+    const SCROLL: usize = 60;
+
+    /// Decoded page sizes vary from half to one and a half `PAGE`.
+    fn page_bytes(page: usize) -> usize {
+        PAGE / 2 + page.wrapping_mul(2_654_435_761) % PAGE
+    }
+
+    /// Read through the pages with read-ahead. Every 15 pages, scroll the grid over a
+    /// pseudo-random region, then look back at the last 3 pages read.
+    fn trace() -> Vec<Access> {
+        let mut state = 0x2545_F491_4F6C_DD1Du64;
+        let mut trace = Vec::new();
+        for page in 0..TRACE_PAGES {
+            trace.push(Access::Read {
+                page,
+                after_scroll: false,
+            });
+            trace.extend((1..=READ_AHEAD).map(|ahead| Access::Load(page + ahead)));
+            if page % 15 == 14 {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                let start = state as usize % TRACE_PAGES;
+                trace.extend((start..start + SCROLL).map(|p| Access::Load(p % TRACE_PAGES)));
+                trace.extend((1..=3).map(|back| Access::Read {
+                    page: page - back,
+                    after_scroll: true,
+                }));
+            }
+        }
+        trace
+    }
+
+    /// Hits and reads, overall and after scrolls.
+    #[derive(Default)]
+    struct HitRate {
+        hits: usize,
+        reads: usize,
+        hits_after_scroll: usize,
+        reads_after_scroll: usize,
+    }
+
+    impl HitRate {
+        fn count(&mut self, hit: bool, after_scroll: bool) {
+            self.hits += hit as usize;
+            self.reads += 1;
+            if after_scroll {
+                self.hits_after_scroll += hit as usize;
+                self.reads_after_scroll += 1;
+            }
+        }
+
+        fn percent(hits: usize, reads: usize) -> f64 {
+            100.0 * hits as f64 / reads as f64
+        }
+    }
+
+    fn replay_two_queue(trace: &[Access]) -> HitRate {
+        let mut cache = TwoQueue::new();
+        let mut rate = HitRate::default();
+        for access in trace {
+            match *access {
+                Access::Read { page, after_scroll } => {
+                    if !after_scroll {
+                        cache.pin(page..page + READ_AHEAD + 1);
+                    }
+                    let hit = cache.get(&page).is_some();
+                    rate.count(hit, after_scroll);
+                    if !hit {
+                        cache.put(page, (), page_bytes(page));
+                        cache.get(&page);
+                    }
+                }
+                Access::Load(page) => {
+                    if !cache.contains(&page) {
+                        cache.put(page, (), page_bytes(page));
+                    }
+                }
+            }
+            cache.evict_to(TRACE_BUDGET);
+        }
+        rate
+    }
+
+    fn replay_lru(trace: &[Access]) -> HitRate {
+        let mut cache = LruCache::<usize, usize>::unbounded();
+        let mut bytes = 0;
+        let mut rate = HitRate::default();
+        for access in trace {
+            match *access {
+                Access::Read { page, after_scroll } => {
+                    let hit = cache.get(&page).is_some();
+                    rate.count(hit, after_scroll);
+                    if !hit {
+                        cache.put(page, page_bytes(page));
+                        bytes += page_bytes(page);
+                    }
+                }
+                Access::Load(page) => {
+                    if !cache.contains(&page) {
+                        cache.put(page, page_bytes(page));
+                        bytes += page_bytes(page);
+                    }
+                }
+            }
+            while bytes > TRACE_BUDGET {
+                let (_, evicted) = cache.pop_lru().unwrap();
+                bytes -= evicted;
+            }
+        }
+        rate
+    }
+
+    #[test]
+    fn replayed_reading_with_grid_scrolls_beats_lru() {
+        let trace = trace();
+        let two_queue = replay_two_queue(&trace);
+        let lru = replay_lru(&trace);
+        println!(
+            "hit rate: 2Q {:.1}%, LRU {:.1}%; after grid scrolls: 2Q {:.1}%, LRU {:.1}%",
+            HitRate::percent(two_queue.hits, two_queue.reads),
+            HitRate::percent(lru.hits, lru.reads),
+            HitRate::percent(two_queue.hits_after_scroll, two_queue.reads_after_scroll),
+            HitRate::percent(lru.hits_after_scroll, lru.reads_after_scroll),
+        );
+        assert!(two_queue.hits_after_scroll > lru.hits_after_scroll);
+    }
+}
@@ -1,12 +1,20 @@
 //! Application-wide configuration constants.
 
+use std::time::Duration;
+
 pub const NAME: &str = concat!("Comic Reader ", env!("CARGO_PKG_VERSION"));
 /// Default window width.
 pub const WIN_WIDTH: f32 = 720.0;
 /// Default window height.
 pub const WIN_HEIGHT: f32 = 1080.0;
-/// Number of images to keep in cache.
-pub const CACHE_SIZE: usize = 20;
+/// Most bytes of decoded pages to keep in memory.
+pub const IMAGE_CACHE_BUDGET: usize = 1024 * 1024 * 1024;
+/// The image cache budget is never cut below this by low memory.
+pub const IMAGE_CACHE_MIN_BUDGET: usize = 64 * 1024 * 1024;
+/// Under memory pressure the image cache keeps at most 1/N of available memory.
+pub const IMAGE_CACHE_MEMORY_SHARE: usize = 4;
+/// How often the image cache checks available memory.
+pub const IMAGE_CACHE_MEMORY_CHECK: Duration = Duration::from_secs(2);
 /// Border size for image display.
 // pub const BORDER_SIZE: f32 = 100.0;
 /// Margin between pages in dual mode.
@@ -17,6 +25,8 @@ pub const DEFAULT_DUAL_PAGE_MODE: bool = false;
 pub const DEFAULT_RIGHT_TO_LEFT: bool = false;
 /// Whether reading direction affects arrow keys.
 // pub const READING_DIRECTION_AFFECTS_ARROWS: bool = true;
+/// Page textures kept on the GPU: the current, previous and next two-page spreads.
+pub const TEXTURE_CACHE_PAGES: usize = 6;
 /// How many pages ahead to pre-cache.
 pub const READ_AHEAD: usize = 16;
 pub const READ_AHEAD_WEB: usize = 4;
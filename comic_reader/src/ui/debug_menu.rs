@@ -20,6 +20,10 @@ impl CBZViewerApp {
                     ui.separator();
                     self.debug_lru_cache(ui);
                     ui.separator();
+                    self.debug_extract_store(ui);
+                    ui.separator();
+                    self.debug_web_link(ui);
+                    ui.separator();
                     self.debug_ram_usage(ui);
                     // ui.separator();
                     // self.debug_network_usage(ui);
@@ -83,12 +87,15 @@ impl CBZViewerApp {
                 .color(Color32::from_rgb(0, 220, 255))
                 .strong(),
             |ui| {
-                let image_lru = self.image_lru.lock().unwrap();
+                let image_lru = &self.image_lru;
                 ui.label(
-                    RichText::new(format!("Entries: {}", image_lru.len()))
-                        .color(Color32::LIGHT_BLUE),
+                    RichText::new(format!(
+                        "Entries: {}, evictions: {}",
+                        image_lru.len(),
+                        image_lru.evictions()
+                    ))
+                    .color(Color32::LIGHT_BLUE),
                 );
-                let mut total_lru_bytes = 0usize;
 
                 egui::Grid::new("lru_cache_grid")
                     .striped(true)
@@ -99,10 +106,9 @@ impl CBZViewerApp {
                         ui.label(RichText::new("\u{f1b2} MB").strong());
                         ui.end_row();
 
-                        for (k, v) in image_lru.iter() {
+                        for (k, v) in image_lru.pages() {
                             let (w, h) = v.image.dimensions();
-                            let bytes = (w as usize) * (h as usize) * 4; // RGBA8
-                            total_lru_bytes += bytes;
+                            let bytes = v.image.bytes();
                             ui.label(RichText::new(format!("{k}")).color(Color32::YELLOW));
                             ui.label(format!("{}x{}", w, h));
                             ui.label(
@@ -116,9 +122,10 @@ impl CBZViewerApp {
                 ui.separator();
                 ui.label(
                     RichText::new(format!(
-                        "\u{f1ec} Total: {} bytes ({:.2} MB)",
-                        total_lru_bytes,
-                        total_lru_bytes as f64 / (1024.0 * 1024.0)
+                        "\u{f1ec} Total: {:.2} MB of {:.2} MB ({:.2} MB on probation)",
+                        image_lru.bytes() as f64 / (1024.0 * 1024.0),
+                        image_lru.budget() as f64 / (1024.0 * 1024.0),
+                        image_lru.probation_bytes() as f64 / (1024.0 * 1024.0)
                     ))
                     .color(Color32::from_rgb(0, 200, 0))
                     .strong(),
@@ -127,6 +134,81 @@ impl CBZViewerApp {
         );
     }
 
+    fn debug_extract_store(&self, ui: &mut egui::Ui) {
+        ui.collapsing(
+            RichText::new("\u{f1c6} 7z Extracted Pages")
+                .color(Color32::from_rgb(200, 120, 255))
+                .strong(),
+            |ui| {
+                let stats = SevenZipImageArchive::extract_stats();
+                egui::Grid::new("extract_store_grid")
+                    .striped(true)
+                    .show(ui, |ui| {
+                        ui.label(RichText::new("Hits").strong());
+                        ui.label(format!("{}", stats.hits));
+                        ui.end_row();
+                        ui.label(RichText::new("Misses").strong());
+                        ui.label(format!("{}", stats.misses));
+                        ui.end_row();
+                        ui.label(RichText::new("Evictions").strong());
+                        ui.label(format!("{}", stats.evictions));
+                        ui.end_row();
+                        ui.label(RichText::new("Hit rate").strong());
+                        ui.label(format!("{:.1}%", stats.hit_rate() * 100.0));
+                        ui.end_row();
+                    });
+
+                ui.separator();
+                ui.label(
+                    RichText::new(format!(
+                        "\u{f1ec} On disk: {:.2} MB of {:.2} MB",
+                        stats.bytes as f64 / (1024.0 * 1024.0),
+                        stats.budget as f64 / (1024.0 * 1024.0)
+                    ))
+                    .color(Color32::from_rgb(0, 200, 0))
+                    .strong(),
+                );
+            },
+        );
+    }
+
+    fn debug_web_link(&self, ui: &mut egui::Ui) {
+        ui.collapsing(
+            RichText::new("\u{f0ac} Web Downloads")
+                .color(Color32::from_rgb(100, 200, 255))
+                .strong(),
+            |ui| {
+                let client = WebClient::shared();
+                let Some(estimate) = client.estimate() else {
+                    ui.label("Nothing downloaded yet.");
+                    return;
+                };
+                egui::Grid::new("web_link_grid")
+                    .striped(true)
+                    .show(ui, |ui| {
+                        ui.label(RichText::new("Latency").strong());
+                        ui.label(format!("{:.0} ms", estimate.latency * 1000.0));
+                        ui.end_row();
+                        ui.label(RichText::new("Throughput").strong());
+                        ui.label(format!(
+                            "{:.2} MB/s",
+                            estimate.throughput / (1024.0 * 1024.0)
+                        ));
+                        ui.end_row();
+                        ui.label(RichText::new("Page size").strong());
+                        ui.label(format!("{:.0} KB", estimate.page_bytes / 1024.0));
+                        ui.end_row();
+                        ui.label(RichText::new("Prefetch window").strong());
+                        ui.label(format!(
+                            "{} pages",
+                            client.prefetch_window().unwrap_or_default()
+                        ));
+                        ui.end_row();
+                    });
+            },
+        );
+    }
+
     fn debug_ram_usage(&self, ui: &mut egui::Ui) {
         ui.heading(
             RichText::new("\u{f5dc} RAM Usage")
@@ -42,7 +42,6 @@ impl CBZViewerApp {
                     ctx.input(|i| i.raw_scroll_delta.y),
                     0.05,
                     10.0,
-                    &mut self.texture_cache, // pass cursor_pos here
                     &mut self.has_initialised_zoom,
                 );
             }
@@ -53,7 +52,7 @@ impl CBZViewerApp {
 
     pub fn display_manifest_editor(&mut self, ctx: &egui::Context) {
         if let Some(archive_mutex) = &self.archive {
-            if let Ok(mut archive) = archive_mutex.lock() {
+            if let Ok(mut archive) = archive_mutex.write() {
                 if !self.loading_pages.lock().unwrap().is_empty() && self.total_pages > 0 {
                     if let Ok(mut logger) = self.ui_logger.lock() {
                         logger.warn(
@@ -172,9 +171,9 @@ impl CBZViewerApp {
             let response = ui.allocate_rect(image_area, egui::Sense::click_and_drag());
             response_opt = Some(response.clone());
 
-            // Load images from image_lru with a short lock scope
+            // Look up the pages on screen; the cache hands out shared handles without locking
             let (loaded1, loaded2, single_loaded) = {
-                let mut image_lru = self.image_lru.lock().unwrap();
+                let image_lru = &self.image_lru;
                 let page1 = self.current_page;
                 let page2 = if page1 + 1 < total_pages {
                     page1 + 1
@@ -183,15 +182,14 @@ impl CBZViewerApp {
                 };
 
                 (
-                    image_lru.get(&page1).cloned(),
+                    image_lru.get(&page1),
                     if page2 != usize::MAX {
-                        image_lru.get(&page2).cloned()
+                        image_lru.get(&page2)
                     } else {
                         None
                     },
-                    image_lru.get(&page1).cloned(),
+                    image_lru.get(&page1),
                 )
-                // lock dropped here
             };
 
             // Determine total size for clamping pan
@@ -227,7 +225,7 @@ impl CBZViewerApp {
                 clamp_pan(self, total_size, image_area);
             }
 
-            // Drawing happens after image_lru lock is dropped and pan handled
+            // Drawing happens after pan is handled
             if self.double_page_mode {
                 if let (Some(l1), Some(l2)) = (&loaded1, &loaded2) {
                     if !self.has_initialised_zoom {
@@ -276,6 +274,15 @@ impl CBZViewerApp {
                     draw_spinner(ui, image_area);
                 }
             }
+
+            // Upload the next spread ahead of time, so turning the page reuses its textures.
+            let step = if self.double_page_mode { 2 } else { 1 };
+            let next = self.current_page + step..(self.current_page + 2 * step).min(total_pages);
+            for page in next {
+                if let Some(loaded) = self.image_lru.peek(&page) {
+                    self.texture_cache.get_or_upload(ctx, &loaded);
+                }
+            }
         });
 
         response_opt.expect("Central panel UI always provides a response")
@@ -18,29 +18,15 @@ pub fn draw_spinner(ui: &mut Ui, area: Rect) {
 macro_rules! draw_static {
     ($ui:expr, $loaded:expr, $area:expr, $zoom:expr, $pan:expr, $cache:expr, $disp_size:ident, $handle:ident) => {{
         let (w, h) = match &$loaded.image {
-            PageImage::Static(img) => img.dimensions(),
+            PageImage::Static(img) => (img.size[0], img.size[1]),
             _ => return,
         };
         let $disp_size = Vec2::new(w as f32 * $zoom, h as f32 * $zoom);
 
+        // The texture is full resolution; the GPU scales it to the zoomed size.
         let ctx = $ui.ctx().clone();
-        let $handle = if let Some(handle) = $cache.get_single($loaded.index, $zoom) {
-            handle.clone()
-        } else {
-            let color_img = match &$loaded.image {
-                PageImage::Static(img) => egui::ColorImage::from_rgba_unmultiplied(
-                    [w as usize, h as usize],
-                    &img.to_rgba8(),
-                ),
-                _ => return,
-            };
-            let handle = ctx.load_texture(
-                format!("tex{}_{}", $loaded.index, $zoom),
-                color_img,
-                egui::TextureOptions::default(),
-            );
-            $cache.set_single($loaded.index, $zoom, handle.clone());
-            handle
+        let Some($handle) = $cache.get_or_upload(&ctx, $loaded) else {
+            return;
         };
 
         let rect = Rect::from_center_size($area.center() + $pan, $disp_size);
@@ -159,25 +145,9 @@ pub fn draw_dual_page(
     ) -> Option<(Vec2, Option<egui::TextureHandle>)> {
         match &page.image {
             PageImage::Static(img) => {
-                let (w, h) = img.dimensions();
+                let [w, h] = img.size;
                 let disp_size = Vec2::new(w as f32 * zoom, h as f32 * zoom);
-                let handle = if let Some(h) = cache.get_single(page.index, zoom) {
-                    Some(h.clone())
-                } else {
-                    let rgba_bytes = img.to_rgba8();
-                    let color_img = egui::ColorImage::from_rgba_unmultiplied(
-                        [w as usize, h as usize],
-                        rgba_bytes.as_flat_samples().as_slice(),
-                    );
-                    let h = ctx.load_texture(
-                        format!("tex{}_{}", page.index, zoom),
-                        color_img,
-                        egui::TextureOptions::default(),
-                    );
-                    cache.set_single(page.index, zoom, h.clone());
-                    Some(h)
-                };
-                Some((disp_size, handle))
+                Some((disp_size, cache.get_or_upload(ctx, page)))
             }
             PageImage::AnimatedGif { frames, .. } if !frames.is_empty() => {
                 let [w, h] = frames[0].size();
@@ -421,7 +391,6 @@ pub fn handle_zoom(
     scroll_delta_y: f32,
     min_zoom: f32,
     max_zoom: f32,
-    texture_cache: &mut TextureCache,
     has_initialised_zoom: &mut bool,
 ) -> bool {
     if scroll_delta_y.abs() < f32::EPSILON {
@@ -445,7 +414,6 @@ pub fn handle_zoom(
 
         *pan_offset = (*pan_offset - cursor_rel) * effective_factor + cursor_rel;
         *has_initialised_zoom = true;
-        texture_cache.clear();
         return true;
     }
 
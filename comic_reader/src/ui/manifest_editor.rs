@@ -73,7 +73,7 @@ impl<'a> ManifestEditor<'a> {
 
             ui.checkbox(&mut manifest.meta.web_archive, "Web Archive");
 
-            let mut num_pages = self.archive.list_images().len();
+            let mut num_pages = self.archive.pages().len();
 
             // External Page URLs
             if manifest.meta.web_archive {
@@ -27,7 +27,6 @@ pub fn ui_zoom_slider(app: &mut CBZViewerApp, ui: &mut Ui) {
         app.zoom = 1.0;
         app.pan_offset = Vec2::ZERO;
         app.has_initialised_zoom = false;
-        app.texture_cache.clear();
     }
 }
 
@@ -108,7 +107,6 @@ pub fn ui_navigation(app: &mut CBZViewerApp, ui: &mut Ui) {
         .clicked()
     {
         app.right_to_left = !app.right_to_left;
-        app.texture_cache.clear();
     }
 
     if ui
@@ -120,14 +118,12 @@ pub fn ui_navigation(app: &mut CBZViewerApp, ui: &mut Ui) {
             app.double_page_mode = false;
             app.current_page = app.current_page.min(app.total_pages.saturating_sub(1));
             app.has_initialised_zoom = false;
-            app.texture_cache.clear();
         } else {
             if app.current_page > 0 && app.current_page % 2 != 0 {
                 app.current_page -= 1;
             }
             app.double_page_mode = true;
             app.has_initialised_zoom = false;
-            app.texture_cache.clear();
         }
     }
     if ui
@@ -158,7 +154,6 @@ pub fn ui_navigation(app: &mut CBZViewerApp, ui: &mut Ui) {
             if app.current_page + 1 < app.total_pages {
                 app.current_page += 1;
                 app.has_initialised_zoom = false;
-                app.texture_cache.clear();
             }
         }
     }
@@ -1,4 +1,7 @@
+use crate::cache::image_cache::LoadingGuard;
 use crate::prelude::*;
+use image::imageops::FilterType;
+use std::io::Cursor;
 
 impl CBZViewerApp {
     pub fn display_thumbnail_grid(&mut self, ctx: &egui::Context) {
@@ -36,172 +39,7 @@ impl CBZViewerApp {
                                 if ui.is_rect_visible(rect.1)
                                     && !self.thumbnail_cache.lock().unwrap().contains_key(&page_idx)
                                 {
-                                    let archive = self.archive.clone();
-                                    let cache = self.thumbnail_cache.clone();
-                                    let semaphore = self.thumb_semaphore.clone();
-                                    let page_idx_copy = page_idx;
-                                    let thumb_size_copy = thumb_size;
-                                    let is_web_archive = self.is_web_archive;
-                                    let image_lru = self.image_lru.clone();
-
-                                    // Clone the filename while holding the lock, then drop the guard before spawn
-                                    let filename = {
-                                        let archive_ref = archive.as_ref().unwrap();
-                                        let guard = archive_ref.lock().unwrap();
-                                        guard.list_images().get(page_idx_copy).cloned()
-                                    };
-
-                                    if let Some(filename) = filename {
-                                        tokio::spawn(async move {
-                                            let _permit = semaphore.acquire().await.unwrap();
-
-                                            // Lock the archive, get the image bytes synchronously, then drop the lock before .await
-                                            let img_data = {
-                                                let archive_ref = archive.as_ref().unwrap();
-                                                let mut guard = archive_ref.lock().unwrap();
-                                                guard.backend.read_image_by_name_sync(&filename)
-                                            };
-
-                                            if let Ok(img_data) = img_data {
-                                                // Detect GIF by magic bytes
-                                                let is_gif = img_data.starts_with(b"GIF87a")
-                                                    || img_data.starts_with(b"GIF89a");
-                                                let img_result = if is_gif {
-                                                    use image::AnimationDecoder;
-                                                    use image::codecs::gif::GifDecoder;
-                                                    use std::io::Cursor;
-                                                    let cursor = Cursor::new(&*img_data);
-                                                    if let Ok(decoder) = GifDecoder::new(cursor) {
-                                                        if let Ok(frames) =
-                                                            decoder.into_frames().collect_frames()
-                                                        {
-                                                            if let Some(frame) = frames.get(0) {
-                                                                Some(image::DynamicImage::from(
-                                                                    frame.clone().into_buffer(),
-                                                                ))
-                                                            } else {
-                                                                None
-                                                            }
-                                                        } else {
-                                                            None
-                                                        }
-                                                    } else {
-                                                        None
-                                                    }
-                                                } else {
-                                                    image::load_from_memory(&img_data).ok()
-                                                };
-                                                let filename_clone = filename.clone();
-                                                let is_web_archive = is_web_archive;
-                                                let image_lru = image_lru.clone();
-                                                if let Some(img) = img_result {
-                                                    // If this is a webarchive, add to LRU cache
-                                                    if is_web_archive {
-                                                        use crate::cache::image_cache::PageImage;
-                                                        let mut lru = image_lru.lock().unwrap();
-                                                        lru.put(page_idx_copy, crate::cache::image_cache::LoadedPage {
-                                                            image: PageImage::Static(img.clone()),
-                                                            filename: filename_clone,
-                                                            index: page_idx_copy.clone(),
-                                                        });
-                                                    }
-                                                    // Always resize to thumbnail size before caching
-                                                    let thumb = img.resize_exact(
-                                                        thumb_size_copy,
-                                                        thumb_size_copy,
-                                                        image::imageops::FilterType::Lanczos3,
-                                                    );
-                                                    let mut cache_guard = cache.lock().unwrap();
-                                                    cache_guard.insert(page_idx_copy, thumb);
-                                                }
-                                            }
-                                        });
-                                    }
-                                } else {
-                                    // Before spawning the async loader:
-                                    if !self.thumbnail_cache.lock().unwrap().contains_key(&page_idx) {
-                                        // Try LRU cache first
-                                        if let Some(lru_entry) = self.image_lru.lock().unwrap().get(&page_idx) {
-                                            if let PageImage::Static(ref dyn_img) = lru_entry.image {
-                                                let thumb = dyn_img.resize_exact(
-                                                    thumb_size,
-                                                    thumb_size,
-                                                    image::imageops::FilterType::Lanczos3,
-                                                );
-                                                self.thumbnail_cache.lock().unwrap().insert(page_idx, thumb);
-                                            } else {
-                                                // If it's not a static image, skip or handle other variants as needed
-                                            }
-                                        } else {
-                                            let archive = self.archive.clone();
-                                            let cache = self.thumbnail_cache.clone();
-                                            let semaphore = self.thumb_semaphore.clone();
-                                            let page_idx_copy = page_idx;
-                                            let thumb_size_copy = thumb_size;
-
-                                            // Clone the filename while holding the lock, then drop the guard before spawn
-                                            let filename = {
-                                                let archive_ref = archive.as_ref().unwrap();
-                                                let guard = archive_ref.lock().unwrap();
-                                                guard.list_images().get(page_idx_copy).cloned()
-                                            };
-
-                                            if let Some(filename) = filename {
-                                                tokio::spawn(async move {
-                                                    let _permit = semaphore.acquire().await.unwrap();
-
-                                                    // Lock the archive, get the image bytes synchronously, then drop the lock before .await
-                                                    let img_data = {
-                                                        let archive_ref = archive.as_ref().unwrap();
-                                                        let mut guard = archive_ref.lock().unwrap();
-                                                        guard.backend.read_image_by_name_sync(&filename)
-                                                    };
-
-                                                    if let Ok(img_data) = img_data {
-                                                        // Detect GIF by magic bytes
-                                                        let is_gif = img_data.starts_with(b"GIF87a")
-                                                            || img_data.starts_with(b"GIF89a");
-                                                        let img_result = if is_gif {
-                                                            use image::AnimationDecoder;
-                                                            use image::codecs::gif::GifDecoder;
-                                                            use std::io::Cursor;
-                                                            let cursor = Cursor::new(&*img_data);
-                                                            if let Ok(decoder) = GifDecoder::new(cursor) {
-                                                                if let Ok(frames) =
-                                                                    decoder.into_frames().collect_frames()
-                                                                {
-                                                                    if let Some(frame) = frames.get(0) {
-                                                                        Some(image::DynamicImage::from(
-                                                                            frame.clone().into_buffer(),
-                                                                        ))
-                                                                    } else {
-                                                                        None
-                                                                    }
-                                                                } else {
-                                                                    None
-                                                                }
-                                                            } else {
-                                                                None
-                                                            }
-                                                        } else {
-                                                            image::load_from_memory(&img_data).ok()
-                                                        };
-
-                                                        if let Some(img) = img_result {
-                                                            // Always resize to thumbnail size before caching
-                                                            let thumb = img.resize_exact(
-                                                                thumb_size_copy,
-                                                                thumb_size_copy,
-                                                                image::imageops::FilterType::Lanczos3,
-                                                            );
-                                                            let mut cache_guard = cache.lock().unwrap();
-                                                            cache_guard.insert(page_idx_copy, thumb);
-                                                        }
-                                                    }
-                                                });
-                                            }
-                                        }
-                                    }
+                                    self.request_thumbnail(page_idx, thumb_size);
                                 }
 
                                 // Always show spinner until the thumbnail is loaded
@@ -284,4 +122,74 @@ impl CBZViewerApp {
             });
         });
     }
+
+    /// Make the thumbnail of a page in the background, from the decoded page if it is
+    /// cached and by reading the page otherwise. Decoding and resizing run on the blocking
+    /// pool, so the UI thread never touches full-size pixels.
+    fn request_thumbnail(&self, page_idx: usize, thumb_size: u32) {
+        let cached = self.image_lru.peek(&page_idx);
+        let backend = self.archive.as_ref().map(|a| a.read().unwrap().backend());
+        let filename = self
+            .pages
+            .as_ref()
+            .and_then(|p| p.get(page_idx))
+            .map(|entry| entry.name.clone());
+        let (Some(backend), Some(filename)) = (backend, filename) else {
+            return;
+        };
+        let Some(guard) = LoadingGuard::claim(page_idx, self.thumbnails_loading.clone()) else {
+            return;
+        };
+        let cache = self.thumbnail_cache.clone();
+        let semaphore = self.thumb_semaphore.clone();
+        let image_lru = self.image_lru.clone();
+        let is_web_archive = self.is_web_archive;
+
+        tokio::spawn(async move {
+            let _guard = guard;
+            let _permit = semaphore.acquire().await.unwrap();
+
+            let thumb = if let Some(loaded) = cached {
+                tokio::task::spawn_blocking(move || loaded.image.thumbnail(thumb_size)).await
+            } else {
+                let Ok(img_data) = backend.read_image_by_name(&filename).await else {
+                    return;
+                };
+                tokio::task::spawn_blocking(move || {
+                    let img = decode_first_frame(&img_data)?;
+                    // If this is a webarchive, add the page to the LRU cache as well
+                    if is_web_archive {
+                        let image = PageImage::from_dynamic(img);
+                        let thumb = image.thumbnail(thumb_size);
+                        image_lru.put(
+                            page_idx,
+                            LoadedPage {
+                                image,
+                                filename,
+                                index: page_idx,
+                            },
+                        );
+                        thumb
+                    } else {
+                        Some(img.resize_exact(thumb_size, thumb_size, FilterType::Lanczos3))
+                    }
+                })
+                .await
+            };
+            if let Ok(Some(thumb)) = thumb {
+                cache.lock().unwrap().insert(page_idx, thumb);
+            }
+        });
+    }
+}
+
+/// Decode a page for its thumbnail. Animated GIFs give their first frame.
+fn decode_first_frame(data: &[u8]) -> Option<DynamicImage> {
+    if data.starts_with(b"GIF87a") || data.starts_with(b"GIF89a") {
+        let decoder = GifDecoder::new(Cursor::new(data)).ok()?;
+        let frame = decoder.into_frames().next()?.ok()?;
+        Some(DynamicImage::from(frame.into_buffer()))
+    } else {
+        image::load_from_memory(data).ok()
+    }
 }
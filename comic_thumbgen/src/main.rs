@@ -22,7 +22,7 @@ async fn main() {
     let image_name = args.get(3);
 
     // FIX: Await the async process method
-    let mut archive = match ImageArchive::process(Path::new(archive_path)).await {
+    let archive = match ImageArchive::process(Path::new(archive_path)).await {
         Ok(a) => a,
         Err(e) => {
             eprintln!("Failed to open archive: {e}");
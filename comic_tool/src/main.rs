@@ -0,0 +1,167 @@
+use comic_archive::prelude::*;
+use std::env;
+use std::path::{Path, PathBuf};
+
+/// Pages downloaded at once by `mirror` unless given.
+const MIRROR_PARALLEL: usize = 4;
+
+fn print_usage() {
+    eprintln!("Usage:");
+    eprintln!("  comic_tool split <comic.cbz> <pages_per_volume> [output_dir]");
+    eprintln!("  comic_tool merge <output.cbz> <volume.cbz>...");
+    eprintln!("  comic_tool extract <comic.cbz> <first_page> <last_page> <output.cbz>");
+    eprintln!("  comic_tool compact <comic.cbz>");
+    eprintln!("  comic_tool mirror <web_comic.cbz> [parallel_downloads]");
+    eprintln!("Page numbers start at 1 and ranges are inclusive.");
+    eprintln!("Entries are copied as-is, without recompressing.");
+}
+
+fn open(path: &str) -> ZipImageArchive {
+    match ZipImageArchive::new(Path::new(path)) {
+        Ok(archive) => archive,
+        Err(e) => {
+            eprintln!("Failed to open archive {path}: {e}");
+            std::process::exit(2);
+        }
+    }
+}
+
+fn parse_number(arg: &str, what: &str) -> usize {
+    match arg.parse::<usize>() {
+        Ok(n) if n > 0 => n,
+        _ => {
+            eprintln!("Invalid {what}: {arg}");
+            std::process::exit(1);
+        }
+    }
+}
+
+fn check(result: Result<(), ArchiveError>, what: &str) {
+    if let Err(e) = result {
+        eprintln!("Failed to {what}: {e}");
+        std::process::exit(3);
+    }
+}
+
+fn split(args: &[String]) {
+    if args.len() < 2 {
+        print_usage();
+        std::process::exit(1);
+    }
+    let archive = open(&args[0]);
+    let per_volume = parse_number(&args[1], "page count");
+    let source = Path::new(&args[0]);
+    let output_dir = args
+        .get(2)
+        .map(PathBuf::from)
+        .or_else(|| source.parent().map(Path::to_path_buf))
+        .unwrap_or_default();
+    let stem = source
+        .file_stem()
+        .and_then(|s| s.to_str())
+        .unwrap_or("volume");
+
+    let page_count = archive.pages().len();
+    let volumes = page_count.div_ceil(per_volume);
+    let width = volumes.to_string().len().max(2);
+    for volume in 0..volumes {
+        let start = volume * per_volume;
+        let end = (start + per_volume).min(page_count);
+        let indices: Vec<usize> = (start..end).collect();
+        let dest = output_dir.join(format!("{stem}_v{:0width$}.cbz", volume + 1));
+        check(archive.extract_pages(&indices, &dest), "write volume");
+        println!("Wrote pages {}-{} to {}", start + 1, end, dest.display());
+    }
+}
+
+fn merge(args: &[String]) {
+    if args.len() < 2 {
+        print_usage();
+        std::process::exit(1);
+    }
+    let volumes: Vec<ZipImageArchive> = args[1..].iter().map(|path| open(path)).collect();
+    check(
+        ZipImageArchive::merge(&volumes, Path::new(&args[0])),
+        "merge volumes",
+    );
+    println!("Merged {} volumes into {}", volumes.len(), args[0]);
+}
+
+fn extract(args: &[String]) {
+    if args.len() < 4 {
+        print_usage();
+        std::process::exit(1);
+    }
+    let archive = open(&args[0]);
+    let first = parse_number(&args[1], "first page");
+    let last = parse_number(&args[2], "last page");
+    let page_count = archive.pages().len();
+    if first > last || last > page_count {
+        eprintln!("Page range {first}-{last} is outside 1-{page_count}.");
+        std::process::exit(1);
+    }
+    let indices: Vec<usize> = (first - 1..last).collect();
+    check(
+        archive.extract_pages(&indices, Path::new(&args[3])),
+        "extract pages",
+    );
+    println!("Wrote pages {first}-{last} to {}", args[3]);
+}
+
+fn compact(args: &[String]) {
+    if args.is_empty() {
+        print_usage();
+        std::process::exit(1);
+    }
+    let archive = open(&args[0]);
+    check(archive.compact(), "compact archive");
+    println!("Compacted {}", args[0]);
+}
+
+fn mirror(args: &[String]) {
+    if args.is_empty() {
+        print_usage();
+        std::process::exit(1);
+    }
+    let archive = open(&args[0]);
+    let parallel = args
+        .get(1)
+        .map_or(MIRROR_PARALLEL, |arg| parse_number(arg, "download count"));
+    let manifest = match archive.read_manifest_sync() {
+        Ok(manifest) if manifest.meta.web_archive => manifest,
+        Ok(_) => {
+            eprintln!("{} is not a web archive.", args[0]);
+            std::process::exit(1);
+        }
+        Err(e) => {
+            eprintln!("Failed to read manifest of {}: {e}", args[0]);
+            std::process::exit(2);
+        }
+    };
+    let web = WebImageArchive::new(archive, manifest);
+    check(
+        web.mirror(parallel, |done, total| println!("Saved {done}/{total} pages")),
+        "mirror pages",
+    );
+    println!("Mirrored {} into a local archive", args[0]);
+}
+
+fn main() {
+    let args: Vec<String> = env::args().collect();
+    if args.len() < 2 {
+        print_usage();
+        std::process::exit(1);
+    }
+
+    match args[1].as_str() {
+        "split" => split(&args[2..]),
+        "merge" => merge(&args[2..]),
+        "extract" => extract(&args[2..]),
+        "compact" => compact(&args[2..]),
+        "mirror" => mirror(&args[2..]),
+        _ => {
+            print_usage();
+            std::process::exit(1);
+        }
+    }
+}